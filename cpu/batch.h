@@ -0,0 +1,197 @@
+#pragma once
+
+#include "parser.h"
+#include "verifier.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace Cpu {
+    // Runs a fixed set of tasks on worker threads. Tasks are dealt out to the
+    // workers' own deques up front; a worker takes tasks from the back of its
+    // deque and, once it is empty, steals from the front of the others, so
+    // long tasks do not leave the other threads idle.
+    class WorkStealingPool {
+    public:
+        explicit WorkStealingPool(size_t threads = std::thread::hardware_concurrency())
+            : threads_(threads == 0 ? 1 : threads), steals_(0) {
+        }
+
+        size_t Threads() const {
+            return threads_;
+        }
+
+        // Tasks taken from another worker's deque over all runs
+        size_t Steals() const {
+            return steals_;
+        }
+
+        // Calls task(i) for every i in [0, count) and returns when all are done
+        void Run(size_t count, const std::function<void(size_t)>& task) {
+            std::vector<Queue> queues(threads_);
+            for (size_t i = 0; i < count; ++i) {
+                queues[i % threads_].tasks.push_back(i);
+            }
+            std::vector<std::thread> workers;
+            for (size_t worker = 1; worker < threads_; ++worker) {
+                workers.emplace_back([&, worker] {
+                    Work(&queues, worker, task);
+                });
+            }
+            Work(&queues, 0, task);
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<size_t> tasks;
+        };
+
+        // No tasks are added while running, so a worker is done once a pass
+        // over every deque finds nothing
+        void Work(std::vector<Queue>* queues, size_t worker, const std::function<void(size_t)>& task) {
+            while (true) {
+                size_t index = 0;
+                bool found = false;
+                for (size_t i = 0; i < queues->size() && !found; ++i) {
+                    Queue& queue = (*queues)[(worker + i) % queues->size()];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    if (queue.tasks.empty()) {
+                        continue;
+                    }
+                    if (i == 0) {
+                        index = queue.tasks.back();
+                        queue.tasks.pop_back();
+                    } else {
+                        index = queue.tasks.front();
+                        queue.tasks.pop_front();
+                        ++steals_;
+                    }
+                    found = true;
+                }
+                if (!found) {
+                    return;
+                }
+                task(index);
+            }
+        }
+
+        size_t threads_;
+        std::atomic<size_t> steals_;
+    };
+
+    struct BatchJob {
+        std::string program;
+        std::string input;
+        std::string output;
+    };
+
+    // Reads a manifest with one job per line: the compiled program, its input
+    // file and its output file, separated by spaces. Empty lines and lines
+    // starting with '#' are skipped.
+    std::vector<BatchJob> ReadManifest(std::istream& in) {
+        std::vector<BatchJob> jobs;
+        std::string line;
+        for (size_t number = 1; std::getline(in, line); ++number) {
+            std::stringstream fields(line);
+            BatchJob job;
+            if (!(fields >> job.program) || job.program[0] == '#') {
+                continue;
+            }
+            std::string extra;
+            if (!(fields >> job.input >> job.output) || fields >> extra) {
+                errx(1, "Manifest line %zu: program, input and output files expected", number);
+            }
+            jobs.push_back(job);
+        }
+        return jobs;
+    }
+
+    struct BatchStats {
+        size_t jobs = 0;
+        size_t failed = 0;
+        size_t steals = 0;
+        double seconds = 0;
+    };
+
+    // Runs every job on its own Cpu, with its own Memory and BufferedIo over
+    // its files. Each distinct program is mapped and verified once and shared
+    // read-only by all of its jobs; verified programs run without operand
+    // stack checks. A job that faults or cannot open its files or its
+    // program is counted as failed and reported on stderr; the others go on.
+    BatchStats RunBatch(const std::vector<BatchJob>& jobs, Engine engine, WorkStealingPool* pool) {
+        std::map<std::string, std::unique_ptr<MappedProgram>> programs;
+        std::map<std::string, Verification> verifications;
+        for (const auto& job : jobs) {
+            if (programs.count(job.program)) {
+                continue;
+            }
+            auto& program = programs[job.program];
+            std::string error;
+            program = MappedProgram::Open(job.program.c_str(), &error);
+            if (!program) {
+                // Left null, its jobs fail
+                warnx("%s", error.c_str());
+                continue;
+            }
+            verifications[job.program] = Verify(DecodedProgram(program->Data()));
+        }
+
+        std::atomic<size_t> failed(0);
+        auto start = std::chrono::steady_clock::now();
+        pool->Run(jobs.size(), [&](size_t i) {
+            const BatchJob& job = jobs[i];
+            if (!programs.at(job.program)) {
+                warnx("Job %zu: no program %s", i, job.program.c_str());
+                ++failed;
+                return;
+            }
+            int in = open(job.input.c_str(), O_RDONLY);
+            int out = open(job.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (in < 0 || out < 0) {
+                warn("Job %zu: failed to open %s", i, in < 0 ? job.input.c_str() : job.output.c_str());
+                ++failed;
+            } else {
+                BufferCommandsReader reader(programs.at(job.program)->Data());
+                const Verification& verification = verifications.at(job.program);
+                BufferedIo io(in, out);
+                try {
+                    if (verification.verified) {
+                        VerifiedCpu cpu(reader, Memory(), &io);
+                        cpu.ReserveStack(verification.max_stack);
+                        cpu.Run(engine);
+                    } else {
+                        Cpu cpu(reader, Memory(), &io);
+                        cpu.Run(engine);
+                    }
+                } catch (const MemoryFault& fault) {
+                    warnx("Job %zu: memory fault: %s", i, fault.what());
+                    ++failed;
+                }
+            }
+            if (in >= 0) {
+                close(in);
+            }
+            if (out >= 0) {
+                close(out);
+            }
+        });
+
+        BatchStats stats;
+        stats.jobs = jobs.size();
+        stats.failed = failed;
+        stats.steals = pool->Steals();
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+} // namespace Cpu
@@ -0,0 +1,444 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <malloc.h>
+#include <sstream>
+#include <sys/resource.h>
+#include "compiler.h"
+#include "verifier.h"
+
+// Benchmark suite of the VM: every workload on every engine, operand stack
+// and memory policy, with commands per second, time per command and peak
+// RSS. Run from the build directory, as the tests are.
+//
+// Usage: cpu_bench [--format=table|csv|json] [--repeat=N] [--only=WORKLOAD]
+//                  [--engine=ENGINE] [--stack=fast|checked|fixed]
+
+// Monitor counting the commands the decoded engine runs
+class CommandCounter {
+public:
+    void Start(const Cpu::DecodedProgram& program) {
+        UNUSED(program);
+    }
+
+    template <class Stack>
+    bool Step(uint32_t index, const Stack& stack, const double* regs, const int64_t* iregs) {
+        UNUSED(index);
+        UNUSED(stack);
+        UNUSED(regs);
+        UNUSED(iregs);
+        ++count_;
+        return true;
+    }
+
+    void Jump(uint32_t from, uint32_t to) {
+        UNUSED(from);
+        UNUSED(to);
+    }
+
+    void Stop(bool halted) {
+        UNUSED(halted);
+    }
+
+    uint64_t Count() const {
+        return count_;
+    }
+
+private:
+    uint64_t count_ = 0;
+};
+
+struct Workload {
+    const char* name;
+    std::string program;
+    // The program is run once for every input
+    std::vector<std::string> inputs;
+    // Cells of flat memory the program needs
+    size_t flat_cells;
+    // Operand stack a verified program needs, or 0 if it is not verified
+    size_t max_stack;
+};
+
+struct Measurement {
+    uint64_t commands;
+    double milliseconds;
+    // Peak resident set during the runs, in kilobytes
+    long peak_rss;
+};
+
+std::string CompileProgram(const char* filename) {
+    std::ifstream in(filename);
+    if (!in) {
+        errx(1, "Run from the build directory: %s not found", filename);
+    }
+    return Cpu::Compile(in);
+}
+
+std::string CompileText(const std::string& text) {
+    std::stringstream in(text);
+    return Cpu::Compile(in);
+}
+
+// The text program with every $N replaced by the number
+std::string Repeat(std::string text, size_t count) {
+    for (size_t at = 0; (at = text.find("$N", at)) != std::string::npos;) {
+        text.replace(at, 2, std::to_string(count));
+    }
+    return text;
+}
+
+std::vector<Workload> MakeWorkloads() {
+    std::vector<Workload> workloads;
+    workloads.push_back({"fib", CompileProgram("../cpu/test_programs/fib.txt"), {"25\n"}, 1, 0});
+    workloads.push_back({"fib_call", CompileProgram("../cpu/test_programs/fib_call.txt"), {"25\n"}, 1, 0});
+
+    // Many short runs, like a program used as a function
+    std::vector<std::string> equations;
+    srand(20);
+    for (int i = 0; i < 5000; ++i) {
+        equations.push_back(std::to_string(rand() % 21 - 10) + "\n" + std::to_string(rand() % 21 - 10) + "\n" +
+                            std::to_string(rand() % 21 - 10) + "\n");
+    }
+    workloads.push_back({"square_solver", CompileProgram("../cpu/test_programs/square_solver.txt"), equations,
+                         1, 0});
+
+    // Fills an array and sums it over and over
+    const size_t array_cells = 1 << 20;
+    workloads.push_back({"array_sum", CompileText(Repeat(
+        "iset IAX 0\n"
+        ":fill\n"
+        "ipush IAX\n"
+        "pop [IAX]\n"
+        "iadd IAX 1\n"
+        "ijb IAX $N fill\n"
+        "push 0\n"
+        "iset ICX 0\n"
+        ":pass\n"
+        "iset IAX 0\n"
+        ":sum\n"
+        "push [IAX]\n"
+        "add\n"
+        "iadd IAX 1\n"
+        "ijb IAX $N sum\n"
+        "iadd ICX 1\n"
+        "ijb ICX 4 pass\n"
+        "out\n"
+        "hlt\n", array_cells)), {""}, array_cells, 0});
+
+    // Steps a linear congruential generator and branches on its sign, which
+    // the processor cannot predict
+    workloads.push_back({"branches", CompileText(Repeat(
+        "iset IAX 12345\n"
+        "iset ICX 0\n"
+        "push 0\n"
+        ":loop\n"
+        "push 6364136223846793005\n"
+        "imul IAX\n"
+        "iadd IAX 1442695040888963407\n"
+        "ija IAX 0 up\n"
+        "sub 1\n"
+        "jmp next\n"
+        ":up\n"
+        "add 1\n"
+        ":next\n"
+        "iadd ICX 1\n"
+        "ijb ICX $N loop\n"
+        "out\n"
+        "hlt\n", 1000000)), {""}, 1, 0});
+
+    // Doubles every number of the input
+    const size_t numbers = 200000;
+    std::string input;
+    for (size_t i = 0; i < numbers; ++i) {
+        input += std::to_string(i * 0.25) + "\n";
+    }
+    workloads.push_back({"io", CompileText(Repeat(
+        "iset ICX 0\n"
+        ":loop\n"
+        "in\n"
+        "mul 2\n"
+        "out\n"
+        "iadd ICX 1\n"
+        "ijb ICX $N loop\n"
+        "hlt\n", numbers)), {input}, 1, 0});
+
+    for (Workload& workload : workloads) {
+        Cpu::Verification verification = Cpu::Verify(Cpu::DecodedProgram(workload.program.data()));
+        if (verification.verified) {
+            workload.max_stack = verification.max_stack;
+        }
+    }
+    return workloads;
+}
+
+// Peak RSS is kept per process: clearing it lets every measurement report its
+// own. Kernels without clear_refs report the peak of the whole run instead.
+void ResetPeakRss() {
+    // Hands memory freed by earlier runs back, so it does not count
+    malloc_trim(0);
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) < 0) {
+            // Keeps the peak so far
+        }
+        close(fd);
+    }
+}
+
+long PeakRss() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return atol(line.c_str() + 6);
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// All inputs in one file, so that the one a run starts at is a seek away
+class Inputs {
+public:
+    explicit Inputs(const std::vector<std::string>& inputs) : file_(tmpfile()) {
+        if (!file_) {
+            err(1, "Failed to create the input file");
+        }
+        size_t offset = 0;
+        for (const std::string& input : inputs) {
+            if (pwrite(fileno(file_), input.data(), input.size(), offset) != ssize_t(input.size())) {
+                err(1, "Failed to write the input");
+            }
+            offsets_.push_back(offset);
+            offset += input.size();
+        }
+    }
+
+    Inputs(const Inputs&) = delete;
+    Inputs& operator=(const Inputs&) = delete;
+
+    ~Inputs() {
+        fclose(file_);
+    }
+
+    int Fd() const {
+        return fileno(file_);
+    }
+
+    const std::vector<size_t>& Offsets() const {
+        return offsets_;
+    }
+
+private:
+    FILE* file_;
+    std::vector<size_t> offsets_;
+};
+
+template <class CpuType>
+void Prepare(CpuType& cpu, const Workload& workload) {
+    UNUSED(cpu);
+    UNUSED(workload);
+}
+
+void Prepare(Cpu::VerifiedCpu& cpu, const Workload& workload) {
+    cpu.ReserveStack(workload.max_stack);
+}
+
+template <class CpuType>
+double RunAll(const Workload& workload, const Inputs& inputs, Cpu::Engine engine, bool flat, int null_fd) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t offset : inputs.Offsets()) {
+        lseek(inputs.Fd(), offset, SEEK_SET);
+        Cpu::BufferCommandsReader reader(workload.program.data());
+        Cpu::BufferedIo io(inputs.Fd(), null_fd);
+        CpuType cpu(reader, flat ? Cpu::Memory::Flat(workload.flat_cells) : Cpu::Memory(), &io);
+        Prepare(cpu, workload);
+        cpu.Run(engine);
+    }
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(finish - start).count();
+}
+
+uint64_t CountCommands(const Workload& workload, const Inputs& inputs, int null_fd) {
+    uint64_t commands = 0;
+    for (size_t offset : inputs.Offsets()) {
+        lseek(inputs.Fd(), offset, SEEK_SET);
+        Cpu::BufferCommandsReader reader(workload.program.data());
+        Cpu::BufferedIo io(inputs.Fd(), null_fd);
+        Cpu::BasicCpu<Cpu::CpuStack, CommandCounter> cpu(reader, Cpu::Memory(), &io);
+        cpu.Run(Cpu::Engine::DECODED);
+        commands += cpu.GetMonitor().Count();
+    }
+    return commands;
+}
+
+// Best time of repeat runs
+template <class CpuType>
+Measurement Measure(const Workload& workload, const Inputs& inputs, Cpu::Engine engine, bool flat, int repeat,
+                    uint64_t commands, int null_fd) {
+    ResetPeakRss();
+    double best = 0;
+    for (int i = 0; i < repeat; ++i) {
+        double milliseconds = RunAll<CpuType>(workload, inputs, engine, flat, null_fd);
+        best = i == 0 ? milliseconds : std::min(best, milliseconds);
+    }
+    return {commands, best, PeakRss()};
+}
+
+enum class Format {
+    TABLE,
+    CSV,
+    JSON
+};
+
+void Report(Format format, bool first, const Workload& workload, const char* engine, const char* stack,
+            const char* memory, const Measurement& measurement) {
+    double seconds = measurement.milliseconds / 1e3;
+    double per_second = measurement.commands / seconds;
+    double ns = measurement.milliseconds * 1e6 / measurement.commands;
+    unsigned long long commands = measurement.commands;
+    switch (format) {
+        case Format::TABLE:
+            if (first) {
+                printf("%-14s %-9s %-8s %-6s %12s %10s %12s %10s %10s\n", "workload", "engine", "stack", "memory",
+                       "commands", "ms", "Mcommands/s", "ns/command", "peak KB");
+            }
+            printf("%-14s %-9s %-8s %-6s %12llu %10.2f %12.1f %10.2f %10ld\n", workload.name, engine, stack,
+                   memory, commands, measurement.milliseconds, per_second / 1e6, ns, measurement.peak_rss);
+            break;
+        case Format::CSV:
+            if (first) {
+                printf("workload,engine,stack,memory,commands,ms,commands_per_second,ns_per_command,peak_rss_kb\n");
+            }
+            printf("%s,%s,%s,%s,%llu,%.3f,%.0f,%.3f,%ld\n", workload.name, engine, stack, memory, commands,
+                   measurement.milliseconds, per_second, ns, measurement.peak_rss);
+            break;
+        case Format::JSON:
+            printf("%s  {\"workload\": \"%s\", \"engine\": \"%s\", \"stack\": \"%s\", \"memory\": \"%s\", "
+                   "\"commands\": %llu, \"ms\": %.3f, \"commands_per_second\": %.0f, \"ns_per_command\": %.3f, "
+                   "\"peak_rss_kb\": %ld}", first ? "[\n" : ",\n", workload.name, engine, stack, memory, commands,
+                   measurement.milliseconds, per_second, ns, measurement.peak_rss);
+            break;
+    }
+    fflush(stdout);
+}
+
+bool Selected(const std::string& filter, const char* name) {
+    return filter.empty() || filter == name;
+}
+
+// Whether the filter is empty or selects one of names
+bool Known(const std::string& filter, const std::vector<const char*>& names) {
+    if (filter.empty()) {
+        return true;
+    }
+    for (const char* name : names) {
+        if (filter == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Usage(const char* program) {
+    errx(1, "Usage: %s [--format=table|csv|json] [--repeat=N] [--only=WORKLOAD] [--engine=ENGINE] "
+            "[--stack=fast|checked|fixed]", program);
+}
+
+int main(int argc, const char** argv) {
+    Format format = Format::TABLE;
+    int repeat = 3;
+    std::string only;
+    std::string only_engine;
+    std::string only_stack;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--format=table") {
+            format = Format::TABLE;
+        } else if (arg == "--format=csv") {
+            format = Format::CSV;
+        } else if (arg == "--format=json") {
+            format = Format::JSON;
+        } else if (arg.compare(0, 9, "--repeat=") == 0 && atoi(arg.c_str() + 9) > 0) {
+            repeat = atoi(arg.c_str() + 9);
+        } else if (arg.compare(0, 7, "--only=") == 0) {
+            only = arg.substr(7);
+        } else if (arg.compare(0, 9, "--engine=") == 0) {
+            only_engine = arg.substr(9);
+        } else if (arg.compare(0, 8, "--stack=") == 0) {
+            only_stack = arg.substr(8);
+        } else {
+            Usage(argv[0]);
+        }
+    }
+
+    const std::pair<const char*, Cpu::Engine> engines[] = {
+        {"switch", Cpu::Engine::SWITCH},
+        {"threaded", Cpu::Engine::THREADED},
+        {"decoded", Cpu::Engine::DECODED},
+        {"jit", Cpu::Engine::JIT},
+    };
+    std::vector<Workload> workloads = MakeWorkloads();
+    // A misspelt name would otherwise measure nothing and still succeed
+    std::vector<const char*> workload_names;
+    for (const Workload& workload : workloads) {
+        workload_names.push_back(workload.name);
+    }
+    std::vector<const char*> engine_names;
+    for (const auto& engine : engines) {
+        engine_names.push_back(engine.first);
+    }
+    if (!Known(only, workload_names) || !Known(only_engine, engine_names) ||
+        !Known(only_stack, {"fast", "checked", "fixed"})) {
+        Usage(argv[0]);
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        err(1, "Failed to open /dev/null");
+    }
+    bool first = true;
+    for (const Workload& workload : workloads) {
+        if (!Selected(only, workload.name)) {
+            continue;
+        }
+        Inputs inputs(workload.inputs);
+        uint64_t commands = CountCommands(workload, inputs, null_fd);
+        for (const auto& engine : engines) {
+            if (!Selected(only_engine, engine.first)) {
+                continue;
+            }
+            for (bool flat : {false, true}) {
+                const char* memory = flat ? "flat" : "paged";
+                if (Selected(only_stack, "fast")) {
+                    Report(format, first, workload, engine.first, "fast", memory,
+                           Measure<Cpu::BasicCpu<FastStack>>(workload, inputs, engine.second, flat, repeat,
+                                                             commands, null_fd));
+                    first = false;
+                }
+                // Checks itself on every command, which makes it far slower
+                // on deep stacks
+                if (Selected(only_stack, "checked")) {
+                    Report(format, first, workload, engine.first, "checked", memory,
+                           Measure<Cpu::BasicCpu<Stack>>(workload, inputs, engine.second, flat, repeat, commands,
+                                                         null_fd));
+                    first = false;
+                }
+                // The unchecked stack is only safe for verified programs
+                if (Selected(only_stack, "fixed") && workload.max_stack > 0) {
+                    Report(format, first, workload, engine.first, "fixed", memory,
+                           Measure<Cpu::VerifiedCpu>(workload, inputs, engine.second, flat, repeat, commands,
+                                                     null_fd));
+                    first = false;
+                }
+            }
+        }
+    }
+    if (format == Format::JSON) {
+        printf(first ? "[]\n" : "\n]\n");
+    }
+    close(null_fd);
+}
@@ -1,23 +1,21 @@
-// COMMAND(NAME, PARAM_CNT, READ, WRITE, CODE)
+// COMMAND(NAME, PARAM_CNT, SYNTAX, CODE)
+//
+// SYNTAX is the assembly form of the command: a mnemonic followed by its
+// operands, where '#' stands for a number and '@' for a label. Both the
+// assembler and the disassembler are generated from it.
+//
+// CODE does control flow only through macros every engine defines:
+// JUMP_ARG(i) jumps to the label operand i, JUMP_TO(pos) jumps to a computed
+// position and NEXT_POSITION() is the position right after this command.
 
 #define NOARG_COMMAND(NAME, name, CODE) \
-COMMAND(NAME, 0, {                      \
-    UNUSED(args);                       \
-    result =  command_line == name;       \
-}, {                                    \
-    UNUSED(args);                       \
-    result =  name;                       \
-}, CODE)
+COMMAND(NAME, 0, name, CODE)
 
 NOARG_COMMAND(HLT, "hlt", {
     UNUSED(args);
 })
 
-COMMAND(PUSH, 1, {
-    result =  ReadSimpleCommand(command_line, "push", 1, args);
-}, {
-    result =  WriteSimpleCommand("push", 1, args);
-}, {
+COMMAND(PUSH, 1, "push #", {
     stack_.Push(args[0]);
 })
 
@@ -36,16 +34,14 @@ NOARG_COMMAND(DUP, "dup", {
 
 NOARG_COMMAND(IN, "in", {
     UNUSED(args);
-    double value = 0;
-    std::cin >> value;
-    stack_.Push(value);
+    stack_.Push(io_->In());
 })
 
 NOARG_COMMAND(OUT, "out", {
     UNUSED(args);
     double value = 0;
     stack_.Pop(&value);
-    std::cout << value << "\n";
+    io_->Out(value);
 })
 
 NOARG_COMMAND(ADD, "add", {
@@ -122,19 +118,11 @@ NOARG_COMMAND(POP_##REG, "pop " #REG, {     \
 
 
 
-COMMAND(PUSH_MEM, 1, {
-    result =  ReadMemCommand(command_line, "push", "[", "]", args);
-}, {
-    result =  WriteMemCommand("push", "[", "]", args);
-}, {
+COMMAND(PUSH_MEM, 1, "push [#]", {
     stack_.Push(mem_.at(args[0]));
 })
 
-COMMAND(POP_MEM, 1, {
-    result =  ReadMemCommand(command_line, "pop", "[", "]", args);
-}, {
-    result =  WriteMemCommand("pop", "[", "]", args);
-}, {
+COMMAND(POP_MEM, 1, "pop [#]", {
     stack_.Pop(&mem_.at(args[0]));
 })
 
@@ -163,11 +151,7 @@ NOARG_COMMAND(POP_MEM_##REG, "pop [" #REG "]", {    \
 //PUSH MEM REG OFFSET
 
 #define REGISTER(REG, NUM)                                                \
-COMMAND(PUSH_MEM_OFFSET_##REG, 1, {                                       \
-    result =  ReadMemCommand(command_line, "push", "[" #REG "+", "]", args); \
-}, {                                                                      \
-    result =  WriteMemCommand("push", "[" #REG "+", "]", args);              \
-}, {                                                                      \
+COMMAND(PUSH_MEM_OFFSET_##REG, 1, "push [" #REG "+#]", {                  \
     stack_.Push(mem_.at(regs_[REG] + args[0]));               \
 })
 
@@ -177,11 +161,7 @@ COMMAND(PUSH_MEM_OFFSET_##REG, 1, {                                       \
 //POP MEM REG OFFSET
 
 #define REGISTER(REG, NUM)                                               \
-COMMAND(POP_MEM_OFFSET_##REG, 1, {                                       \
-    result =  ReadMemCommand(command_line, "pop", "[" #REG "+", "]", args); \
-}, {                                                                     \
-result =  WriteMemCommand("pop", "[" #REG "+", "]", args);                  \
-}, {                                                                     \
+COMMAND(POP_MEM_OFFSET_##REG, 1, "pop [" #REG "+#]", {                   \
     stack_.Pop(&mem_.at(args[0] + regs_[REG]));              \
 })
 
@@ -189,56 +169,254 @@ result =  WriteMemCommand("pop", "[" #REG "+", "]", args);                  \
 #undef REGISTER
 
 #define JUMP_COMMAND(NAME, name, CODE)                          \
-COMMAND(NAME, 1, {                                              \
-    UNUSED(args);                                               \
-    result =  ReadJumpCommand(command_line, name);                 \
-}, {                                                            \
-    UNUSED(args);                                               \
-    result =  std::string(name) + " " + std::to_string(args[0]);   \
-}, CODE)
+COMMAND(NAME, 1, name " @", CODE)
 
 JUMP_COMMAND(JMP, "jmp", {
-    reader_.Jump(args[0]);
+    JUMP_ARG(0);
 })
 
 JUMP_COMMAND(JE, "je", {
-    double first;
-    double second;
+    double first = 0;
+    double second = 0;
     stack_.Pop(&second);
     stack_.Pop(&first);
     if (first == second) {
-        reader_.Jump(args[0]);
+        JUMP_ARG(0);
     }
 })
 
 JUMP_COMMAND(JNE, "jne", {
-    double first;
-    double second;
+    double first = 0;
+    double second = 0;
     stack_.Pop(&second);
     stack_.Pop(&first);
     if (first != second) {
-        reader_.Jump(args[0]);
+        JUMP_ARG(0);
     }
 })
 
 JUMP_COMMAND(JA, "ja", {
-    double first;
-    double second;
+    double first = 0;
+    double second = 0;
     stack_.Pop(&second);
     stack_.Pop(&first);
     if (first > second) {
-        reader_.Jump(args[0]);
+        JUMP_ARG(0);
     }
 })
 
 JUMP_COMMAND(JEXEC, "jexec", {
-    regs_[RDX] = reader_.GetNextPosition();
-    reader_.Jump(args[0]);
+    regs_[RDX] = NEXT_POSITION();
+    JUMP_ARG(0);
 })
 
 NOARG_COMMAND(RET, "ret", {
     UNUSED(args);
-    reader_.Jump(regs_[RDX]);
+    JUMP_TO(regs_[RDX]);
+})
+
+// CALL and RETURN keep return positions on the call stack, so recursive code
+// does not have to save RDX around every call
+
+JUMP_COMMAND(CALL, "call", {
+    calls_.Push(NEXT_POSITION());
+    JUMP_ARG(0);
+})
+
+NOARG_COMMAND(RETURN, "return", {
+    UNUSED(args);
+    JUMP_TO(calls_.Pop());
+})
+
+// Superinstructions emitted by the peephole optimizer
+
+#define IMM_COMMAND(NAME, name, OPERATION)                       \
+COMMAND(NAME, 1, name " #", {                                    \
+    double first = 0;                                            \
+    stack_.Pop(&first);                                          \
+    stack_.Push(first OPERATION args[0]);                        \
+})
+
+IMM_COMMAND(ADD_IMM, "add", +)
+IMM_COMMAND(MUL_IMM, "mul", *)
+IMM_COMMAND(DIV_IMM, "div", /)
+IMM_COMMAND(SUB_IMM, "sub", -)
+
+#undef IMM_COMMAND
+
+#define JUMP_IMM_COMMAND(NAME, name, CONDITION)                    \
+COMMAND(NAME, 2, name " # @", {                                    \
+    double first = 0;                                              \
+    stack_.Pop(&first);                                            \
+    if (first CONDITION args[0]) {                                 \
+        JUMP_ARG(1);                                               \
+    }                                                              \
+})
+
+JUMP_IMM_COMMAND(JE_IMM, "je", ==)
+JUMP_IMM_COMMAND(JNE_IMM, "jne", !=)
+JUMP_IMM_COMMAND(JA_IMM, "ja", >)
+
+#undef JUMP_IMM_COMMAND
+
+//STORE REG: copies the top of the stack into the register
+
+#define REGISTER(REG, NUM)                        \
+NOARG_COMMAND(STORE_##REG, "store " #REG, {       \
+    UNUSED(args);                                 \
+    stack_.Pop(&(regs_[REG]));                    \
+    stack_.Push(regs_[REG]);                      \
+})
+
+#include "registers.h"
+#undef REGISTER
+
+// Integer registers: loop counters and addresses that never go through
+// doubles. Numbers from the stack and immediates are truncated to integers.
+
+#define REGISTER(REG, NUM)
+#define INT_REGISTER(REG, NUM)                                           \
+NOARG_COMMAND(IPUSH_##REG, "ipush " #REG, {                              \
+    UNUSED(args);                                                        \
+    stack_.Push(static_cast<double>(iregs_[REG]));                       \
+})                                                                       \
+                                                                         \
+NOARG_COMMAND(IPOP_##REG, "ipop " #REG, {                                \
+    UNUSED(args);                                                        \
+    double value = 0;                                                    \
+    stack_.Pop(&value);                                                  \
+    iregs_[REG] = DoubleToInt(value);                                    \
+})                                                                       \
+                                                                         \
+COMMAND(ISET_##REG, 1, "iset " #REG " #", {                              \
+    iregs_[REG] = DoubleToInt(args[0]);                                  \
+})                                                                       \
+                                                                         \
+COMMAND(IADD_IMM_##REG, 1, "iadd " #REG " #", {                          \
+    iregs_[REG] = WrappingAdd(iregs_[REG], DoubleToInt(args[0]));        \
+})                                                                       \
+                                                                         \
+INT_STACK_COMMAND(IADD_##REG, "iadd " #REG, REG, WrappingAdd)            \
+INT_STACK_COMMAND(ISUB_##REG, "isub " #REG, REG, WrappingSub)            \
+INT_STACK_COMMAND(IMUL_##REG, "imul " #REG, REG, WrappingMul)            \
+                                                                         \
+INT_JUMP_COMMAND(IJE_##REG, "ije " #REG, REG, ==)                        \
+INT_JUMP_COMMAND(IJNE_##REG, "ijne " #REG, REG, !=)                      \
+INT_JUMP_COMMAND(IJA_##REG, "ija " #REG, REG, >)                         \
+INT_JUMP_COMMAND(IJB_##REG, "ijb " #REG, REG, <)                         \
+                                                                         \
+NOARG_COMMAND(PUSH_MEM_INT_##REG, "push [" #REG "]", {                   \
+    UNUSED(args);                                                        \
+    stack_.Push(mem_.AtIndex(iregs_[REG]));                              \
+})                                                                       \
+                                                                         \
+NOARG_COMMAND(POP_MEM_INT_##REG, "pop [" #REG "]", {                     \
+    UNUSED(args);                                                        \
+    stack_.Pop(&mem_.AtIndex(iregs_[REG]));                              \
+})                                                                       \
+                                                                         \
+COMMAND(PUSH_MEM_INT_OFFSET_##REG, 1, "push [" #REG "+#]", {             \
+    stack_.Push(mem_.AtIndex(WrappingAdd(iregs_[REG], DoubleToInt(args[0])))); \
+})                                                                       \
+                                                                         \
+COMMAND(POP_MEM_INT_OFFSET_##REG, 1, "pop [" #REG "+#]", {               \
+    stack_.Pop(&mem_.AtIndex(WrappingAdd(iregs_[REG], DoubleToInt(args[0])))); \
+})
+
+// Applies OPERATION to the register and the number popped from the stack
+#define INT_STACK_COMMAND(NAME, name, REG, OPERATION)                    \
+NOARG_COMMAND(NAME, name, {                                              \
+    UNUSED(args);                                                        \
+    double value = 0;                                                    \
+    stack_.Pop(&value);                                                  \
+    iregs_[REG] = OPERATION(iregs_[REG], DoubleToInt(value));            \
+})
+
+// Jumps if the register compares to the immediate as CONDITION requires
+#define INT_JUMP_COMMAND(NAME, name, REG, CONDITION)                     \
+COMMAND(NAME, 2, name " # @", {                                          \
+    if (iregs_[REG] CONDITION DoubleToInt(args[0])) {                    \
+        JUMP_ARG(1);                                                     \
+    }                                                                    \
+})
+
+#include "registers.h"
+#undef INT_JUMP_COMMAND
+#undef INT_STACK_COMMAND
+#undef INT_REGISTER
+#undef REGISTER
+
+// Vector commands over ranges of memory. Operands are pushed in the order
+// they are listed, the count last; nothing is done for counts below one.
+// A fault leaves memory unchanged. Ranges that partly overlap give
+// unspecified results.
+
+// vfill: dst value count
+NOARG_COMMAND(VFILL, "vfill", {
+    UNUSED(args);
+    double count = 0;
+    double value = 0;
+    double dst = 0;
+    stack_.Pop(&count);
+    stack_.Pop(&value);
+    stack_.Pop(&dst);
+    VectorFill(&mem_, dst, value, count);
+})
+
+// vadd, vmul: dst x y count, dst[i] = x[i] op y[i]
+#define VECTOR_COMMAND(NAME, name, FUNCTION)                             \
+NOARG_COMMAND(NAME, name, {                                              \
+    UNUSED(args);                                                        \
+    double count = 0;                                                    \
+    double y = 0;                                                        \
+    double x = 0;                                                        \
+    double dst = 0;                                                      \
+    stack_.Pop(&count);                                                  \
+    stack_.Pop(&y);                                                      \
+    stack_.Pop(&x);                                                      \
+    stack_.Pop(&dst);                                                    \
+    FUNCTION(&mem_, dst, x, y, count);                                   \
+})
+
+VECTOR_COMMAND(VADD, "vadd", VectorAdd)
+VECTOR_COMMAND(VMUL, "vmul", VectorMul)
+
+#undef VECTOR_COMMAND
+
+// vaxpy: y a x count, y[i] += a * x[i]
+NOARG_COMMAND(VAXPY, "vaxpy", {
+    UNUSED(args);
+    double count = 0;
+    double x = 0;
+    double a = 0;
+    double y = 0;
+    stack_.Pop(&count);
+    stack_.Pop(&x);
+    stack_.Pop(&a);
+    stack_.Pop(&y);
+    VectorAxpy(&mem_, y, a, x, count);
+})
+
+// vdot: x y count, pushes the dot product
+NOARG_COMMAND(VDOT, "vdot", {
+    UNUSED(args);
+    double count = 0;
+    double y = 0;
+    double x = 0;
+    stack_.Pop(&count);
+    stack_.Pop(&y);
+    stack_.Pop(&x);
+    stack_.Push(VectorDot(&mem_, x, y, count));
+})
+
+// vsum: x count, pushes the sum
+NOARG_COMMAND(VSUM, "vsum", {
+    UNUSED(args);
+    double count = 0;
+    double x = 0;
+    stack_.Pop(&count);
+    stack_.Pop(&x);
+    stack_.Push(VectorSum(&mem_, x, count));
 })
 
 #undef JUMP_COMMAND
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "parser.h"
+#include "sha256.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// Cache of compiled programs in a directory, one file per program named by
+// the SHA-256 of the compiler version, the options and the source text.
+//
+// Entries are written to a temporary file and renamed into place, so readers,
+// other processes included, never see a partial one. The modification time
+// of an entry is the last time it was used: when the directory grows past its
+// size bound, the entries used longest ago are removed first.
+
+namespace Cpu {
+    // Bumped whenever the compiler starts giving other output for the same
+    // source without a change of the program format or the command set
+    const uint32_t COMPILER_REVISION = 2;
+
+    // Everything the output of the compiler depends on besides its input:
+    // the program format, the revision and the syntax of every command
+    std::string CompilerVersion() {
+        std::string version = "program " + std::to_string(PROGRAM_VERSION) + " compiler " +
+                              std::to_string(COMPILER_REVISION) + "\n";
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+        version += #NAME " " SYNTAX "\n";
+
+#include "commands.h"
+
+#undef COMMAND
+        return version;
+    }
+
+    class CompileCache {
+    public:
+        static const size_t DEFAULT_MAX_BYTES = size_t(64) << 20;
+
+        explicit CompileCache(const std::string& directory, size_t max_bytes = DEFAULT_MAX_BYTES)
+            : directory_(directory), max_bytes_(max_bytes), hits_(0), misses_(0), temporaries_(0) {
+            if (mkdir(directory_.c_str(), 0755) < 0 && errno != EEXIST) {
+                err(1, "Failed to create the compile cache %s", directory_.c_str());
+            }
+        }
+
+        // The key of a source compiled with options, which are any flags
+        // that change the output
+        static std::string Key(const std::string& source, uint32_t options) {
+            Sha256 hash;
+            std::string version = CompilerVersion();
+            uint64_t version_size = version.size();
+            hash.Update(&version_size, sizeof(version_size));
+            hash.Update(version);
+            hash.Update(&options, sizeof(options));
+            hash.Update(source);
+            return Sha256::Hex(hash.Finish());
+        }
+
+        // Reads the program stored under the key. Entries that are not a
+        // whole compiled program count as misses and are removed.
+        bool Lookup(const std::string& key, std::string* program) {
+            std::string path = Path(key);
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                ++misses_;
+                return false;
+            }
+            std::string data;
+            char buffer[1 << 16];
+            ssize_t count = 0;
+            while ((count = read(fd, buffer, sizeof(buffer))) > 0 || (count < 0 && errno == EINTR)) {
+                data.append(buffer, std::max<ssize_t>(count, 0));
+            }
+            close(fd);
+            if (count < 0 || !IsProgram(data)) {
+                unlink(path.c_str());
+                ++misses_;
+                return false;
+            }
+            Touch(path);
+            *program = std::move(data);
+            ++hits_;
+            return true;
+        }
+
+        // Stores the program under the key, then evicts down to the size
+        // bound. Failing to write only leaves the program out of the cache.
+        void Store(const std::string& key, const std::string& program) {
+            std::string temporary = directory_ + "/.tmp-" + std::to_string(getpid()) + "-" +
+                                    std::to_string(temporaries_++);
+            int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd < 0) {
+                return;
+            }
+            size_t written = 0;
+            while (written < program.size()) {
+                ssize_t count = write(fd, program.data() + written, program.size() - written);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count <= 0) {
+                    break;
+                }
+                written += count;
+            }
+            if (close(fd) < 0 || written < program.size() || rename(temporary.c_str(), Path(key).c_str()) < 0) {
+                unlink(temporary.c_str());
+                return;
+            }
+            Touch(Path(key));
+            Evict();
+        }
+
+        uint64_t Hits() const {
+            return hits_.load();
+        }
+
+        uint64_t Misses() const {
+            return misses_.load();
+        }
+
+        const std::string& Directory() const {
+            return directory_;
+        }
+
+    private:
+        static const size_t KEY_LENGTH = 64;
+
+        std::string Path(const std::string& key) const {
+            return directory_ + "/" + key + ".bin";
+        }
+
+        static bool IsProgram(const std::string& data) {
+            ProgramHeader header;
+            if (data.size() < sizeof(header)) {
+                return false;
+            }
+            memcpy(&header, data.data(), sizeof(header));
+            if (memcmp(header.magic, PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC)) != 0 || header.version != PROGRAM_VERSION) {
+                return false;
+            }
+            uint64_t length = sizeof(header) + uint64_t(header.constants_count) * sizeof(double) +
+                              uint64_t(header.code_count) * sizeof(Instruction) + header.symbols_size;
+            return length == data.size();
+        }
+
+        // File systems keep coarse timestamps of their own, so the time of use
+        // is set explicitly to tell apart entries used moments apart
+        static void Touch(const std::string& path) {
+            struct timespec times[2];
+            clock_gettime(CLOCK_REALTIME, &times[0]);
+            times[1] = times[0];
+            utimensat(AT_FDCWD, path.c_str(), times, 0);
+        }
+
+        void Evict() {
+            struct Entry {
+                struct timespec used;
+                size_t size;
+                std::string path;
+            };
+            std::vector<Entry> entries;
+            size_t total = 0;
+            DIR* directory = opendir(directory_.c_str());
+            if (!directory) {
+                return;
+            }
+            while (struct dirent* entry = readdir(directory)) {
+                std::string name = entry->d_name;
+                if (name.size() != KEY_LENGTH + 4 || name.compare(KEY_LENGTH, 4, ".bin") != 0) {
+                    continue;
+                }
+                std::string path = directory_ + "/" + name;
+                struct stat statbuf;
+                if (stat(path.c_str(), &statbuf) < 0) {
+                    continue;
+                }
+                entries.push_back({statbuf.st_mtim, size_t(statbuf.st_size), path});
+                total += statbuf.st_size;
+            }
+            closedir(directory);
+            if (total <= max_bytes_) {
+                return;
+            }
+            std::sort(entries.begin(), entries.end(), [](const Entry& first, const Entry& second) {
+                return first.used.tv_sec != second.used.tv_sec ? first.used.tv_sec < second.used.tv_sec
+                                                               : first.used.tv_nsec < second.used.tv_nsec;
+            });
+            for (const Entry& entry : entries) {
+                if (total <= max_bytes_) {
+                    break;
+                }
+                if (unlink(entry.path.c_str()) == 0) {
+                    total -= entry.size;
+                }
+            }
+        }
+
+        std::string directory_;
+        size_t max_bytes_;
+        std::atomic<uint64_t> hits_;
+        std::atomic<uint64_t> misses_;
+        std::atomic<uint64_t> temporaries_;
+    };
+} // namespace Cpu
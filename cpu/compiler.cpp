@@ -1,12 +1,57 @@
 #include <err.h>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <memory>
 #include "compiler.h"
 
+// --cache=DIR keeps compiled programs in DIR, CPU_COMPILE_CACHE names the
+// directory when the flag is not given. --stream writes the program as it is
+// compiled instead of holding it in memory, and does not use the cache.
+// --no-dataflow keeps only the peephole pass of the optimizer.
 int main(int argc, const char** argv) {
-    if (argc != 3) {
+    Cpu::CompileOptions options;
+    std::vector<const char*> files;
+    const char* cache_directory = getenv("CPU_COMPILE_CACHE");
+    size_t cache_size = Cpu::CompileCache::DEFAULT_MAX_BYTES;
+    bool cache_stats = false;
+    bool stream = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--no-optimize") == 0) {
+            options.optimize = false;
+        } else if (strcmp(argv[i], "--no-dataflow") == 0) {
+            options.dataflow = false;
+        } else if (strcmp(argv[i], "--symbols") == 0) {
+            options.symbols = true;
+        } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+            cache_directory = argv[i] + 8;
+        } else if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+            cache_size = strtoull(argv[i] + 13, nullptr, 10);
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            cache_stats = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.size() != 2) {
         errx(1, "Exactly 2 arguments expected: input and output file");
     }
-    std::ifstream in(argv[1]);
-    std::ofstream out(argv[2]);
-    out << Cpu::Compile(in);
-}
\ No newline at end of file
+    std::ifstream in(files[0]);
+    if (stream) {
+        Cpu::CompileToFile(in, files[1], options);
+        return 0;
+    }
+    std::unique_ptr<Cpu::CompileCache> cache;
+    if (cache_directory && *cache_directory) {
+        cache.reset(new Cpu::CompileCache(cache_directory, cache_size));
+        options.cache = cache.get();
+    }
+    std::ofstream out(files[1]);
+    out << Cpu::Compile(in, options);
+    if (cache && cache_stats) {
+        fprintf(stderr, "compile cache: %llu hits, %llu misses\n", (unsigned long long)cache->Hits(),
+                (unsigned long long)cache->Misses());
+    }
+}
@@ -1,51 +1,413 @@
 #pragma once
 
 #include "parser.h"
+#include "compile_cache.h"
+#include "optimizer.h"
+#include <algorithm>
+#include <cstddef>
+#include <err.h>
+#include <fcntl.h>
+#include <iterator>
+#include <sstream>
+#include <unistd.h>
 
 namespace Cpu {
-    std::string Compile(std::istream& in) {
-        Command command = HLT;
+    struct CompileOptions {
+        bool optimize = true;
+        // With optimize, also run the passes over the whole control flow
+        // graph, see GlobalOptimize. The streaming compiler only has the
+        // peephole pass.
+        bool dataflow = true;
+        // Keep label names in the program for Decompile and other tools
+        bool symbols = false;
+        // Take the program from here when the same source was compiled with
+        // the same options before, and store it here otherwise
+        CompileCache* cache = nullptr;
+    };
+
+    AsmProgram Parse(std::istream& in) {
+        AsmProgram program;
+        std::string command_line;
+        while (std::getline(in, command_line)) {
+            if (command_line.empty()) {
+                continue;
+            }
+            if (command_line[0] == ':') {
+                auto result = program.labels.emplace(command_line.substr(1), program.commands.size());
+                assert(result.second);
+                continue;
+            }
+            AsmCommand command = MakeCommand(HLT);
+            bool parsed = ParseCommand(command_line, &command.command, command.args, &command.label);
+            assert(parsed);
+            UNUSED(parsed);
+            program.commands.push_back(command);
+        }
+        return program;
+    }
+
+    template <class T>
+    void AppendRaw(std::string* program, const T* data, size_t count) {
+        program->append(reinterpret_cast<const char*>(data), sizeof(T) * count);
+    }
+
+    // Constant pool of a program being emitted. Equal constants share an
+    // entry, and entry 0 is always 0.
+    class ConstantPool {
+    public:
+        ConstantPool() : constants_({0}), index_({{0, 0}}) {
+        }
+
+        uint32_t Add(double value) {
+            uint64_t bits = 0;
+            memcpy(&bits, &value, sizeof(bits));
+            auto it = index_.emplace(bits, constants_.size());
+            if (it.second) {
+                constants_.push_back(value);
+            }
+            return it.first->second;
+        }
+
+        const double* Data() const {
+            return constants_.data();
+        }
+
+        size_t Size() const {
+            return constants_.size();
+        }
+
+    private:
+        std::vector<double> constants_;
+        std::unordered_map<uint64_t, uint32_t> index_;
+    };
+
+    ProgramHeader MakeHeader(uint32_t constants_count, uint32_t code_count, uint32_t symbols_count,
+                             uint32_t symbols_size) {
+        ProgramHeader header;
+        memcpy(header.magic, PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC));
+        header.version = PROGRAM_VERSION;
+        header.constants_count = constants_count;
+        header.code_count = code_count;
+        header.symbols_count = symbols_count;
+        header.symbols_size = symbols_size;
+        return header;
+    }
+
+    // Symbol table section with the labels in the order of their commands
+    std::string EmitSymbols(const std::unordered_map<std::string, size_t>& source, uint32_t* count) {
+        std::vector<std::pair<size_t, std::string>> labels;
+        for (const auto& label : source) {
+            labels.emplace_back(label.second, label.first);
+        }
+        std::sort(labels.begin(), labels.end());
+        std::string symbol_table;
+        for (const auto& label : labels) {
+            uint32_t index = label.first;
+            AppendRaw(&symbol_table, &index, 1);
+            symbol_table.append(label.second);
+            symbol_table.append(4 - label.second.size() % 4, '\0');
+        }
+        *count = labels.size();
+        return symbol_table;
+    }
+
+    // Lays the program out as described at ProgramHeader. Equal constants
+    // share a pool entry. A HLT is appended unless the program already ends
+    // with one and no label points past it, so running off the end stops.
+    std::string Emit(const AsmProgram& source, bool symbols = false) {
+        ConstantPool constants;
+        std::vector<Instruction> code;
+        code.reserve(source.commands.size() + 1);
+        for (const auto& command : source.commands) {
+            Instruction instruction = {command.command, {}, 0, NO_INDEX};
+            size_t args_count = CommandParamCnt(command.command);
+            if (!command.label.empty()) {
+                auto it = source.labels.find(command.label);
+                assert(it != source.labels.end());
+                instruction.target = it->second;
+                --args_count;
+            }
+            if (args_count > 0) {
+                instruction.constant = constants.Add(command.args[0]);
+            }
+            code.push_back(instruction);
+        }
+        bool label_at_end = false;
+        for (const auto& label : source.labels) {
+            label_at_end |= label.second == source.commands.size();
+        }
+        if (code.empty() || code.back().command != HLT || label_at_end) {
+            code.push_back(Instruction{HLT, {}, 0, NO_INDEX});
+        }
+
+        std::string symbol_table;
+        uint32_t symbols_count = 0;
+        if (symbols) {
+            symbol_table = EmitSymbols(source.labels, &symbols_count);
+        }
+        ProgramHeader header = MakeHeader(constants.Size(), code.size(), symbols_count, symbol_table.size());
+
         std::string program;
-        std::map<std::string, size_t> labels;
-        std::vector<std::pair<size_t, std::string> > places;
-        double args[MAX_ARGS_COUNT];
-        while (in) {
-            std::string command_line;
-            while (in.good() && command_line.empty()) {
-                std::getline(in, command_line);
-                if (!command_line.empty() && command_line[0] == ':') {
-                    auto result = labels.emplace(command_line.substr(1), program.size());
-                    assert(result.second);
-                    command_line.clear();
+        AppendRaw(&program, &header, 1);
+        AppendRaw(&program, constants.Data(), constants.Size());
+        AppendRaw(&program, code.data(), code.size());
+        program.append(symbol_table);
+        return program;
+    }
+
+    std::string Compile(std::istream& in, const CompileOptions& options = CompileOptions()) {
+        if (!options.cache) {
+            AsmProgram program = Parse(in);
+            if (options.optimize && options.dataflow) {
+                GlobalOptimize(&program, options.symbols);
+            } else if (options.optimize) {
+                PeepholeOptimize(&program);
+            }
+            return Emit(program, options.symbols);
+        }
+        std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::string key = CompileCache::Key(source, uint32_t(options.optimize) | uint32_t(options.symbols) << 1 |
+                                                          uint32_t(options.dataflow) << 2);
+        std::string compiled;
+        if (options.cache->Lookup(key, &compiled)) {
+            return compiled;
+        }
+        std::istringstream source_in(source);
+        CompileOptions uncached = options;
+        uncached.cache = nullptr;
+        compiled = Compile(source_in, uncached);
+        options.cache->Store(key, compiled);
+        return compiled;
+    }
+
+    // Compiles straight into a file. Only the labels, the jumps still waiting
+    // for their label and the constant pool stay in memory: instructions are
+    // written as they come, and forward jumps are patched in place once their
+    // label shows up. The code goes right after the header and is moved behind
+    // the constant pool at the end, when the size of the pool is known.
+    class StreamingCompiler {
+    public:
+        StreamingCompiler(const char* path, const CompileOptions& options = CompileOptions())
+            : path_(path), options_(options), code_count_(0), flushed_count_(0), last_command_(HLT),
+              label_at_end_(false) {
+            fd_ = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd_ < 0) {
+                err(1, "Failed to open %s", path);
+            }
+            buffer_.reserve(BUFFER_SIZE);
+        }
+
+        ~StreamingCompiler() {
+            close(fd_);
+        }
+
+        void AddLine(const std::string& command_line) {
+            if (command_line.empty()) {
+                return;
+            }
+            if (command_line[0] == ':') {
+                AddLabel(command_line.substr(1));
+                return;
+            }
+            AsmCommand command = MakeCommand(HLT);
+            bool parsed = ParseCommand(command_line, &command.command, command.args, &command.label);
+            assert(parsed);
+            UNUSED(parsed);
+            if (!options_.optimize) {
+                Write(command);
+                return;
+            }
+            // The peephole pass of Compile over a bounded tail: reductions
+            // reaching further back than the window are given up
+            window_.push_back(command);
+            while (ReduceTail(&window_, 0)) {
+            }
+            if (window_.size() == 2 * WINDOW_SIZE) {
+                for (size_t i = 0; i < WINDOW_SIZE; ++i) {
+                    Write(window_[i]);
                 }
+                window_.erase(window_.begin(), window_.begin() + WINDOW_SIZE);
             }
-            if (in.eof()) {
-                break;
+        }
+
+        void Finish() {
+            FlushWindow();
+            if (code_count_ == 0 || last_command_ != HLT || label_at_end_) {
+                Write(MakeCommand(HLT));
+            }
+            if (!fixups_.empty()) {
+                errx(1, "Undefined label %s", fixups_.begin()->first.c_str());
+            }
+            FlushBuffer();
+
+            size_t code_size = code_count_ * sizeof(Instruction);
+            size_t constants_size = constants_.Size() * sizeof(double);
+            std::vector<char> chunk(CHUNK_SIZE);
+            for (size_t end = code_size; end > 0;) {
+                size_t size = std::min(end, chunk.size());
+                end -= size;
+                ReadAt(chunk.data(), size, sizeof(ProgramHeader) + end);
+                WriteAt(chunk.data(), size, sizeof(ProgramHeader) + constants_size + end);
+            }
+            WriteAt(constants_.Data(), constants_size, sizeof(ProgramHeader));
+
+            std::string symbol_table;
+            uint32_t symbols_count = 0;
+            if (options_.symbols) {
+                symbol_table = EmitSymbols(labels_, &symbols_count);
+            }
+            WriteAt(symbol_table.data(), symbol_table.size(), sizeof(ProgramHeader) + constants_size + code_size);
+            ProgramHeader header = MakeHeader(constants_.Size(), code_count_, symbols_count, symbol_table.size());
+            WriteAt(&header, sizeof(header), 0);
+        }
+
+    private:
+        static const size_t BUFFER_SIZE = 4096;
+        static const size_t WINDOW_SIZE = 64;
+        static const size_t CHUNK_SIZE = 1 << 16;
+
+        void AddLabel(const std::string& label) {
+            FlushWindow();
+            auto result = labels_.emplace(label, code_count_);
+            assert(result.second);
+            UNUSED(result);
+            auto fixups = fixups_.find(label);
+            if (fixups != fixups_.end()) {
+                for (uint32_t index : fixups->second) {
+                    Patch(index, code_count_);
+                }
+                fixups_.erase(fixups);
             }
-            CommandFromString(command_line, &command, args);
+            label_at_end_ = true;
+        }
 
-            if (command_line[0] == 'j') {
-                auto label = GetJumpLabel(command_line);
-                places.emplace_back(program.size() + 1, label);
-                args[0] = 0;
+        void FlushWindow() {
+            for (const auto& command : window_) {
+                Write(command);
             }
-            program.append(reinterpret_cast<const char*>(&command), sizeof(command));
-            program.append(reinterpret_cast<const char*>(args), sizeof(double) * CommandParamCnt(command));
+            window_.clear();
         }
-        for (const auto& place : places) {
-            auto it = labels.find(place.second);
-            assert(it != labels.end());
-            *reinterpret_cast<double*>(&program[place.first]) = it->second;
+
+        void Write(const AsmCommand& command) {
+            Instruction instruction = {command.command, {}, 0, NO_INDEX};
+            size_t args_count = CommandParamCnt(command.command);
+            if (!command.label.empty()) {
+                auto it = labels_.find(command.label);
+                if (it != labels_.end()) {
+                    instruction.target = it->second;
+                } else {
+                    fixups_[command.label].push_back(code_count_);
+                }
+                --args_count;
+            }
+            if (args_count > 0) {
+                instruction.constant = constants_.Add(command.args[0]);
+            }
+            buffer_.push_back(instruction);
+            ++code_count_;
+            last_command_ = command.command;
+            label_at_end_ = false;
+            if (buffer_.size() == BUFFER_SIZE) {
+                FlushBuffer();
+            }
         }
-        return program;
+
+        void Patch(uint32_t index, uint32_t target) {
+            if (index >= flushed_count_) {
+                buffer_[index - flushed_count_].target = target;
+                return;
+            }
+            WriteAt(&target, sizeof(target),
+                    sizeof(ProgramHeader) + index * sizeof(Instruction) + offsetof(Instruction, target));
+        }
+
+        void FlushBuffer() {
+            WriteAt(buffer_.data(), buffer_.size() * sizeof(Instruction),
+                    sizeof(ProgramHeader) + flushed_count_ * sizeof(Instruction));
+            flushed_count_ += buffer_.size();
+            buffer_.clear();
+        }
+
+        void WriteAt(const void* data, size_t size, size_t offset) {
+            const char* bytes = static_cast<const char*>(data);
+            while (size > 0) {
+                ssize_t count = pwrite(fd_, bytes, size, offset);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count <= 0) {
+                    err(1, "Failed to write %s", path_.c_str());
+                }
+                bytes += count;
+                size -= count;
+                offset += count;
+            }
+        }
+
+        void ReadAt(void* data, size_t size, size_t offset) {
+            char* bytes = static_cast<char*>(data);
+            while (size > 0) {
+                ssize_t count = pread(fd_, bytes, size, offset);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count <= 0) {
+                    err(1, "Failed to read %s", path_.c_str());
+                }
+                bytes += count;
+                size -= count;
+                offset += count;
+            }
+        }
+
+        std::string path_;
+        CompileOptions options_;
+        int fd_;
+        ConstantPool constants_;
+        std::unordered_map<std::string, size_t> labels_;
+        // Instructions waiting for each label that is not defined yet
+        std::unordered_map<std::string, std::vector<uint32_t>> fixups_;
+        std::vector<AsmCommand> window_;
+        std::vector<Instruction> buffer_;
+        uint32_t code_count_;
+        uint32_t flushed_count_;
+        Command last_command_;
+        bool label_at_end_;
+    };
+
+    void CompileToFile(std::istream& in, const char* path, const CompileOptions& options = CompileOptions()) {
+        StreamingCompiler compiler(path, options);
+        std::string command_line;
+        while (std::getline(in, command_line)) {
+            compiler.AddLine(command_line);
+        }
+        compiler.Finish();
     }
 
+    // Prints a program that compiles back into the same one. Labels are taken
+    // from the symbol table, or named after the index of their command.
     void Decompile(const char* program, std::ostream& out) {
-        Command command = HLT;
-        BufferCommandsReader reader(program);
-        do {
-            reader.NextCommand(&command);
-            out << StringFromCommand(command, reader.GetArgs()) << "\n";
-        } while (command != HLT);
-    }
-} // Cpu
\ No newline at end of file
+        ProgramImage image(program);
+        std::vector<std::string> labels(image.Size() + 1);
+        for (const auto& symbol : image.Symbols()) {
+            labels[symbol.first] = symbol.second;
+        }
+        for (size_t i = 0; i < image.Size(); ++i) {
+            const Instruction& instruction = image.Code()[i];
+            if (IsJumpCommand(instruction.command) && labels[instruction.target].empty()) {
+                labels[instruction.target] = std::to_string(instruction.target);
+            }
+        }
+        for (size_t i = 0; i <= image.Size(); ++i) {
+            if (!labels[i].empty()) {
+                out << ":" << labels[i] << "\n";
+            }
+            if (i == image.Size()) {
+                break;
+            }
+            const Instruction& instruction = image.Code()[i];
+            std::string label = IsJumpCommand(instruction.command) ? labels[instruction.target] : "";
+            out << StringFromCommand(instruction.command, image.Constants() + instruction.constant, label) << "\n";
+        }
+    }
+} // Cpu
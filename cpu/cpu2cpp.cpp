@@ -0,0 +1,15 @@
+#include <err.h>
+#include <fstream>
+#include "transpiler.h"
+
+int main(int argc, const char** argv) {
+    if (argc != 3) {
+        errx(1, "Exactly 2 arguments expected: compiled program and output file");
+    }
+    Cpu::MappedProgram program(argv[1]);
+    std::ofstream out(argv[2]);
+    out << Cpu::Transpile(Cpu::DecodedProgram(program.Data()));
+    if (!out) {
+        errx(1, "Failed to write %s", argv[2]);
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "parser.h"
+#include <memory>
+#include <poll.h>
+#include <vector>
+
+namespace Cpu {
+    // Runs many copies of a program on one thread, each talking to its own
+    // pipes or socket. A copy runs on the decoded engine until it needs input
+    // that has not arrived yet; the loop then polls the descriptors of all
+    // waiting copies and resumes each one at its IN when its input comes.
+    class InteractiveLoop {
+    public:
+        explicit InteractiveLoop(const char* program) : reader_(program), program_(program) {
+        }
+
+        // Adds a copy reading in_fd and writing out_fd, which may be the same
+        // socket. The descriptors are switched to non-blocking mode and are
+        // left open.
+        void Add(int in_fd, int out_fd, Memory memory = Memory()) {
+            std::unique_ptr<Session> session(new Session(in_fd, out_fd));
+            session->cpu.reset(new Cpu(reader_, std::move(memory), &session->io));
+            sessions_.push_back(std::move(session));
+        }
+
+        size_t Size() const {
+            return sessions_.size();
+        }
+
+        // Runs until every copy halts or faults and its output is written.
+        // Faults and failed writes are reported on stderr; returns how many
+        // copies had either.
+        size_t Run() {
+            for (size_t i = 0; i < sessions_.size(); ++i) {
+                Resume(i);
+            }
+            std::vector<struct pollfd> descriptors;
+            std::vector<size_t> owners;
+            while (true) {
+                descriptors.clear();
+                owners.clear();
+                for (size_t i = 0; i < sessions_.size(); ++i) {
+                    Session& session = *sessions_[i];
+                    if (session.waiting) {
+                        descriptors.push_back({session.io.InFd(), POLLIN, 0});
+                        owners.push_back(i);
+                    }
+                    if (session.io.OutputPending()) {
+                        descriptors.push_back({session.io.OutFd(), POLLOUT, 0});
+                        owners.push_back(i);
+                    }
+                }
+                if (descriptors.empty()) {
+                    break;
+                }
+                if (poll(descriptors.data(), descriptors.size(), -1) < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    err(1, "Failed to poll");
+                }
+                for (size_t j = 0; j < descriptors.size(); ++j) {
+                    if (descriptors[j].revents == 0) {
+                        continue;
+                    }
+                    Session& session = *sessions_[owners[j]];
+                    if (descriptors[j].events == POLLOUT) {
+                        session.io.Flush();
+                    } else if (session.io.HasInput()) {
+                        Resume(owners[j]);
+                    }
+                }
+            }
+            size_t failed = 0;
+            for (size_t i = 0; i < sessions_.size(); ++i) {
+                if (sessions_[i]->io.OutputFailed()) {
+                    warnx("Program %zu: failed to write output", i);
+                }
+                failed += sessions_[i]->faulted || sessions_[i]->io.OutputFailed();
+            }
+            return failed;
+        }
+
+    private:
+        struct Session {
+            Session(int in_fd, int out_fd) : io(in_fd, out_fd), position(0), waiting(false), faulted(false) {
+            }
+
+            NonBlockingIo io;
+            std::unique_ptr<Cpu> cpu;
+            uint32_t position;
+            bool waiting;
+            bool faulted;
+        };
+
+        void Resume(size_t i) {
+            Session& session = *sessions_[i];
+            try {
+                session.position = session.cpu->RunDecoded(program_, session.position);
+                session.waiting = session.cpu->NeedsInput();
+            } catch (const MemoryFault& fault) {
+                warnx("Program %zu: memory fault: %s", i, fault.what());
+                session.waiting = false;
+                session.faulted = true;
+            }
+            session.io.Flush();
+        }
+
+        BufferCommandsReader reader_;
+        DecodedProgram program_;
+        std::vector<std::unique_ptr<Session>> sessions_;
+    };
+} // namespace Cpu
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <err.h>
+#include <iostream>
+#include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <unistd.h>
+
+namespace Cpu {
+    // Where IN reads numbers from and OUT writes them to
+    class Io {
+    public:
+        virtual ~Io() = default;
+
+        virtual double In() = 0;
+
+        // Whether In can return without waiting. The decoded engine stops
+        // before an IN while this is false.
+        virtual bool HasInput() {
+            return true;
+        }
+
+        virtual void Out(double value) = 0;
+
+        // Called when the program stops
+        virtual void Flush() {
+        }
+    };
+
+    // Goes through std::cin and std::cout on every command, so redirecting
+    // their buffers redirects the program. The default one.
+    class StreamIo : public Io {
+    public:
+        double In() override {
+            double value = 0;
+            std::cin >> value;
+            return value;
+        }
+
+        void Out(double value) override {
+            std::cout << value << "\n";
+        }
+
+        void Flush() override {
+            std::cout.flush();
+        }
+    };
+
+    // Reads and writes file descriptors through large buffers, parsing with
+    // strtod and printing with "%g", which gives the same text as the default
+    // stream formatting. Output is written out when the buffer fills and on
+    // Flush. Like with streams, a number that fails to parse reads as 0 and so
+    // does everything after it.
+    class BufferedIo : public Io {
+    public:
+        static const size_t DEFAULT_BUFFER_SIZE = 1 << 16;
+
+        explicit BufferedIo(int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO,
+                            size_t buffer_size = DEFAULT_BUFFER_SIZE)
+            : in_fd_(in_fd), out_fd_(out_fd),
+              in_capacity_(buffer_size), in_(new char[buffer_size + 1]), in_begin_(0), in_end_(0),
+              in_eof_(false), in_failed_(false),
+              out_capacity_(buffer_size < MAX_NUMBER_LENGTH ? size_t(MAX_NUMBER_LENGTH) : buffer_size),
+              out_(new char[out_capacity_]), out_size_(0) {
+            in_[0] = '\0';
+        }
+
+        BufferedIo(const BufferedIo&) = delete;
+        BufferedIo& operator=(const BufferedIo&) = delete;
+
+        ~BufferedIo() override {
+            Flush();
+        }
+
+        double In() override {
+            if (in_failed_) {
+                return 0;
+            }
+            while (true) {
+                while (in_begin_ < in_end_ && isspace(static_cast<unsigned char>(in_[in_begin_]))) {
+                    ++in_begin_;
+                }
+                // Parse only once the whole token is in the buffer
+                const char* token_end = in_.get() + in_begin_;
+                while (*token_end != '\0' && !isspace(static_cast<unsigned char>(*token_end))) {
+                    ++token_end;
+                }
+                if (*token_end != '\0' || in_eof_) {
+                    break;
+                }
+                Refill();
+            }
+            char* end = nullptr;
+            double value = strtod(in_.get() + in_begin_, &end);
+            if (end == in_.get() + in_begin_) {
+                in_failed_ = true;
+                return 0;
+            }
+            in_begin_ = end - in_.get();
+            return value;
+        }
+
+        void Out(double value) override {
+            if (out_capacity_ - out_size_ < MAX_NUMBER_LENGTH) {
+                WriteOut();
+            }
+            out_size_ += snprintf(out_.get() + out_size_, MAX_NUMBER_LENGTH, "%g\n", value);
+        }
+
+        void Flush() override {
+            WriteOut();
+        }
+
+    private:
+        // Longest "%g\n" output with the terminating zero
+        static const size_t MAX_NUMBER_LENGTH = 32;
+
+        // Moves the unread tail to the front and reads more after it, growing
+        // the buffer if a token fills it completely
+        void Refill() {
+            memmove(in_.get(), in_.get() + in_begin_, in_end_ - in_begin_);
+            in_end_ -= in_begin_;
+            in_begin_ = 0;
+            if (in_end_ == in_capacity_) {
+                std::unique_ptr<char[]> grown(new char[2 * in_capacity_ + 1]);
+                memcpy(grown.get(), in_.get(), in_end_);
+                in_ = std::move(grown);
+                in_capacity_ *= 2;
+            }
+            ssize_t count = 0;
+            do {
+                count = read(in_fd_, in_.get() + in_end_, in_capacity_ - in_end_);
+            } while (count < 0 && errno == EINTR);
+            if (count < 0) {
+                err(1, "Error reading input");
+            }
+            in_eof_ = count == 0;
+            in_end_ += count;
+            in_[in_end_] = '\0';
+        }
+
+        void WriteOut() {
+            size_t written = 0;
+            while (written < out_size_) {
+                ssize_t count = write(out_fd_, out_.get() + written, out_size_ - written);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count < 0) {
+                    err(1, "Error writing output");
+                }
+                written += count;
+            }
+            out_size_ = 0;
+        }
+
+        int in_fd_;
+        int out_fd_;
+        size_t in_capacity_;
+        std::unique_ptr<char[]> in_;
+        size_t in_begin_;
+        size_t in_end_;
+        bool in_eof_;
+        bool in_failed_;
+        size_t out_capacity_;
+        std::unique_ptr<char[]> out_;
+        size_t out_size_;
+    };
+
+    // Reads and writes file descriptors switched to non-blocking mode, so one
+    // thread can serve many programs. HasInput reads whatever has arrived, and
+    // output is kept until the descriptor takes it. In called with no input
+    // ready still waits, so engines that never ask HasInput work too. Numbers
+    // parse and print like with BufferedIo.
+    class NonBlockingIo : public Io {
+    public:
+        NonBlockingIo(int in_fd, int out_fd)
+            : in_fd_(in_fd), out_fd_(out_fd), in_begin_(0), in_eof_(false), in_failed_(false), out_begin_(0),
+              out_failed_(false) {
+            fcntl(in_fd_, F_SETFL, fcntl(in_fd_, F_GETFL) | O_NONBLOCK);
+            fcntl(out_fd_, F_SETFL, fcntl(out_fd_, F_GETFL) | O_NONBLOCK);
+        }
+
+        bool HasInput() override {
+            if (TokenReady()) {
+                return true;
+            }
+            ReadAvailable();
+            return TokenReady();
+        }
+
+        double In() override {
+            while (!HasInput()) {
+                struct pollfd descriptor = {in_fd_, POLLIN, 0};
+                poll(&descriptor, 1, -1);
+            }
+            if (in_failed_) {
+                return 0;
+            }
+            const char* begin = in_.c_str() + in_begin_;
+            char* end = nullptr;
+            double value = strtod(begin, &end);
+            if (end == begin) {
+                in_failed_ = true;
+                return 0;
+            }
+            in_begin_ += end - begin;
+            if (in_begin_ > in_.size() / 2) {
+                in_.erase(0, in_begin_);
+                in_begin_ = 0;
+            }
+            return value;
+        }
+
+        void Out(double value) override {
+            char number[MAX_NUMBER_LENGTH];
+            out_.append(number, snprintf(number, sizeof(number), "%g\n", value));
+            if (out_.size() - out_begin_ >= WRITE_THRESHOLD) {
+                WriteAvailable();
+            }
+        }
+
+        void Flush() override {
+            WriteAvailable();
+        }
+
+        // Output the descriptor has not taken yet
+        bool OutputPending() const {
+            return out_begin_ < out_.size();
+        }
+
+        // Whether writing failed, in which case the output is dropped
+        bool OutputFailed() const {
+            return out_failed_;
+        }
+
+        int InFd() const {
+            return in_fd_;
+        }
+
+        int OutFd() const {
+            return out_fd_;
+        }
+
+    private:
+        static const size_t MAX_NUMBER_LENGTH = 32;
+        static const size_t READ_SIZE = 1 << 16;
+        static const size_t WRITE_THRESHOLD = 1 << 16;
+
+        // A token is ready once whitespace or the end of input follows it
+        bool TokenReady() const {
+            if (in_failed_ || in_eof_) {
+                return true;
+            }
+            size_t i = in_begin_;
+            while (i < in_.size() && isspace(static_cast<unsigned char>(in_[i]))) {
+                ++i;
+            }
+            while (i < in_.size() && !isspace(static_cast<unsigned char>(in_[i]))) {
+                ++i;
+            }
+            return i < in_.size();
+        }
+
+        void ReadAvailable() {
+            char buffer[READ_SIZE];
+            ssize_t count = 0;
+            do {
+                count = read(in_fd_, buffer, sizeof(buffer));
+            } while (count < 0 && errno == EINTR);
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (count <= 0) {
+                in_eof_ = true;
+                return;
+            }
+            in_.append(buffer, count);
+        }
+
+        void WriteAvailable() {
+            while (OutputPending() && !out_failed_) {
+                ssize_t count = write(out_fd_, out_.data() + out_begin_, out_.size() - out_begin_);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    out_.erase(0, out_begin_);
+                    out_begin_ = 0;
+                    return;
+                }
+                if (count < 0) {
+                    out_failed_ = true;
+                    break;
+                }
+                out_begin_ += count;
+            }
+            out_.clear();
+            out_begin_ = 0;
+        }
+
+        int in_fd_;
+        int out_fd_;
+        std::string in_;
+        size_t in_begin_;
+        bool in_eof_;
+        bool in_failed_;
+        std::string out_;
+        size_t out_begin_;
+        bool out_failed_;
+    };
+} // namespace Cpu
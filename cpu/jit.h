@@ -0,0 +1,886 @@
+#pragma once
+
+#include "parser.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Template JIT translating a DecodedProgram into x86-64 code.
+//
+// Register assignment inside generated code:
+//   rbx - operand stack pointer (next free slot)
+//   r12 - operand stack base, r13 - operand stack limit
+//   r14 - JitContext, r15 - Cpu registers; integer registers are reached
+//         through the context
+//   rbp - call stack pointer (next free slot), the stack keeps native return
+//         addresses
+// Everything the JIT does not translate, and every stack underflow or overflow,
+// exits back to the host with the index of the command to resume from, and the
+// decoded interpreter finishes the program from there.
+
+namespace Cpu {
+    const size_t JIT_STACK_SIZE = 1 << 16;
+    const size_t JIT_CALL_DEPTH = 1 << 16;
+
+    struct JitContext {
+        Memory* memory;
+        int64_t* iregs;
+        Io* io;
+        const DecodedProgram* program;
+        const uint8_t* const* native;
+        double* sp;
+        const uint8_t** call_sp;
+        const uint8_t** call_base;
+        const uint8_t** call_limit;
+        uint32_t exit_index;
+    };
+
+    // Exceptions cannot unwind through generated code, so a fault returns null
+    // and the interpreter repeats the access to raise it
+    double* JitMemAt(JitContext* context, double address) {
+        try {
+            return &context->memory->at(address);
+        } catch (const MemoryFault&) {
+            return nullptr;
+        }
+    }
+
+    double* JitMemAtIndex(JitContext* context, uint64_t address) {
+        try {
+            return &context->memory->AtIndex(address);
+        } catch (const MemoryFault&) {
+            return nullptr;
+        }
+    }
+
+    // Runs a vector command on the operands below sp and leaves its result,
+    // if any, in place of the first one. Returns 0 on a fault.
+    uint64_t JitVector(JitContext* context, double* sp, uint64_t command) {
+        try {
+            switch (command) {
+                case VFILL:
+                    VectorFill(context->memory, sp[-3], sp[-2], sp[-1]);
+                    break;
+                case VADD:
+                    VectorAdd(context->memory, sp[-4], sp[-3], sp[-2], sp[-1]);
+                    break;
+                case VMUL:
+                    VectorMul(context->memory, sp[-4], sp[-3], sp[-2], sp[-1]);
+                    break;
+                case VAXPY:
+                    VectorAxpy(context->memory, sp[-4], sp[-3], sp[-2], sp[-1]);
+                    break;
+                case VDOT:
+                    sp[-3] = VectorDot(context->memory, sp[-3], sp[-2], sp[-1]);
+                    break;
+                case VSUM:
+                    sp[-2] = VectorSum(context->memory, sp[-2], sp[-1]);
+                    break;
+            }
+            return 1;
+        } catch (const MemoryFault&) {
+            return 0;
+        }
+    }
+
+    double JitIn(JitContext* context) {
+        return context->io->In();
+    }
+
+    void JitOut(JitContext* context, double value) {
+        context->io->Out(value);
+    }
+
+    const uint8_t* JitResolve(JitContext* context, double position) {
+        uint32_t index = context->program->FindIndex(position);
+        if (index == NO_INDEX) {
+            return nullptr;
+        }
+        return context->native[index];
+    }
+
+    class X64Emitter {
+    public:
+        enum Reg {
+            RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+            R8 = 8, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+        };
+
+        enum Condition {
+            BELOW = 0x2, ABOVE_EQUAL = 0x3, EQUAL = 0x4, NOT_EQUAL = 0x5, ABOVE = 0x7, PARITY = 0xA,
+            LESS = 0xC, GREATER = 0xF
+        };
+
+        void Bytes(std::initializer_list<uint8_t> bytes) {
+            code_.insert(code_.end(), bytes.begin(), bytes.end());
+        }
+
+        void Imm32(uint32_t value) {
+            for (int i = 0; i < 4; ++i) {
+                code_.push_back(static_cast<uint8_t>(value >> (8 * i)));
+            }
+        }
+
+        void Imm64(uint64_t value) {
+            Imm32(static_cast<uint32_t>(value));
+            Imm32(static_cast<uint32_t>(value >> 32));
+        }
+
+        size_t Size() const {
+            return code_.size();
+        }
+
+        const std::vector<uint8_t>& Code() const {
+            return code_;
+        }
+
+        // mov reg, [base + disp]
+        void Load(int reg, int base, int32_t disp) {
+            Rex(true, reg, base);
+            Bytes({0x8B});
+            Mem(reg, base, disp);
+        }
+
+        // mov [base + disp], reg
+        void Store(int base, int32_t disp, int reg) {
+            Rex(true, reg, base);
+            Bytes({0x89});
+            Mem(reg, base, disp);
+        }
+
+        // mov dword [base + disp], imm
+        void StoreImm32(int base, int32_t disp, uint32_t value) {
+            Rex(false, 0, base);
+            Bytes({0xC7});
+            Mem(0, base, disp);
+            Imm32(value);
+        }
+
+        // mov dst, src
+        void Move(int dst, int src) {
+            Rex(true, src, dst);
+            Bytes({0x89, static_cast<uint8_t>(0xC0 | (src & 7) << 3 | (dst & 7))});
+        }
+
+        // movabs reg, imm
+        void MoveImm(int reg, uint64_t value) {
+            Rex(true, 0, reg);
+            Bytes({static_cast<uint8_t>(0xB8 | (reg & 7))});
+            Imm64(value);
+        }
+
+        // lea reg, [base + disp]
+        void Lea(int reg, int base, int32_t disp) {
+            Rex(true, reg, base);
+            Bytes({0x8D});
+            Mem(reg, base, disp);
+        }
+
+        void AddImm(int reg, int32_t value) {
+            Rex(true, 0, reg);
+            Bytes({0x81, static_cast<uint8_t>(0xC0 | (reg & 7))});
+            Imm32(value);
+        }
+
+        void SubImm(int reg, int32_t value) {
+            Rex(true, 0, reg);
+            Bytes({0x81, static_cast<uint8_t>(0xE8 | (reg & 7))});
+            Imm32(value);
+        }
+
+        // cmp first, second
+        void Compare(int first, int second) {
+            Rex(true, second, first);
+            Bytes({0x39, static_cast<uint8_t>(0xC0 | (second & 7) << 3 | (first & 7))});
+        }
+
+        // Two-register integer operation "op dst, src": 0x01 add, 0x29 sub
+        void IntRegs(uint8_t op, int dst, int src) {
+            Rex(true, src, dst);
+            Bytes({op, static_cast<uint8_t>(0xC0 | (src & 7) << 3 | (dst & 7))});
+        }
+
+        // imul dst, src
+        void IntMul(int dst, int src) {
+            Rex(true, dst, src);
+            Bytes({0x0F, 0xAF, static_cast<uint8_t>(0xC0 | (dst & 7) << 3 | (src & 7))});
+        }
+
+        // cvtsi2sd xmm, reg
+        void IntToDouble(int xmm, int reg) {
+            Bytes({0xF2});
+            Rex(true, xmm, reg);
+            Bytes({0x0F, 0x2A, static_cast<uint8_t>(0xC0 | xmm << 3 | (reg & 7))});
+        }
+
+        // cvttsd2si reg, xmm
+        void TruncateToInt(int reg, int xmm) {
+            Bytes({0xF2});
+            Rex(true, reg, 0);
+            Bytes({0x0F, 0x2C, static_cast<uint8_t>(0xC0 | (reg & 7) << 3 | xmm)});
+        }
+
+        void TestRax() {
+            Bytes({0x48, 0x85, 0xC0});
+        }
+
+        // btr qword [base + disp], bit
+        void ClearBit(int base, int32_t disp, uint8_t bit) {
+            Rex(true, 0, base);
+            Bytes({0x0F, 0xBA});
+            Mem(6, base, disp);
+            Bytes({bit});
+        }
+
+        // Scalar double operation "op xmm, [base + disp]" with F2 0F prefix:
+        // 0x10 movsd load, 0x11 movsd store, 0x51 sqrt, 0x58 add, 0x59 mul, 0x5C sub, 0x5E div
+        void Sse(uint8_t op, int xmm, int base, int32_t disp) {
+            Bytes({0xF2});
+            Rex(false, xmm, base);
+            Bytes({0x0F, op});
+            Mem(xmm, base, disp);
+        }
+
+        void SseRegs(uint8_t op, int dst, int src) {
+            Bytes({0xF2, 0x0F, op, static_cast<uint8_t>(0xC0 | dst << 3 | src)});
+        }
+
+        // ucomisd first, second
+        void CompareDoubles(int first, int second) {
+            Bytes({0x66, 0x0F, 0x2E, static_cast<uint8_t>(0xC0 | first << 3 | second)});
+        }
+
+        // movq xmm, rax
+        void MoveToXmm(int xmm) {
+            Bytes({0x66, 0x48, 0x0F, 0x6E, static_cast<uint8_t>(0xC0 | xmm << 3)});
+        }
+
+        void CallRax() {
+            Bytes({0xFF, 0xD0});
+        }
+
+        // lea reg, [rip + rel32] with an unresolved rel32, returns the offset to patch
+        size_t LeaRip(int reg) {
+            Rex(true, reg, 0);
+            Bytes({0x8D, static_cast<uint8_t>(0x05 | (reg & 7) << 3)});
+            Imm32(0);
+            return code_.size() - 4;
+        }
+
+        void JumpRax() {
+            Bytes({0xFF, 0xE0});
+        }
+
+        void JumpReg(int reg) {
+            Rex(false, 0, reg);
+            Bytes({0xFF, static_cast<uint8_t>(0xE0 | (reg & 7))});
+        }
+
+        void Push(int reg) {
+            Rex(false, 0, reg);
+            Bytes({static_cast<uint8_t>(0x50 | (reg & 7))});
+        }
+
+        void Pop(int reg) {
+            Rex(false, 0, reg);
+            Bytes({static_cast<uint8_t>(0x58 | (reg & 7))});
+        }
+
+        void Ret() {
+            Bytes({0xC3});
+        }
+
+        // Emits a jump with an unresolved rel32 and returns the offset to patch
+        size_t Jump() {
+            Bytes({0xE9});
+            Imm32(0);
+            return code_.size() - 4;
+        }
+
+        size_t JumpIf(Condition condition) {
+            Bytes({0x0F, static_cast<uint8_t>(0x80 | condition)});
+            Imm32(0);
+            return code_.size() - 4;
+        }
+
+        void Patch(size_t at, size_t target) {
+            uint32_t rel = static_cast<uint32_t>(target - (at + 4));
+            memcpy(&code_[at], &rel, sizeof(rel));
+        }
+
+    private:
+        void Rex(bool wide, int reg, int base) {
+            uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+            if (rex != 0x40) {
+                Bytes({rex});
+            }
+        }
+
+        void Mem(int reg, int base, int32_t disp) {
+            Bytes({static_cast<uint8_t>(0x80 | (reg & 7) << 3 | (base & 7))});
+            if ((base & 7) == RSP) {
+                Bytes({0x24});
+            }
+            Imm32(static_cast<uint32_t>(disp));
+        }
+
+        std::vector<uint8_t> code_;
+    };
+
+    class JitProgram {
+        using Entry = void (*)(JitContext* context, double* regs, double* base, double* limit, const uint8_t* start);
+        using R = X64Emitter;
+
+    public:
+        explicit JitProgram(const DecodedProgram& program)
+            : program_(program), code_(nullptr), code_size_(0) {
+#if defined(__x86_64__)
+            Translate();
+#endif
+        }
+
+        JitProgram(const JitProgram&) = delete;
+        JitProgram& operator=(const JitProgram&) = delete;
+
+        ~JitProgram() {
+            if (code_) {
+                munmap(code_, code_size_);
+            }
+        }
+
+        bool Compiled() const {
+            return code_ != nullptr;
+        }
+
+        // Code of the command at index
+        const uint8_t* Native(uint32_t index) const {
+            return native_[index];
+        }
+
+        // Index of the command whose code starts at native
+        uint32_t IndexOf(const uint8_t* native) const {
+            return std::lower_bound(native_.begin(), native_.end(), native) - native_.begin();
+        }
+
+        // Runs from command start with the given operand stack. Returns the index
+        // of the command the interpreter has to resume from, or NO_INDEX on HLT.
+        uint32_t Run(JitContext* context, double* regs, double* base, double* limit, size_t start) const {
+            context->program = &program_;
+            context->native = native_.data();
+            context->exit_index = NO_INDEX;
+            reinterpret_cast<Entry>(code_)(context, regs, base, limit, native_[start]);
+            return context->exit_index;
+        }
+
+    private:
+        void Translate() {
+            R e;
+            std::vector<size_t> offsets(program_.Size());
+            std::vector<std::pair<size_t, uint32_t>> jumps;
+            std::vector<std::pair<size_t, uint32_t>> exits;
+
+            e.Push(R::RBP);
+            e.Push(R::RBX);
+            e.Push(R::R12);
+            e.Push(R::R13);
+            e.Push(R::R14);
+            e.Push(R::R15);
+            e.SubImm(R::RSP, 8);
+            e.Move(R::R14, R::RDI);
+            e.Move(R::R15, R::RSI);
+            e.Move(R::R12, R::RDX);
+            e.Move(R::R13, R::RCX);
+            e.Load(R::RBX, R::R14, offsetof(JitContext, sp));
+            e.Load(R::RBP, R::R14, offsetof(JitContext, call_sp));
+            e.JumpReg(R::R8);
+
+            auto exit_to = [&](uint32_t index) {
+                exits.emplace_back(e.Jump(), index);
+            };
+            auto exit_if = [&](R::Condition condition, uint32_t index) {
+                exits.emplace_back(e.JumpIf(condition), index);
+            };
+            auto need_pops = [&](int count, uint32_t index) {
+                e.Lea(R::RAX, R::R12, count * sizeof(double));
+                e.Compare(R::RBX, R::RAX);
+                exit_if(R::BELOW, index);
+            };
+            auto need_push = [&](uint32_t index) {
+                e.Compare(R::RBX, R::R13);
+                exit_if(R::ABOVE_EQUAL, index);
+            };
+            auto call = [&](const void* function) {
+                e.Move(R::RDI, R::R14);
+                e.MoveImm(R::RAX, reinterpret_cast<uint64_t>(function));
+                e.CallRax();
+            };
+            auto load_constant = [&](int xmm, double value) {
+                uint64_t bits = 0;
+                memcpy(&bits, &value, sizeof(bits));
+                e.MoveImm(R::RAX, bits);
+                e.MoveToXmm(xmm);
+            };
+            auto push_rax = [&]() {
+                e.Store(R::RBX, 0, R::RAX);
+                e.AddImm(R::RBX, sizeof(double));
+            };
+            auto pop_to_rcx = [&]() {
+                e.Load(R::RCX, R::RBX, -8);
+                e.SubImm(R::RBX, sizeof(double));
+            };
+            auto arithmetic = [&](uint8_t op, uint32_t index) {
+                need_pops(2, index);
+                e.Sse(0x10, 0, R::RBX, -16);
+                e.Sse(op, 0, R::RBX, -8);
+                e.Sse(0x11, 0, R::RBX, -16);
+                e.SubImm(R::RBX, sizeof(double));
+            };
+            auto arithmetic_imm = [&](uint8_t op, const Instruction& instruction, uint32_t index) {
+                need_pops(1, index);
+                e.Sse(0x10, 0, R::RBX, -8);
+                load_constant(1, program_.Arg(instruction));
+                e.SseRegs(op, 0, 1);
+                e.Sse(0x11, 0, R::RBX, -8);
+            };
+            // Jumps to the target if first compares to second as the command requires
+            auto branch = [&](Command command, uint32_t target) {
+                e.CompareDoubles(0, 1);
+                if (command == JE || command == JE_IMM) {
+                    size_t unordered = e.JumpIf(R::PARITY);
+                    jumps.emplace_back(e.JumpIf(R::EQUAL), target);
+                    e.Patch(unordered, e.Size());
+                } else if (command == JNE || command == JNE_IMM) {
+                    jumps.emplace_back(e.JumpIf(R::PARITY), target);
+                    jumps.emplace_back(e.JumpIf(R::NOT_EQUAL), target);
+                } else {
+                    jumps.emplace_back(e.JumpIf(R::ABOVE), target);
+                }
+            };
+            auto compare_jump = [&](const Instruction& instruction, uint32_t index) {
+                need_pops(2, index);
+                e.Sse(0x10, 0, R::RBX, -16);
+                e.Sse(0x10, 1, R::RBX, -8);
+                e.SubImm(R::RBX, 2 * sizeof(double));
+                branch(instruction.command, instruction.target);
+            };
+            auto compare_imm_jump = [&](const Instruction& instruction, uint32_t index) {
+                need_pops(1, index);
+                e.Sse(0x10, 0, R::RBX, -8);
+                e.SubImm(R::RBX, sizeof(double));
+                load_constant(1, program_.Arg(instruction));
+                branch(instruction.command, instruction.target);
+            };
+            // Leaves the address in xmm0: the immediate, the register or their sum
+            auto mem_address = [&](const Instruction& instruction, int reg, bool offset) {
+                if (reg == NOREG) {
+                    load_constant(0, program_.Arg(instruction));
+                    return;
+                }
+                e.Sse(0x10, 0, R::R15, reg * sizeof(double));
+                if (offset) {
+                    load_constant(1, program_.Arg(instruction));
+                    e.SseRegs(0x58, 0, 1);
+                }
+            };
+            auto push_mem = [&](const Instruction& instruction, int reg, bool offset, uint32_t index) {
+                need_push(index);
+                mem_address(instruction, reg, offset);
+                call(reinterpret_cast<const void*>(&JitMemAt));
+                e.TestRax();
+                exit_if(R::EQUAL, index);
+                e.Load(R::RAX, R::RAX, 0);
+                push_rax();
+            };
+            auto pop_mem = [&](const Instruction& instruction, int reg, bool offset, uint32_t index) {
+                need_pops(1, index);
+                mem_address(instruction, reg, offset);
+                call(reinterpret_cast<const void*>(&JitMemAt));
+                e.TestRax();
+                exit_if(R::EQUAL, index);
+                pop_to_rcx();
+                e.Store(R::RAX, 0, R::RCX);
+            };
+
+            auto load_int = [&](int reg, int ireg) {
+                e.Load(R::RCX, R::R14, offsetof(JitContext, iregs));
+                e.Load(reg, R::RCX, ireg * sizeof(int64_t));
+            };
+            auto store_int = [&](int ireg, int reg) {
+                e.Load(R::RCX, R::R14, offsetof(JitContext, iregs));
+                e.Store(R::RCX, ireg * sizeof(int64_t), reg);
+            };
+            auto pop_int = [&](int reg) {
+                e.Sse(0x10, 0, R::RBX, -8);
+                e.SubImm(R::RBX, sizeof(double));
+                e.TruncateToInt(reg, 0);
+            };
+            // Leaves the integer address in rsi, the second argument of JitMemAtIndex
+            auto mem_int_address = [&](const Instruction& instruction, int ireg, bool offset) {
+                load_int(R::RSI, ireg);
+                if (offset) {
+                    e.MoveImm(R::RAX, DoubleToInt(program_.Arg(instruction)));
+                    e.IntRegs(0x01, R::RSI, R::RAX);
+                }
+            };
+            auto push_mem_int = [&](const Instruction& instruction, int ireg, bool offset, uint32_t index) {
+                need_push(index);
+                mem_int_address(instruction, ireg, offset);
+                call(reinterpret_cast<const void*>(&JitMemAtIndex));
+                e.TestRax();
+                exit_if(R::EQUAL, index);
+                e.Load(R::RAX, R::RAX, 0);
+                push_rax();
+            };
+            auto pop_mem_int = [&](const Instruction& instruction, int ireg, bool offset, uint32_t index) {
+                need_pops(1, index);
+                mem_int_address(instruction, ireg, offset);
+                call(reinterpret_cast<const void*>(&JitMemAtIndex));
+                e.TestRax();
+                exit_if(R::EQUAL, index);
+                pop_to_rcx();
+                e.Store(R::RAX, 0, R::RCX);
+            };
+
+            auto vector = [&](Command command, int pops, int pushes, uint32_t index) {
+                need_pops(pops, index);
+                e.Move(R::RSI, R::RBX);
+                e.MoveImm(R::RDX, command);
+                call(reinterpret_cast<const void*>(&JitVector));
+                e.TestRax();
+                exit_if(R::EQUAL, index);
+                e.SubImm(R::RBX, (pops - pushes) * sizeof(double));
+            };
+
+            const Instruction* code = program_.Code();
+            for (uint32_t i = 0; i < program_.Size(); ++i) {
+                const Instruction& instruction = code[i];
+                offsets[i] = e.Size();
+                switch (instruction.command) {
+                    case HLT:
+                        exit_to(NO_INDEX);
+                        break;
+                    case PUSH: {
+                        need_push(i);
+                        double value = program_.Arg(instruction);
+                        uint64_t bits = 0;
+                        memcpy(&bits, &value, sizeof(bits));
+                        e.MoveImm(R::RAX, bits);
+                        push_rax();
+                        break;
+                    }
+                    case POP:
+                        need_pops(1, i);
+                        e.SubImm(R::RBX, sizeof(double));
+                        break;
+                    case DUP:
+                        need_pops(1, i);
+                        need_push(i);
+                        e.Load(R::RAX, R::RBX, -8);
+                        push_rax();
+                        break;
+                    case IN:
+                        need_push(i);
+                        call(reinterpret_cast<const void*>(&JitIn));
+                        e.Sse(0x11, 0, R::RBX, 0);
+                        e.AddImm(R::RBX, sizeof(double));
+                        break;
+                    case OUT:
+                        need_pops(1, i);
+                        e.Sse(0x10, 0, R::RBX, -8);
+                        e.SubImm(R::RBX, sizeof(double));
+                        call(reinterpret_cast<const void*>(&JitOut));
+                        break;
+                    case ADD:
+                        arithmetic(0x58, i);
+                        break;
+                    case MUL:
+                        arithmetic(0x59, i);
+                        break;
+                    case DIV:
+                        arithmetic(0x5E, i);
+                        break;
+                    case SUB:
+                        arithmetic(0x5C, i);
+                        break;
+                    case SQRT:
+                        need_pops(1, i);
+                        e.Sse(0x51, 0, R::RBX, -8);
+                        e.Sse(0x11, 0, R::RBX, -8);
+                        break;
+                    case ABS:
+                        need_pops(1, i);
+                        e.ClearBit(R::RBX, -8, 63);
+                        break;
+                    case ADD_IMM:
+                        arithmetic_imm(0x58, instruction, i);
+                        break;
+                    case MUL_IMM:
+                        arithmetic_imm(0x59, instruction, i);
+                        break;
+                    case DIV_IMM:
+                        arithmetic_imm(0x5E, instruction, i);
+                        break;
+                    case SUB_IMM:
+                        arithmetic_imm(0x5C, instruction, i);
+                        break;
+#define REGISTER(REG, NUM)                                   \
+                    case PUSH_##REG:                         \
+                        need_push(i);                        \
+                        e.Load(R::RAX, R::R15, REG * sizeof(double)); \
+                        push_rax();                          \
+                        break;                               \
+                    case POP_##REG:                          \
+                        need_pops(1, i);                     \
+                        pop_to_rcx();                        \
+                        e.Store(R::R15, REG * sizeof(double), R::RCX); \
+                        break;                               \
+                    case STORE_##REG:                        \
+                        need_pops(1, i);                     \
+                        e.Load(R::RAX, R::RBX, -8);          \
+                        e.Store(R::R15, REG * sizeof(double), R::RAX); \
+                        break;                               \
+                    case PUSH_MEM_##REG:                     \
+                        push_mem(instruction, REG, false, i); \
+                        break;                               \
+                    case PUSH_MEM_OFFSET_##REG:              \
+                        push_mem(instruction, REG, true, i); \
+                        break;                               \
+                    case POP_MEM_##REG:                      \
+                        pop_mem(instruction, REG, false, i); \
+                        break;                               \
+                    case POP_MEM_OFFSET_##REG:               \
+                        pop_mem(instruction, REG, true, i);  \
+                        break;
+
+#include "registers.h"
+#undef REGISTER
+#define REGISTER(REG, NUM)
+#define INT_REGISTER(REG, NUM)                               \
+                    case IPUSH_##REG:                        \
+                        need_push(i);                        \
+                        load_int(R::RAX, REG);               \
+                        e.IntToDouble(0, R::RAX);            \
+                        e.Sse(0x11, 0, R::RBX, 0);           \
+                        e.AddImm(R::RBX, sizeof(double));    \
+                        break;                               \
+                    case IPOP_##REG:                         \
+                        need_pops(1, i);                     \
+                        pop_int(R::RAX);                     \
+                        store_int(REG, R::RAX);              \
+                        break;                               \
+                    case ISET_##REG:                         \
+                        e.MoveImm(R::RAX, DoubleToInt(program_.Arg(instruction))); \
+                        store_int(REG, R::RAX);              \
+                        break;                               \
+                    case IADD_IMM_##REG:                     \
+                        load_int(R::RAX, REG);               \
+                        e.MoveImm(R::RDX, DoubleToInt(program_.Arg(instruction))); \
+                        e.IntRegs(0x01, R::RAX, R::RDX);     \
+                        store_int(REG, R::RAX);              \
+                        break;                               \
+                    case IADD_##REG:                         \
+                    case ISUB_##REG:                         \
+                    case IMUL_##REG:                         \
+                        need_pops(1, i);                     \
+                        pop_int(R::RDX);                     \
+                        load_int(R::RAX, REG);               \
+                        if (instruction.command == IMUL_##REG) { \
+                            e.IntMul(R::RAX, R::RDX);        \
+                        } else {                             \
+                            e.IntRegs(instruction.command == IADD_##REG ? 0x01 : 0x29, R::RAX, R::RDX); \
+                        }                                    \
+                        store_int(REG, R::RAX);              \
+                        break;                               \
+                    case IJE_##REG:                          \
+                    case IJNE_##REG:                         \
+                    case IJA_##REG:                          \
+                    case IJB_##REG: {                        \
+                        load_int(R::RAX, REG);               \
+                        e.MoveImm(R::RDX, DoubleToInt(program_.Arg(instruction))); \
+                        e.Compare(R::RAX, R::RDX);           \
+                        R::Condition condition = instruction.command == IJE_##REG ? R::EQUAL :   \
+                                                 instruction.command == IJNE_##REG ? R::NOT_EQUAL : \
+                                                 instruction.command == IJA_##REG ? R::GREATER : R::LESS; \
+                        jumps.emplace_back(e.JumpIf(condition), instruction.target); \
+                        break;                               \
+                    }                                        \
+                    case PUSH_MEM_INT_##REG:                 \
+                        push_mem_int(instruction, REG, false, i); \
+                        break;                               \
+                    case PUSH_MEM_INT_OFFSET_##REG:          \
+                        push_mem_int(instruction, REG, true, i); \
+                        break;                               \
+                    case POP_MEM_INT_##REG:                  \
+                        pop_mem_int(instruction, REG, false, i); \
+                        break;                               \
+                    case POP_MEM_INT_OFFSET_##REG:           \
+                        pop_mem_int(instruction, REG, true, i); \
+                        break;
+
+#include "registers.h"
+#undef INT_REGISTER
+#undef REGISTER
+                    case PUSH_MEM:
+                        push_mem(instruction, NOREG, false, i);
+                        break;
+                    case POP_MEM:
+                        pop_mem(instruction, NOREG, false, i);
+                        break;
+                    case JMP:
+                        jumps.emplace_back(e.Jump(), instruction.target);
+                        break;
+                    case JE:
+                    case JNE:
+                    case JA:
+                        compare_jump(instruction, i);
+                        break;
+                    case JE_IMM:
+                    case JNE_IMM:
+                    case JA_IMM:
+                        compare_imm_jump(instruction, i);
+                        break;
+                    case JEXEC: {
+                        double position = program_.PositionOf(i + 1);
+                        uint64_t bits = 0;
+                        memcpy(&bits, &position, sizeof(bits));
+                        e.MoveImm(R::RAX, bits);
+                        e.Store(R::R15, RDX * sizeof(double), R::RAX);
+                        jumps.emplace_back(e.Jump(), instruction.target);
+                        break;
+                    }
+                    case RET:
+                        e.Sse(0x10, 0, R::R15, RDX * sizeof(double));
+                        call(reinterpret_cast<const void*>(&JitResolve));
+                        e.TestRax();
+                        exit_if(R::EQUAL, i);
+                        e.JumpRax();
+                        break;
+                    case CALL:
+                        e.Load(R::RAX, R::R14, offsetof(JitContext, call_limit));
+                        e.Compare(R::RBP, R::RAX);
+                        exit_if(R::ABOVE_EQUAL, i);
+                        jumps.emplace_back(e.LeaRip(R::RAX), i + 1);
+                        e.Store(R::RBP, 0, R::RAX);
+                        e.AddImm(R::RBP, sizeof(void*));
+                        jumps.emplace_back(e.Jump(), instruction.target);
+                        break;
+                    case RETURN:
+                        e.Load(R::RAX, R::R14, offsetof(JitContext, call_base));
+                        e.Compare(R::RBP, R::RAX);
+                        exit_if(R::EQUAL, i);
+                        e.SubImm(R::RBP, sizeof(void*));
+                        e.Load(R::RAX, R::RBP, 0);
+                        e.JumpRax();
+                        break;
+                    case VFILL:
+                        vector(instruction.command, 3, 0, i);
+                        break;
+                    case VADD:
+                    case VMUL:
+                    case VAXPY:
+                        vector(instruction.command, 4, 0, i);
+                        break;
+                    case VDOT:
+                        vector(instruction.command, 3, 1, i);
+                        break;
+                    case VSUM:
+                        vector(instruction.command, 2, 1, i);
+                        break;
+                    default:
+                        exit_to(i);
+                }
+            }
+
+            std::map<uint32_t, size_t> stubs;
+            std::vector<size_t> to_epilogue;
+            for (const auto& exit : exits) {
+                auto it = stubs.find(exit.second);
+                if (it == stubs.end()) {
+                    it = stubs.emplace(exit.second, e.Size()).first;
+                    e.StoreImm32(R::R14, offsetof(JitContext, exit_index), exit.second);
+                    to_epilogue.push_back(e.Jump());
+                }
+                e.Patch(exit.first, it->second);
+            }
+            for (size_t at : to_epilogue) {
+                e.Patch(at, e.Size());
+            }
+            e.Store(R::R14, offsetof(JitContext, sp), R::RBX);
+            e.Store(R::R14, offsetof(JitContext, call_sp), R::RBP);
+            e.AddImm(R::RSP, 8);
+            e.Pop(R::R15);
+            e.Pop(R::R14);
+            e.Pop(R::R13);
+            e.Pop(R::R12);
+            e.Pop(R::RBX);
+            e.Pop(R::RBP);
+            e.Ret();
+
+            for (const auto& jump : jumps) {
+                e.Patch(jump.first, offsets[jump.second]);
+            }
+
+            size_t page_size = sysconf(_SC_PAGESIZE);
+            size_t size = (e.Size() + page_size - 1) / page_size * page_size;
+            void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                return;
+            }
+            memcpy(memory, e.Code().data(), e.Size());
+            if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, size);
+                return;
+            }
+            code_ = memory;
+            code_size_ = size;
+            native_.resize(program_.Size());
+            for (size_t i = 0; i < program_.Size(); ++i) {
+                native_[i] = static_cast<const uint8_t*>(code_) + offsets[i];
+            }
+        }
+
+        const DecodedProgram& program_;
+        std::vector<const uint8_t*> native_;
+        void* code_;
+        size_t code_size_;
+    };
+
+    template <template<class> class OperandStack, class Monitor>
+    uint32_t BasicCpu<OperandStack, Monitor>::RunJit(uint32_t start) {
+        DecodedProgram program(reader_.GetCompiled().first);
+        JitProgram jit(program);
+        size_t call_depth = std::min(calls_.Limit(), JIT_CALL_DEPTH);
+        if (!jit.Compiled() || stack_.Size() > JIT_STACK_SIZE / 2 || calls_.Depth() > call_depth / 2) {
+            return RunDecoded(program, start);
+        }
+        // Generated code keeps the operand stack and the call stack in its own
+        // arrays, the latter with native return addresses
+        std::vector<double> stack(JIT_STACK_SIZE);
+        double* sp = stack.data() + stack_.Size();
+        for (double* it = sp; it != stack.data(); ) {
+            stack_.Pop(--it);
+        }
+        std::vector<const uint8_t*> calls(call_depth);
+        for (size_t i = 0; i < calls_.Depth(); ++i) {
+            calls[i] = jit.Native(program.IndexOf(calls_.Positions()[i]));
+        }
+        JitContext context{&mem_, iregs_, io_, nullptr, nullptr, sp,
+                           calls.data() + calls_.Depth(), calls.data(), calls.data() + calls.size(), NO_INDEX};
+        uint32_t resume = jit.Run(&context, regs_, stack.data(), stack.data() + stack.size(), start);
+        for (const double* it = stack.data(); it != context.sp; ++it) {
+            stack_.Push(*it);
+        }
+        std::vector<uint32_t> positions;
+        for (const uint8_t** it = calls.data(); it != context.call_sp; ++it) {
+            positions.push_back(program.PositionOf(jit.IndexOf(*it)));
+        }
+        calls_.Assign(std::move(positions));
+        if (resume != NO_INDEX) {
+            return RunDecoded(program, resume);
+        }
+        return NO_INDEX;
+    }
+} // namespace Cpu
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Cpu {
+    class MemoryFault : public std::runtime_error {
+    public:
+        explicit MemoryFault(const std::string& reason) : std::runtime_error(reason) {
+        }
+    };
+
+    // Cpu memory of doubles addressed by cell number.
+    //
+    // By default it is paged: fixed size pages are allocated on first touch and
+    // found through a two-level page table, with the last used page cached, so
+    // a far address costs one page and not everything below it. Allocation stops
+    // with a MemoryFault once the limit is reached. Programs that know their
+    // footprint can use Flat memory instead: one preallocated array, and any
+    // address past it faults.
+    class Memory {
+    public:
+        static constexpr size_t PAGE_BITS = 12;
+        static constexpr size_t TABLE_BITS = 12;
+        static constexpr size_t DIRECTORY_BITS = 12;
+        static constexpr size_t PAGE_CELLS = size_t(1) << PAGE_BITS;
+        static constexpr size_t TABLE_PAGES = size_t(1) << TABLE_BITS;
+        static constexpr size_t DIRECTORY_TABLES = size_t(1) << DIRECTORY_BITS;
+        static constexpr size_t ADDRESS_SPACE = size_t(1) << (PAGE_BITS + TABLE_BITS + DIRECTORY_BITS);
+        static constexpr size_t PAGE_COUNT = ADDRESS_SPACE >> PAGE_BITS;
+        static constexpr size_t DEFAULT_LIMIT = size_t(1) << 30;
+
+        explicit Memory(size_t limit = DEFAULT_LIMIT)
+            : limit_(limit), allocated_(0), flat_(nullptr), flat_size_(0), cached_number_(SIZE_MAX),
+              cached_page_(nullptr) {
+        }
+
+        static Memory Flat(size_t size) {
+            Memory memory(size * sizeof(double));
+            memory.owned_flat_.reset(new double[size]());
+            memory.flat_ = memory.owned_flat_.get();
+            memory.flat_size_ = size;
+            memory.allocated_ = size * sizeof(double);
+            return memory;
+        }
+
+        // Memory over cells it does not own, such as a mapped snapshot, which
+        // backing keeps alive. With flat set it is Flat memory of flat_size
+        // cells, otherwise pages maps page numbers, all below PAGE_COUNT, to
+        // their cells.
+        static Memory Adopt(std::shared_ptr<void> backing, size_t limit, double* flat, size_t flat_size,
+                            const std::vector<std::pair<size_t, double*>>& pages) {
+            Memory memory(limit);
+            memory.backing_ = std::move(backing);
+            memory.flat_ = flat;
+            memory.flat_size_ = flat ? flat_size : 0;
+            memory.allocated_ = memory.flat_size_ * sizeof(double);
+            for (const auto& page : pages) {
+                assert(page.first < PAGE_COUNT);
+                memory.TablePage(page.first) = page.second;
+                memory.allocated_ += PAGE_CELLS * sizeof(double);
+            }
+            return memory;
+        }
+
+        double& at(double address) {
+            return AtIndex(Address(address));
+        }
+
+        // Cell number of an address given as a double
+        static size_t Address(double address) {
+            if (!(address >= 0) || address >= ADDRESS_SPACE) {
+                throw MemoryFault("address " + std::to_string(address) + " is out of the address space");
+            }
+            return static_cast<size_t>(address);
+        }
+
+        // Same as at for an integer address, with no conversion from double
+        double& AtIndex(size_t pos) {
+            if (pos < flat_size_) {
+                return flat_[pos];
+            }
+            if ((pos >> PAGE_BITS) == cached_number_) {
+                return cached_page_[pos & (PAGE_CELLS - 1)];
+            }
+            if (pos >= ADDRESS_SPACE) {
+                throw MemoryFault("address " + std::to_string(pos) + " is out of the address space");
+            }
+            return PagedAt(pos);
+        }
+
+        // Cells from pos on that are contiguous in memory: cuts *count down to
+        // the end of the page or of the flat array and returns the first cell
+        double* Span(size_t pos, size_t* count) {
+            double* cells = &AtIndex(pos);
+            size_t available = pos < flat_size_ ? flat_size_ - pos : PAGE_CELLS - (pos & (PAGE_CELLS - 1));
+            if (*count > available) {
+                *count = available;
+            }
+            return cells;
+        }
+
+        // Bytes taken by allocated pages and their tables or by the flat array
+        size_t Allocated() const {
+            return allocated_;
+        }
+
+        size_t Limit() const {
+            return limit_;
+        }
+
+        bool IsFlat() const {
+            return flat_ != nullptr;
+        }
+
+        const double* FlatData() const {
+            return flat_;
+        }
+
+        size_t FlatSize() const {
+            return flat_size_;
+        }
+
+        // Calls visit(number, cells) for every allocated page, by number
+        template <class Visit>
+        void ForEachPage(Visit visit) const {
+            for (size_t table = 0; table < directory_.size(); ++table) {
+                if (!directory_[table]) {
+                    continue;
+                }
+                for (size_t page = 0; page < TABLE_PAGES; ++page) {
+                    if (directory_[table][page]) {
+                        visit((table << TABLE_BITS) + page, static_cast<const double*>(directory_[table][page]));
+                    }
+                }
+            }
+        }
+
+    private:
+        using Table = std::unique_ptr<double*[]>;
+
+        // The page table entry of the page, allocating the directory and the
+        // table on the way. These count against the limit like pages do.
+        double*& TablePage(size_t number) {
+            if (directory_.empty()) {
+                Reserve(DIRECTORY_TABLES * sizeof(Table));
+                directory_.resize(DIRECTORY_TABLES);
+            }
+            Table& table = directory_[number >> TABLE_BITS];
+            if (!table) {
+                Reserve(TABLE_PAGES * sizeof(double*));
+                table.reset(new double*[TABLE_PAGES]());
+            }
+            return table[number & (TABLE_PAGES - 1)];
+        }
+
+        void Reserve(size_t bytes) {
+            if (allocated_ + bytes > limit_) {
+                throw MemoryFault("memory limit of " + std::to_string(limit_) + " bytes exceeded");
+            }
+            allocated_ += bytes;
+        }
+
+        double& PagedAt(size_t pos) {
+            if (flat_) {
+                throw MemoryFault("address " + std::to_string(pos) + " is past the flat memory of " +
+                                  std::to_string(flat_size_) + " cells");
+            }
+            size_t number = pos >> PAGE_BITS;
+            double*& page = TablePage(number);
+            if (!page) {
+                Reserve(PAGE_CELLS * sizeof(double));
+                owned_pages_.emplace_back(new double[PAGE_CELLS]());
+                page = owned_pages_.back().get();
+            }
+            cached_number_ = number;
+            cached_page_ = page;
+            return cached_page_[pos & (PAGE_CELLS - 1)];
+        }
+
+        size_t limit_;
+        size_t allocated_;
+        double* flat_;
+        size_t flat_size_;
+        std::vector<Table> directory_;
+        size_t cached_number_;
+        double* cached_page_;
+        std::unique_ptr<double[]> owned_flat_;
+        std::vector<std::unique_ptr<double[]>> owned_pages_;
+        std::shared_ptr<void> backing_;
+    };
+
+    // Return positions of CALL, kept apart from the operand stack and the
+    // registers. Going deeper than the limit or returning with no call left
+    // is a MemoryFault.
+    class CallStack {
+    public:
+        static constexpr size_t DEFAULT_LIMIT = size_t(1) << 20;
+
+        explicit CallStack(size_t limit = DEFAULT_LIMIT) : limit_(limit) {
+        }
+
+        void Push(uint32_t position) {
+            if (positions_.size() == limit_) {
+                throw MemoryFault("call depth limit of " + std::to_string(limit_) + " exceeded");
+            }
+            positions_.push_back(position);
+        }
+
+        uint32_t Pop() {
+            if (positions_.empty()) {
+                throw MemoryFault("return without a call");
+            }
+            uint32_t position = positions_.back();
+            positions_.pop_back();
+            return position;
+        }
+
+        size_t Depth() const {
+            return positions_.size();
+        }
+
+        size_t Limit() const {
+            return limit_;
+        }
+
+        void SetLimit(size_t limit) {
+            limit_ = limit;
+        }
+
+        // Positions bottom first
+        const std::vector<uint32_t>& Positions() const {
+            return positions_;
+        }
+
+        void Assign(std::vector<uint32_t> positions) {
+            positions_ = std::move(positions);
+        }
+
+    private:
+        std::vector<uint32_t> positions_;
+        size_t limit_;
+    };
+} // namespace Cpu
@@ -0,0 +1,832 @@
+#pragma once
+
+#include "parser.h"
+#include "verifier.h"
+#include <functional>
+#include <vector>
+
+namespace Cpu {
+    // One parsed assembly line. Jump commands keep their label by name
+    // until the program is emitted.
+    struct AsmCommand {
+        Command command;
+        double args[MAX_ARGS_COUNT];
+        std::string label;
+    };
+
+    // Parsed program: labels map to the index of the command they precede
+    struct AsmProgram {
+        std::vector<AsmCommand> commands;
+        std::unordered_map<std::string, size_t> labels;
+    };
+
+    AsmCommand MakeCommand(Command command, double arg = 0, const std::string& label = "") {
+        AsmCommand result;
+        result.command = command;
+        result.args[0] = arg;
+        result.args[1] = 0;
+        result.label = label;
+        return result;
+    }
+
+    Register PushedRegister(Command command) {
+        switch (command) {
+#define REGISTER(REG, NUM) \
+            case PUSH_##REG:   \
+                return REG;
+#include "registers.h"
+#undef REGISTER
+            default:
+                return NOREG;
+        }
+    }
+
+    Register PoppedRegister(Command command) {
+        switch (command) {
+#define REGISTER(REG, NUM) \
+            case POP_##REG:    \
+                return REG;
+#include "registers.h"
+#undef REGISTER
+            default:
+                return NOREG;
+        }
+    }
+
+    Register StoredRegister(Command command) {
+        switch (command) {
+#define REGISTER(REG, NUM) \
+            case STORE_##REG:  \
+                return REG;
+#include "registers.h"
+#undef REGISTER
+            default:
+                return NOREG;
+        }
+    }
+
+    Command PopRegisterCommand(Register reg) {
+        switch (reg) {
+#define REGISTER(REG, NUM) \
+            case REG:          \
+                return POP_##REG;
+#include "registers.h"
+#undef REGISTER
+            case NOREG:
+                break;
+        }
+        assert(false);
+        return HLT;
+    }
+
+    Command StoreRegisterCommand(Register reg) {
+        switch (reg) {
+#define REGISTER(REG, NUM) \
+            case REG:          \
+                return STORE_##REG;
+#include "registers.h"
+#undef REGISTER
+            case NOREG:
+                break;
+        }
+        assert(false);
+        return HLT;
+    }
+
+    // Maps a binary command or a conditional jump to its form taking the
+    // second operand as an immediate. Returns HLT if there is none.
+    Command ImmediateCommand(Command command) {
+        switch (command) {
+            case ADD:
+                return ADD_IMM;
+            case MUL:
+                return MUL_IMM;
+            case DIV:
+                return DIV_IMM;
+            case SUB:
+                return SUB_IMM;
+            case JE:
+                return JE_IMM;
+            case JNE:
+                return JNE_IMM;
+            case JA:
+                return JA_IMM;
+            default:
+                return HLT;
+        }
+    }
+
+    // Evaluates an immediate command over a constant first operand. For jumps
+    // the result is 1 if the jump is taken and 0 otherwise.
+    bool FoldImmediate(Command command, double first, double second, double* result) {
+        switch (command) {
+            case ADD_IMM:
+                *result = first + second;
+                return true;
+            case MUL_IMM:
+                *result = first * second;
+                return true;
+            case DIV_IMM:
+                *result = first / second;
+                return true;
+            case SUB_IMM:
+                *result = first - second;
+                return true;
+            case JE_IMM:
+                *result = first == second;
+                return true;
+            case JNE_IMM:
+                *result = first != second;
+                return true;
+            case JA_IMM:
+                *result = first > second;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Rewrites the last commands of the program that was emitted so far.
+    // Nothing at or before the barrier may be touched, since a label points
+    // there. Returns whether anything was rewritten.
+    bool ReduceTail(std::vector<AsmCommand>* commands, size_t barrier) {
+        size_t window = commands->size() - barrier;
+        if (window < 2) {
+            return false;
+        }
+        AsmCommand& first = (*commands)[commands->size() - 2];
+        AsmCommand& second = commands->back();
+
+        if (first.command == PUSH) {
+            double value = first.args[0];
+            double folded = 0;
+            if (FoldImmediate(second.command, value, second.args[0], &folded)) {
+                // push a / op b  ->  push (a op b), jumps become jmp or nothing
+                if (IsJumpCommand(second.command)) {
+                    std::string label = second.label;
+                    commands->resize(commands->size() - 2);
+                    if (folded != 0) {
+                        commands->push_back(MakeCommand(JMP, 0, label));
+                    }
+                } else {
+                    commands->pop_back();
+                    commands->back() = MakeCommand(PUSH, folded);
+                }
+                return true;
+            }
+            if (ImmediateCommand(second.command) != HLT) {
+                // push a / add  ->  add a
+                first = MakeCommand(ImmediateCommand(second.command), value, second.label);
+                commands->pop_back();
+                return true;
+            }
+            switch (second.command) {
+                case POP:
+                    commands->resize(commands->size() - 2);
+                    return true;
+                case SQRT:
+                    commands->pop_back();
+                    commands->back().args[0] = sqrt(value);
+                    return true;
+                case ABS:
+                    commands->pop_back();
+                    commands->back().args[0] = fabs(value);
+                    return true;
+                case DUP:
+                    second = first;
+                    return true;
+                default:
+                    break;
+            }
+        }
+
+        if (first.command == DUP && second.command == POP) {
+            commands->resize(commands->size() - 2);
+            return true;
+        }
+        if (first.command == DUP && PoppedRegister(second.command) != NOREG) {
+            Register reg = PoppedRegister(second.command);
+            commands->pop_back();
+            commands->back() = MakeCommand(StoreRegisterCommand(reg));
+            return true;
+        }
+        if (PushedRegister(first.command) != NOREG && second.command == POP) {
+            commands->resize(commands->size() - 2);
+            return true;
+        }
+        if (PushedRegister(first.command) != NOREG && PushedRegister(first.command) == PoppedRegister(second.command)) {
+            commands->resize(commands->size() - 2);
+            return true;
+        }
+        if (PoppedRegister(first.command) != NOREG && PoppedRegister(first.command) == PushedRegister(second.command)) {
+            Register reg = PoppedRegister(first.command);
+            commands->pop_back();
+            commands->back() = MakeCommand(StoreRegisterCommand(reg));
+            return true;
+        }
+        if (StoredRegister(first.command) != NOREG && second.command == POP) {
+            Register reg = StoredRegister(first.command);
+            commands->pop_back();
+            commands->back() = MakeCommand(PopRegisterCommand(reg));
+            return true;
+        }
+        return false;
+    }
+
+    // Local stack-machine peephole pass: folds constants, drops push/pop pairs
+    // and fuses common sequences into superinstructions. Labels are kept
+    // pointing at the first command of whatever their old command became.
+    void PeepholeOptimize(AsmProgram* program) {
+        const std::vector<AsmCommand>& commands = program->commands;
+        std::vector<std::vector<size_t*>> labels_at(commands.size() + 1);
+        for (auto& label : program->labels) {
+            labels_at[label.second].push_back(&label.second);
+        }
+
+        std::vector<AsmCommand> result;
+        result.reserve(commands.size());
+        size_t barrier = 0;
+        for (size_t i = 0; i <= commands.size(); ++i) {
+            if (!labels_at[i].empty()) {
+                barrier = result.size();
+                for (size_t* position : labels_at[i]) {
+                    *position = result.size();
+                }
+            }
+            if (i == commands.size()) {
+                break;
+            }
+            result.push_back(commands[i]);
+            while (ReduceTail(&result, barrier)) {
+            }
+        }
+        program->commands = std::move(result);
+    }
+
+    // Register a command addresses memory through, NOREG for others. Sets
+    // absolute to the command addressing the same cell by a constant and
+    // offset to whether the address adds the argument.
+    Register AddressRegister(Command command, Command* absolute, bool* offset) {
+        switch (command) {
+#define REGISTER(REG, NUM)                  \
+            case PUSH_MEM_##REG:            \
+                *absolute = PUSH_MEM;       \
+                *offset = false;            \
+                return REG;                 \
+            case POP_MEM_##REG:             \
+                *absolute = POP_MEM;        \
+                *offset = false;            \
+                return REG;                 \
+            case PUSH_MEM_OFFSET_##REG:     \
+                *absolute = PUSH_MEM;       \
+                *offset = true;             \
+                return REG;                 \
+            case POP_MEM_OFFSET_##REG:      \
+                *absolute = POP_MEM;        \
+                *offset = true;             \
+                return REG;
+#include "registers.h"
+#undef REGISTER
+            default:
+                return NOREG;
+        }
+    }
+
+    // Puts commands[i] in place of every command i, with labels kept on the
+    // first command of whatever theirs became
+    void ReplaceCommands(AsmProgram* program, std::vector<std::vector<AsmCommand>>* commands) {
+        std::vector<size_t> positions(commands->size() + 1);
+        std::vector<AsmCommand> result;
+        for (size_t i = 0; i < commands->size(); ++i) {
+            positions[i] = result.size();
+            for (auto& command : (*commands)[i]) {
+                result.push_back(std::move(command));
+            }
+        }
+        positions[commands->size()] = result.size();
+        for (auto& label : program->labels) {
+            label.second = positions[label.second];
+        }
+        program->commands = std::move(result);
+    }
+
+    // Basic blocks of a program, split at labels and after every command that
+    // does not just go on to the next one. A block of commands.size() stands
+    // for running off the end.
+    class FlowGraph {
+    public:
+        struct Block {
+            size_t begin;
+            size_t end;
+            // Blocks control can go to from the last command
+            std::vector<size_t> successors;
+        };
+
+        // Fails on labels that are not defined and on commands the verifier
+        // does not know
+        bool Build(const AsmProgram& program) {
+            const auto& commands = program.commands;
+            std::vector<bool> starts(commands.size() + 1);
+            starts[0] = true;
+            for (const auto& label : program.labels) {
+                starts[label.second] = true;
+            }
+            for (size_t i = 0; i < commands.size(); ++i) {
+                size_t pops = 0;
+                size_t pushes = 0;
+                if (!StackEffect(commands[i].command, &pops, &pushes)) {
+                    return false;
+                }
+                if (!commands[i].label.empty() && !program.labels.count(commands[i].label)) {
+                    return false;
+                }
+                if (!FallsThrough(commands[i].command) || IsJumpCommand(commands[i].command)) {
+                    starts[i + 1] = true;
+                }
+            }
+            blocks_.clear();
+            block_at_.assign(commands.size() + 1, 0);
+            for (size_t i = 0; i < commands.size(); ++i) {
+                if (starts[i]) {
+                    blocks_.push_back({i, i, {}});
+                }
+                blocks_.back().end = i + 1;
+                block_at_[i] = blocks_.size() - 1;
+            }
+            block_at_[commands.size()] = blocks_.size();
+            for (auto& block : blocks_) {
+                const AsmCommand& last = commands[block.end - 1];
+                if (IsJumpCommand(last.command)) {
+                    block.successors.push_back(block_at_[program.labels.at(last.label)]);
+                }
+                if (FallsThrough(last.command)) {
+                    block.successors.push_back(block_at_[block.end]);
+                }
+            }
+            return true;
+        }
+
+        // Whether control can go on to the next command. For CALL and JEXEC
+        // it does once the callee returns; RET and RETURN go to a computed
+        // position, which is always after one of them.
+        static bool FallsThrough(Command command) {
+            return command != HLT && command != JMP && command != RET && command != RETURN;
+        }
+
+        const std::vector<Block>& Blocks() const {
+            return blocks_;
+        }
+
+        size_t BlockAt(size_t index) const {
+            return block_at_[index];
+        }
+
+    private:
+        std::vector<Block> blocks_;
+        std::vector<size_t> block_at_;
+    };
+
+    // A register or stack cell in constant propagation: a constant, or not
+    // known
+    struct AbstractValue {
+        bool known = false;
+        double value = 0;
+
+        bool operator==(const AbstractValue& other) const {
+            return known == other.known && (!known || memcmp(&value, &other.value, sizeof(value)) == 0);
+        }
+    };
+
+    AbstractValue Known(double value) {
+        AbstractValue result;
+        result.known = true;
+        result.value = value;
+        return result;
+    }
+
+    // What constant propagation knows at a point of the program
+    struct AbstractState {
+        // Tracked cells at the top of the operand stack
+        static const size_t MAX_STACK = 16;
+
+        bool reached = false;
+        AbstractValue regs[REGISTER_COUNT];
+        // The top of the operand stack, top last. Cells below are not known.
+        std::vector<AbstractValue> stack;
+
+        AbstractValue Pop() {
+            if (stack.empty()) {
+                return AbstractValue();
+            }
+            AbstractValue value = stack.back();
+            stack.pop_back();
+            return value;
+        }
+
+        void Push(AbstractValue value) {
+            if (stack.size() == MAX_STACK) {
+                stack.erase(stack.begin());
+            }
+            stack.push_back(value);
+        }
+
+        // Keeps what both states know. Returns whether this one changed.
+        bool Join(const AbstractState& other) {
+            if (!reached) {
+                *this = other;
+                return true;
+            }
+            bool changed = false;
+            for (size_t i = 0; i < REGISTER_COUNT; ++i) {
+                if (regs[i].known && !(regs[i] == other.regs[i])) {
+                    regs[i] = AbstractValue();
+                    changed = true;
+                }
+            }
+            if (stack.size() > other.stack.size()) {
+                stack.erase(stack.begin(), stack.end() - other.stack.size());
+                changed = true;
+            }
+            for (size_t i = 1; i <= stack.size(); ++i) {
+                AbstractValue& value = stack[stack.size() - i];
+                if (value.known && !(value == other.stack[other.stack.size() - i])) {
+                    value = AbstractValue();
+                    changed = true;
+                }
+            }
+            return changed;
+        }
+    };
+
+    // Whether the conditional jump is known to be taken or not in state
+    bool KnownCondition(const AsmCommand& command, const AbstractState& state, bool* taken) {
+        size_t size = state.stack.size();
+        double folded = 0;
+        switch (command.command) {
+            case JE:
+            case JNE:
+            case JA:
+                if (size < 2 || !state.stack[size - 2].known || !state.stack[size - 1].known) {
+                    return false;
+                }
+                FoldImmediate(ImmediateCommand(command.command), state.stack[size - 2].value,
+                              state.stack[size - 1].value, &folded);
+                break;
+            case JE_IMM:
+            case JNE_IMM:
+            case JA_IMM:
+                if (size < 1 || !state.stack[size - 1].known) {
+                    return false;
+                }
+                FoldImmediate(command.command, state.stack[size - 1].value, command.args[0], &folded);
+                break;
+            default:
+                return false;
+        }
+        *taken = folded != 0;
+        return true;
+    }
+
+    // Runs the command over state, apart from where it goes next
+    void Interpret(const AsmCommand& command, AbstractState* state) {
+        double folded = 0;
+        if (PushedRegister(command.command) != NOREG) {
+            state->Push(state->regs[PushedRegister(command.command)]);
+            return;
+        }
+        if (PoppedRegister(command.command) != NOREG) {
+            state->regs[PoppedRegister(command.command)] = state->Pop();
+            return;
+        }
+        if (StoredRegister(command.command) != NOREG) {
+            AbstractValue value = state->Pop();
+            state->regs[StoredRegister(command.command)] = value;
+            state->Push(value);
+            return;
+        }
+        if (FoldImmediate(command.command, 0, 0, &folded) && !IsJumpCommand(command.command)) {
+            AbstractValue value = state->Pop();
+            state->Push(value.known && FoldImmediate(command.command, value.value, command.args[0], &folded)
+                        ? Known(folded) : AbstractValue());
+            return;
+        }
+        if (ImmediateCommand(command.command) != HLT && !IsJumpCommand(command.command)) {
+            AbstractValue second = state->Pop();
+            AbstractValue first = state->Pop();
+            bool known = first.known && second.known &&
+                         FoldImmediate(ImmediateCommand(command.command), first.value, second.value, &folded);
+            state->Push(known ? Known(folded) : AbstractValue());
+            return;
+        }
+        switch (command.command) {
+            case PUSH:
+                state->Push(Known(command.args[0]));
+                return;
+            case DUP: {
+                AbstractValue value = state->Pop();
+                state->Push(value);
+                state->Push(value);
+                return;
+            }
+            case SQRT:
+            case ABS: {
+                AbstractValue value = state->Pop();
+                if (value.known) {
+                    value.value = command.command == SQRT ? sqrt(value.value) : fabs(value.value);
+                }
+                state->Push(value);
+                return;
+            }
+            case JEXEC:
+                state->regs[RDX] = AbstractValue();
+                return;
+            default:
+                break;
+        }
+        size_t pops = 0;
+        size_t pushes = 0;
+        StackEffect(command.command, &pops, &pushes);
+        for (size_t i = 0; i < pops; ++i) {
+            state->Pop();
+        }
+        for (size_t i = 0; i < pushes; ++i) {
+            state->Push(AbstractValue());
+        }
+    }
+
+    // Abstract interpretation of the operand stack and registers over the
+    // flow graph. Register reads of known constants become the constants,
+    // conditional jumps known to go one way become pops and maybe a jmp, and
+    // commands control never reaches are dropped. Returns whether anything
+    // changed.
+    bool PropagateConstants(AsmProgram* program) {
+        FlowGraph graph;
+        if (!graph.Build(*program)) {
+            return false;
+        }
+        const auto& blocks = graph.Blocks();
+        const auto& commands = program->commands;
+        std::vector<AbstractState> entry(blocks.size() + 1);
+        std::vector<size_t> work = {0};
+        entry[0].reached = true;
+        auto walk = [&](size_t b, const std::function<void(size_t, const AbstractState&)>& visit) {
+            AbstractState state = entry[b];
+            for (size_t i = blocks[b].begin; i < blocks[b].end; ++i) {
+                visit(i, state);
+                Interpret(commands[i], &state);
+            }
+            return state;
+        };
+        while (!work.empty()) {
+            size_t b = work.back();
+            work.pop_back();
+            if (b == blocks.size()) {
+                continue;
+            }
+            const AsmCommand& last = commands[blocks[b].end - 1];
+            AbstractState before;
+            AbstractState state = walk(b, [&](size_t i, const AbstractState& current) {
+                if (i + 1 == blocks[b].end) {
+                    before = current;
+                }
+            });
+            bool taken = false;
+            bool known = KnownCondition(last, before, &taken);
+            const auto& successors = blocks[b].successors;
+            for (size_t k = 0; k < successors.size(); ++k) {
+                // The jump target comes first, the next command last
+                bool is_target = IsJumpCommand(last.command) && k == 0;
+                bool is_next = FlowGraph::FallsThrough(last.command) && k + 1 == successors.size();
+                size_t successor = successors[k];
+                if (known && !(taken ? is_target : is_next)) {
+                    continue;
+                }
+                AbstractState into = state;
+                if (is_next && !is_target && (last.command == CALL || last.command == JEXEC)) {
+                    // Whatever the callee left
+                    into = AbstractState();
+                    into.reached = true;
+                }
+                if (entry[successor].Join(into)) {
+                    work.push_back(successor);
+                }
+            }
+        }
+
+        bool changed = false;
+        std::vector<std::vector<AsmCommand>> replacements(commands.size());
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            if (!entry[b].reached) {
+                changed = true;
+                continue;
+            }
+            walk(b, [&](size_t i, const AbstractState& state) {
+                const AsmCommand& command = commands[i];
+                std::vector<AsmCommand>& replacement = replacements[i];
+                Register reg = PushedRegister(command.command);
+                Command absolute = HLT;
+                bool offset = false;
+                bool taken = false;
+                if (reg != NOREG && state.regs[reg].known) {
+                    replacement.push_back(MakeCommand(PUSH, state.regs[reg].value));
+                } else if ((reg = AddressRegister(command.command, &absolute, &offset)) != NOREG &&
+                           state.regs[reg].known) {
+                    replacement.push_back(MakeCommand(absolute, offset ? command.args[0] + state.regs[reg].value
+                                                                       : state.regs[reg].value));
+                } else if (KnownCondition(command, state, &taken)) {
+                    size_t pops = 0;
+                    size_t pushes = 0;
+                    StackEffect(command.command, &pops, &pushes);
+                    replacement.assign(pops, MakeCommand(POP));
+                    if (taken) {
+                        replacement.push_back(MakeCommand(JMP, 0, command.label));
+                    }
+                } else {
+                    replacement.push_back(command);
+                    return;
+                }
+                changed = true;
+            });
+        }
+        if (changed) {
+            ReplaceCommands(program, &replacements);
+        }
+        return changed;
+    }
+
+    // Turns stores to registers that are never read afterwards into plain
+    // pops, or drops them for STORE. Calls, returns and RET may read any
+    // register. Returns whether anything changed.
+    bool RemoveDeadStores(AsmProgram* program) {
+        FlowGraph graph;
+        if (!graph.Build(*program)) {
+            return false;
+        }
+        const auto& blocks = graph.Blocks();
+        const auto& commands = program->commands;
+        const uint32_t ALL = (uint32_t(1) << REGISTER_COUNT) - 1;
+        // Registers read before being written, from before the command on
+        auto live_before = [&](const AsmCommand& command, uint32_t live) {
+            Command absolute = HLT;
+            bool offset = false;
+            switch (command.command) {
+                case HLT:
+                    return uint32_t(0);
+                case CALL:
+                case JEXEC:
+                case RET:
+                case RETURN:
+                    return ALL;
+                default:
+                    break;
+            }
+            Register written = PoppedRegister(command.command) != NOREG ? PoppedRegister(command.command)
+                                                                         : StoredRegister(command.command);
+            if (written != NOREG) {
+                live &= ~(uint32_t(1) << written);
+            }
+            Register read = PushedRegister(command.command) != NOREG ? PushedRegister(command.command)
+                                                                      : AddressRegister(command.command, &absolute, &offset);
+            if (read != NOREG) {
+                live |= uint32_t(1) << read;
+            }
+            return live;
+        };
+        std::vector<uint32_t> live_in(blocks.size() + 1, 0);
+        auto live_out = [&](size_t b) {
+            uint32_t live = 0;
+            for (size_t successor : blocks[b].successors) {
+                live |= live_in[successor];
+            }
+            return live;
+        };
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t b = blocks.size(); b-- > 0;) {
+                uint32_t live = live_out(b);
+                for (size_t i = blocks[b].end; i-- > blocks[b].begin;) {
+                    live = live_before(commands[i], live);
+                }
+                changed |= live != live_in[b];
+                live_in[b] = live;
+            }
+        }
+
+        bool changed = false;
+        std::vector<std::vector<AsmCommand>> replacements(commands.size());
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            uint32_t live = live_out(b);
+            for (size_t i = blocks[b].end; i-- > blocks[b].begin;) {
+                const AsmCommand& command = commands[i];
+                Register popped = PoppedRegister(command.command);
+                Register stored = StoredRegister(command.command);
+                if (popped != NOREG && !(live & (uint32_t(1) << popped))) {
+                    replacements[i].push_back(MakeCommand(POP));
+                    changed = true;
+                } else if (!(stored != NOREG && !(live & (uint32_t(1) << stored)))) {
+                    replacements[i].push_back(command);
+                } else {
+                    changed = true;
+                }
+                live = live_before(command, live);
+            }
+        }
+        if (changed) {
+            ReplaceCommands(program, &replacements);
+        }
+        return changed;
+    }
+
+    // Longest run of commands before a hlt that ThreadJumps copies in place
+    // of a jmp to it
+    const size_t MAX_COPIED_TAIL = 2;
+
+    // Points jumps at the end of the chain of jmp commands they land on,
+    // replaces a jmp to a few commands ending with hlt by a copy of them and
+    // drops jumps to the next command. Returns whether anything changed.
+    bool ThreadJumps(AsmProgram* program) {
+        auto& commands = program->commands;
+        for (const auto& command : commands) {
+            if (!command.label.empty() && !program->labels.count(command.label)) {
+                return false;
+            }
+        }
+        bool changed = false;
+        std::vector<std::vector<AsmCommand>> replacements(commands.size());
+        for (size_t i = 0; i < commands.size(); ++i) {
+            AsmCommand command = commands[i];
+            if (IsJumpCommand(command.command)) {
+                size_t target = program->labels.at(command.label);
+                // A chain longer than the program is a loop
+                for (size_t steps = 0; target < commands.size() && commands[target].command == JMP &&
+                                       steps < commands.size(); ++steps) {
+                    command.label = commands[target].label;
+                    target = program->labels.at(command.label);
+                }
+                changed |= command.label != commands[i].label;
+                // Commands from the target up to a hlt, if there are few
+                // and none of them jumps
+                size_t tail = target;
+                while (tail < commands.size() && tail - target < MAX_COPIED_TAIL &&
+                       FlowGraph::FallsThrough(commands[tail].command) && !IsJumpCommand(commands[tail].command)) {
+                    ++tail;
+                }
+                if (command.command == JMP && (tail == commands.size() || commands[tail].command == HLT)) {
+                    // The program ends with hlt once emitted
+                    replacements[i].assign(commands.begin() + target, commands.begin() + tail);
+                    replacements[i].push_back(MakeCommand(HLT));
+                    changed = true;
+                    continue;
+                } else if (target == i + 1 && command.command != CALL && command.command != JEXEC) {
+                    size_t pops = 0;
+                    size_t pushes = 0;
+                    StackEffect(command.command, &pops, &pushes);
+                    replacements[i].assign(pops, MakeCommand(POP));
+                    changed = true;
+                    continue;
+                }
+            }
+            replacements[i].push_back(command);
+        }
+        if (changed) {
+            ReplaceCommands(program, &replacements);
+        }
+        return changed;
+    }
+
+    // Drops labels no jump refers to, so the peephole pass can work across
+    // where they were. Returns whether there were any.
+    bool RemoveUnusedLabels(AsmProgram* program) {
+        std::set<std::string> used;
+        for (const auto& command : program->commands) {
+            if (IsJumpCommand(command.command)) {
+                used.insert(command.label);
+            }
+        }
+        size_t count = program->labels.size();
+        for (auto label = program->labels.begin(); label != program->labels.end();) {
+            label = used.count(label->first) ? std::next(label) : program->labels.erase(label);
+        }
+        return program->labels.size() != count;
+    }
+
+    // The whole-program passes above and the peephole pass, in turn until
+    // none of them finds anything more to do. Unused labels are dropped
+    // unless keep_labels is set, for programs compiled with symbols.
+    void GlobalOptimize(AsmProgram* program, bool keep_labels = false) {
+        const size_t MAX_ROUNDS = 16;
+        for (size_t round = 0; round < MAX_ROUNDS; ++round) {
+            size_t size = program->commands.size();
+            bool changed = PropagateConstants(program);
+            changed |= ThreadJumps(program);
+            changed |= RemoveDeadStores(program);
+            if (!keep_labels) {
+                changed |= RemoveUnusedLabels(program);
+            }
+            PeepholeOptimize(program);
+            if (!changed && program->commands.size() == size) {
+                break;
+            }
+        }
+    }
+} // namespace Cpu
@@ -1,7 +1,11 @@
 #pragma once
 
 #include "../stack/stack.h"
+#include "../stack/fast_stack.h"
 #include "../onegin/main.h"
+#include "memory.h"
+#include "vector.h"
+#include "io.h"
 #include <string>
 #include <cassert>
 #include <iostream>
@@ -9,22 +13,37 @@
 #include "string"
 #include <sstream>
 #include <map>
+#include <unordered_map>
+#include <cctype>
+#include <set>
+#include <vector>
 #include <cmath>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define UNUSED(x) (void)(x)
 
 namespace Cpu {
-    using CpuStack = Stack<double>;
+    // The canary-checked Stack verifies itself on every operation, which makes
+    // each command O(stack size). It is only used when CPU_CHECKED_STACK is set.
+#ifdef CPU_CHECKED_STACK
+    template <class T>
+    using CpuStack = Stack<T>;
+#else
+    template <class T>
+    using CpuStack = FastStack<T>;
+#endif
     const size_t MAX_COMMAND_COUNT = 256;
     const size_t MAX_ARGS_COUNT = 2;
     const size_t MAX_STRING_LENGTH = 1000;
+    const uint32_t NO_INDEX = UINT32_MAX;
     const size_t REGISTER_COUNT = 0
 #define REGISTER(NAME, NUM) + 1
 #include "registers.h"
 #undef REGISTER
 ;
-    class Cpu;
-
     enum Register {
 #define REGISTER(NAME, NUM) NAME = NUM,
 #include "registers.h"
@@ -32,6 +51,43 @@ namespace Cpu {
         NOREG = 99
     };
 
+    const size_t INT_REGISTER_COUNT = 0
+#define REGISTER(NAME, NUM)
+#define INT_REGISTER(NAME, NUM) + 1
+#include "registers.h"
+#undef INT_REGISTER
+#undef REGISTER
+;
+    enum IntRegister {
+#define REGISTER(NAME, NUM)
+#define INT_REGISTER(NAME, NUM) NAME = NUM,
+#include "registers.h"
+#undef INT_REGISTER
+#undef REGISTER
+    };
+
+    // Integer value of a double as cvttsd2si gives it: truncated, with the
+    // lowest integer for NaN and anything out of range
+    int64_t DoubleToInt(double value) {
+        if (!(value >= -9223372036854775808.0 && value < 9223372036854775808.0)) {
+            return INT64_MIN;
+        }
+        return static_cast<int64_t>(value);
+    }
+
+    // Integer arithmetic wraps around like the hardware does
+    int64_t WrappingAdd(int64_t first, int64_t second) {
+        return static_cast<int64_t>(static_cast<uint64_t>(first) + static_cast<uint64_t>(second));
+    }
+
+    int64_t WrappingSub(int64_t first, int64_t second) {
+        return static_cast<int64_t>(static_cast<uint64_t>(first) - static_cast<uint64_t>(second));
+    }
+
+    int64_t WrappingMul(int64_t first, int64_t second) {
+        return static_cast<int64_t>(static_cast<uint64_t>(first) * static_cast<uint64_t>(second));
+    }
+
     Register RegisterFromString(const std::string& name) {
 #define REGISTER(NAME, NUM)  \
         if (#NAME == name)   \
@@ -53,146 +109,347 @@ std::string StringFromRegister(Register reg) {
     }
 }
 
-    bool ReadSimpleCommand(const std::string& command_line, const std::string& name, int arg_num, double* args) {
-        std::stringstream command_stream(command_line);
-        std::string command_name;
-        command_stream >> command_name;
-        if (command_name != name) {
-            return false;
-        }
-        for (int i = 0; i < arg_num && command_stream.good(); ++i) {
-            command_stream >> args[i];
-        }
-        return command_stream && command_stream.eof();
-    }
+    enum Command : uint8_t {
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+NAME,
 
-    std::string WriteSimpleCommand(const std::string& name, int arg_num, const double* args) {
-        std::stringstream command_stream;
-        command_stream << name << ' ';
-        for (int i = 0; i < arg_num && command_stream.good(); ++i) {
-            command_stream << args[i];
+#include "commands.h"
+
+#undef COMMAND
+    };
+
+    const size_t COMMAND_COUNT = 0
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) + 1
+#include "commands.h"
+#undef COMMAND
+;
+
+    constexpr size_t SyntaxOperandCount(const char* syntax) {
+        size_t count = 0;
+        for (; *syntax != '\0'; ++syntax) {
+            count += *syntax == '#' || *syntax == '@';
         }
-        return command_stream.str();
+        return count;
     }
 
-    bool ReadMemCommand(const std::string& command_line, const std::string& name,
-                        const std::string& left_bracket, const std::string& right_bracket, double* args) {
-        std::stringstream command_stream(command_line);
-        std::string command_name;
-        command_stream >> command_name;
-        if (command_name != name) {
-            return false;
-        }
-        for (size_t i = 0; i < left_bracket.size(); ++i) {
-            char c;
-            command_stream >> c;
-            if (c != left_bracket[i]) {
-                return false;
+    constexpr bool SyntaxHasLabel(const char* syntax) {
+        for (; *syntax != '\0'; ++syntax) {
+            if (*syntax == '@') {
+                return true;
             }
         }
-        command_stream >> args[0];
-        for (size_t i = 0; i < right_bracket.size(); ++i) {
-            char c;
-            command_stream >> c;
-            if (c != right_bracket[i]) {
-                return false;
-            }
-        }
-        command_stream.peek();
-        return command_stream && command_stream.eof();
+        return false;
     }
 
-    std::string WriteMemCommand(const std::string& name,
-                                const std::string& left_bracket, const std::string& right_bracket, const double* args) {
-        std::stringstream command_stream;
-        command_stream << name << ' ' << left_bracket;
-        command_stream << args[0] << right_bracket;
-        return command_stream.str();
-    }
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+    static_assert(SyntaxOperandCount(SYNTAX) == PARAM_CNT, "Syntax of " #NAME " does not match its operand count");
 
-    bool ReadJumpCommand(const std::string& command_line, const std::string& name) {
-        std::stringstream command_stream(command_line);
-        std::string command_name;
-        command_stream >> command_name;
-        if (command_name != name) {
-            return false;
-        }
-        std::string label;
-        command_stream >> label;
-        if (label.empty()) {
-            return false;
-        }
-        return command_stream && command_stream.eof();
-    }
-    std::string GetJumpLabel(const std::string& command_line) {
-        std::stringstream command_stream(command_line);
-        std::string label;
-        command_stream >> label;
-        assert(!label.empty());
-        label.clear();
-        command_stream >> label;
-        assert(!label.empty());
-        return label;
-    }
+#include "commands.h"
 
-    enum Command : uint8_t {
-#define COMMAND(NAME, PARAM_CNT, READ, WRITE, CODE) \
-NAME,
+#undef COMMAND
+
+    const char* CommandName(Command command) {
+        static const char* const NAMES[] = {
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+            #NAME,
 
 #include "commands.h"
 
 #undef COMMAND
-    };
+        };
+        return NAMES[command];
+    }
+
+    const char* CommandSyntax(Command command) {
+        static const char* const SYNTAX[] = {
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+            SYNTAX,
 
-    void CommandFromString(const std::string& command_line, Command *command, double *args) {
-        bool result = false;
-#define COMMAND(NAME, PARAM_CNT, READ, WRITE, CODE) \
-        READ;                                       \
-        if (result) {                               \
-            *command = NAME;                        \
-            return;                                 \
-        }                                           
 #include "commands.h"
+
 #undef COMMAND
+        };
+        return SYNTAX[command];
+    }
+
+    size_t CommandParamCnt(Command command) {
+        static const uint8_t PARAM_COUNTS[] = {
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+            PARAM_CNT,
+
+#include "commands.h"
 
-        // No match found
-        assert(false);
+#undef COMMAND
+        };
+        return PARAM_COUNTS[command];
     }
 
-    std::string StringFromCommand(Command command, const double *args) {
-        std::string result;
-        switch (command) {
-#define COMMAND(NAME, PARAM_CNT, READ, WRITE, CODE) \
-            case (NAME):                            \
-                WRITE;                              \
-                return result;
+    // The label is always the last operand of a jump command
+    bool IsJumpCommand(Command command) {
+        static const bool JUMPS[] = {
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+            SyntaxHasLabel(SYNTAX),
 
 #include "commands.h"
 
 #undef COMMAND
+        };
+        return JUMPS[command];
+    }
+
+    bool IsRegisterName(const char* name, size_t length) {
+#define REGISTER(NAME, NUM)                                                   \
+        if (length == sizeof(#NAME) - 1 && memcmp(name, #NAME, length) == 0) { \
+            return true;                                                      \
         }
+#define INT_REGISTER(NAME, NUM) REGISTER(NAME, NUM)
+#include "registers.h"
+#undef INT_REGISTER
+#undef REGISTER
+        return false;
     }
-    
-    size_t CommandParamCnt(Command command) {
-        switch (command) {
-#define COMMAND(NAME, PARAM_CNT, READ, WRITE, CODE) \
-            case (NAME):                            \
-                return PARAM_CNT;
+
+    // One assembly line split into its shape and operands. The shape is the line
+    // with numbers replaced by '#', labels by '@' and spacing normalized, so
+    // "push  [ RAX + 5 ]" has the shape "push [RAX+#]", same as the syntax of
+    // PUSH_MEM_OFFSET_RAX.
+    struct ScannedLine {
+        std::string shape;
+        double numbers[MAX_ARGS_COUNT];
+        size_t numbers_count;
+        std::string label;
+        const char* last_number;
+        size_t last_number_length;
+    };
+
+    // Hand-written tokenizer producing a ScannedLine. With pattern set, '#' and
+    // '@' are kept as they are, which is how command syntaxes are scanned.
+    // Returns false if the line has more numbers than any command takes.
+    bool ScanLine(const char* line, ScannedLine* scanned, bool pattern = false) {
+        scanned->shape.clear();
+        scanned->numbers_count = 0;
+        scanned->label.clear();
+        scanned->last_number = nullptr;
+        scanned->last_number_length = 0;
+        int depth = 0;
+        const char* p = line;
+        while (true) {
+            while (isspace(static_cast<unsigned char>(*p))) {
+                ++p;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            if (*p == '[' || *p == ']' || (*p == '+' && depth > 0)) {
+                if (*p == '[' && depth == 0 && !scanned->shape.empty()) {
+                    scanned->shape.push_back(' ');
+                }
+                depth += *p == '[' ? 1 : (*p == ']' ? -1 : 0);
+                scanned->shape.push_back(*p++);
+                continue;
+            }
+            const char* word = p;
+            while (*p != '\0' && !isspace(static_cast<unsigned char>(*p)) && *p != '[' && *p != ']' &&
+                   !(*p == '+' && depth > 0)) {
+                ++p;
+            }
+            size_t length = p - word;
+            if (depth == 0 && !scanned->shape.empty()) {
+                scanned->shape.push_back(' ');
+            }
+            if (scanned->shape.empty() || (pattern && length == 1 && (*word == '#' || *word == '@')) ||
+                IsRegisterName(word, length)) {
+                scanned->shape.append(word, length);
+                continue;
+            }
+            char* end = nullptr;
+            double number = strtod(word, &end);
+            if (end == p) {
+                if (scanned->numbers_count == MAX_ARGS_COUNT) {
+                    return false;
+                }
+                scanned->numbers[scanned->numbers_count++] = number;
+                scanned->last_number = word;
+                scanned->last_number_length = length;
+                scanned->shape.push_back('#');
+            } else {
+                scanned->label.assign(word, length);
+                scanned->shape.push_back('@');
+            }
+        }
+        return true;
+    }
+
+    // Assembles one line through a hash table from shape to command built from
+    // the command syntaxes. The label of a jump command is returned separately
+    // and its argument is left zero. Returns false if no command matches.
+    bool ParseCommand(const std::string& command_line, Command* command, double* args, std::string* label) {
+        static const std::unordered_map<std::string, Command> COMMANDS = [] {
+            std::unordered_map<std::string, Command> commands;
+            ScannedLine scanned;
+            bool unique = true;
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE)                 \
+            ScanLine(SYNTAX, &scanned, true);                  \
+            unique &= commands.emplace(scanned.shape, NAME).second;
 
 #include "commands.h"
 
 #undef COMMAND
+            assert(unique);
+            UNUSED(unique);
+            return commands;
+        }();
+
+        ScannedLine scanned;
+        if (!ScanLine(command_line.c_str(), &scanned)) {
+            return false;
+        }
+        auto it = COMMANDS.find(scanned.shape);
+        if (it == COMMANDS.end() && scanned.label.empty() && scanned.numbers_count > 0 &&
+            scanned.shape.back() == '#') {
+            // The last operand might be a label that looks like a number
+            scanned.shape.back() = '@';
+            scanned.label.assign(scanned.last_number, scanned.last_number_length);
+            --scanned.numbers_count;
+            it = COMMANDS.find(scanned.shape);
         }
+        if (it == COMMANDS.end()) {
+            return false;
+        }
+        *command = it->second;
+        for (size_t i = 0; i < CommandParamCnt(*command); ++i) {
+            args[i] = i < scanned.numbers_count ? scanned.numbers[i] : 0;
+        }
+        *label = scanned.label;
+        return true;
     }
 
+    // The label operand is printed as label if it is given and taken from args
+    // otherwise
+    std::string StringFromCommand(Command command, const double *args, const std::string& label = "") {
+        std::stringstream command_stream;
+        for (const char* syntax = CommandSyntax(command); *syntax != '\0'; ++syntax) {
+            if (*syntax == '#') {
+                command_stream << *args++;
+            } else if (*syntax == '@' && !label.empty()) {
+                command_stream << label;
+            } else if (*syntax == '@') {
+                command_stream << std::to_string(*args++);
+            } else {
+                command_stream << *syntax;
+            }
+        }
+        return command_stream.str();
+    }
+
+    // One command of a compiled program. The numeric operand is an index into
+    // the constant pool and the label operand is the index of the target
+    // command, so every field is naturally aligned.
+    struct Instruction {
+        Command command;
+        uint8_t reserved[3];
+        uint32_t constant;
+        uint32_t target;
+    };
+    static_assert(sizeof(Instruction) == 12, "Instruction must stay a dense 12 byte record");
+
+    // Compiled program layout:
+    //   ProgramHeader
+    //   double constants[constants_count]      constant 0 is always 0
+    //   Instruction code[code_count]
+    //   symbols_count labels, each a uint32_t command index followed by its
+    //   zero-terminated name and padded to 4 bytes; symbols_size bytes in total
+    struct ProgramHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t constants_count;
+        uint32_t code_count;
+        uint32_t symbols_count;
+        uint32_t symbols_size;
+    };
+    static_assert(sizeof(ProgramHeader) % alignof(double) == 0, "Constants must follow the header aligned");
+
+    const char PROGRAM_MAGIC[4] = {'C', 'P', 'U', 'B'};
+    const uint32_t PROGRAM_VERSION = 1;
+
+    // Sections of a compiled program, used in place
+    class ProgramImage {
+    public:
+        explicit ProgramImage(const char* program)
+            : header_(reinterpret_cast<const ProgramHeader*>(program)) {
+            assert(reinterpret_cast<uintptr_t>(program) % alignof(double) == 0);
+            if (memcmp(header_->magic, PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC)) != 0) {
+                errx(1, "Not a compiled cpu program");
+            }
+            if (header_->version != PROGRAM_VERSION) {
+                errx(1, "Unsupported program version %u, expected %u", header_->version, PROGRAM_VERSION);
+            }
+            constants_ = reinterpret_cast<const double*>(header_ + 1);
+            code_ = reinterpret_cast<const Instruction*>(constants_ + header_->constants_count);
+            symbols_ = reinterpret_cast<const char*>(code_ + header_->code_count);
+        }
+
+        const double* Constants() const {
+            return constants_;
+        }
+
+        const Instruction* Code() const {
+            return code_;
+        }
+
+        size_t Size() const {
+            return header_->code_count;
+        }
+
+        // Label names by command index, empty if the program has no symbol table
+        std::vector<std::pair<uint32_t, std::string>> Symbols() const {
+            std::vector<std::pair<uint32_t, std::string>> symbols;
+            const char* symbol = symbols_;
+            for (uint32_t i = 0; i < header_->symbols_count; ++i) {
+                uint32_t index = 0;
+                memcpy(&index, symbol, sizeof(index));
+                std::string name(symbol + sizeof(index));
+                symbols.emplace_back(index, name);
+                symbol += (sizeof(index) + name.size() + 1 + 3) / 4 * 4;
+            }
+            return symbols;
+        }
+
+        // Command index of the label, NO_INDEX if the symbol table has none
+        uint32_t FindSymbol(const std::string& name) const {
+            for (const auto& symbol : Symbols()) {
+                if (symbol.second == name) {
+                    return symbol.first;
+                }
+            }
+            return NO_INDEX;
+        }
+
+        // Bytes taken by the whole program
+        size_t Length() const {
+            return symbols_ - reinterpret_cast<const char*>(header_) + header_->symbols_size;
+        }
+
+    private:
+        const ProgramHeader* header_;
+        const double* constants_;
+        const Instruction* code_;
+        const char* symbols_;
+    };
+
+    // Positions of commands are their indices in the code section
     class CommandsReader {
     public:
         virtual ~CommandsReader() = default;
 
         virtual void NextCommand(Command *command) = 0;
 
+        // Numeric operands of the current command
         virtual const double* GetArgs() const = 0;
 
+        // Label operand of the current command
+        virtual size_t GetTarget() const = 0;
+
         virtual void Jump(size_t pos) = 0;
 
         virtual size_t GetNextPosition() const = 0;
@@ -204,27 +461,31 @@ NAME,
     class BufferCommandsReader : public CommandsReader {
     public:
         explicit BufferCommandsReader(const char* program)
-            : position_(0), last_args_count_(0), buffer_(program) {
+            : position_(0), current_(nullptr), buffer_(nullptr), code_(nullptr), constants_(nullptr) {
+            if (program) {
+                Load(program);
+            }
         }
 
         void NextCommand(Command *command) override {
-            position_ += last_args_count_ * sizeof(double);
-            *command = Command(buffer_[position_]);
-            last_args_count_ = CommandParamCnt(*command);
-            ++position_;
+            current_ = code_ + position_++;
+            *command = current_->command;
         }
 
         const double* GetArgs() const override {
-            return reinterpret_cast<const double*>(buffer_ + position_);
+            return constants_ + current_->constant;
+        }
+
+        size_t GetTarget() const override {
+            return current_->target;
         }
 
         void Jump(size_t pos) override {
             position_ = pos;
-            last_args_count_ = 0;
         }
 
         size_t GetNextPosition() const override {
-            return position_  + sizeof(double) * last_args_count_;
+            return position_;
         }
 
         std::pair<const char*, size_t> GetCompiled() const override {
@@ -232,46 +493,488 @@ NAME,
         }
 
     protected:
+        void Load(const char* program) {
+            ProgramImage image(program);
+            buffer_ = program;
+            code_ = image.Code();
+            constants_ = image.Constants();
+        }
+
         size_t position_;
-        size_t last_args_count_;
+        const Instruction* current_;
         const char* buffer_;
+        const Instruction* code_;
+        const double* constants_;
     };
 
     class BinaryFileCommandsReader : public BufferCommandsReader {
     public:
         explicit BinaryFileCommandsReader(const char* filename)
             : BufferCommandsReader(nullptr), buffer_holder_(readFile(filename)) {
-            buffer_ = buffer_holder_.get();
+            Load(buffer_holder_.get());
         }
 
     private:
         std::unique_ptr<char[]> buffer_holder_;
     };
 
-    class Memory {
+    // Read-only mapping of a compiled program file. Processes and Cpus running
+    // the same file share its pages.
+    class MappedProgram {
+    public:
+        explicit MappedProgram(const char* filename) : region_(MAP_FAILED), length_(0) {
+            std::string error;
+            if (!Map(filename, &error)) {
+                errx(1, "%s", error.c_str());
+            }
+        }
+
+        // The mapping of the file, or null with the reason in error if it is
+        // not a whole compiled program
+        static std::unique_ptr<MappedProgram> Open(const char* filename, std::string* error) {
+            std::unique_ptr<MappedProgram> program(new MappedProgram());
+            if (!program->Map(filename, error)) {
+                return nullptr;
+            }
+            return program;
+        }
+
+        MappedProgram(const MappedProgram&) = delete;
+        MappedProgram& operator=(const MappedProgram&) = delete;
+
+        ~MappedProgram() {
+            if (region_ != MAP_FAILED) {
+                munmap(region_, length_);
+            }
+        }
+
+        const char* Data() const {
+            return static_cast<const char*>(region_);
+        }
+
+    private:
+        MappedProgram() : region_(MAP_FAILED), length_(0) {
+        }
+
+        bool Map(const char* filename, std::string* error) {
+            auto fail = [&](const std::string& reason, bool with_errno) {
+                *error = with_errno ? reason + ": " + strerror(errno) : reason;
+                return false;
+            };
+            int fd = open(filename, O_RDONLY);
+            if (fd < 0) {
+                return fail(std::string("Failed to open file ") + filename, true);
+            }
+            struct stat statbuf;
+            if (fstat(fd, &statbuf) < 0) {
+                close(fd);
+                return fail("Error calling stat", true);
+            }
+            if (!S_ISREG(statbuf.st_mode)) {
+                close(fd);
+                return fail("Regular file expected", false);
+            }
+            length_ = statbuf.st_size;
+            if (length_ < sizeof(ProgramHeader)) {
+                close(fd);
+                return fail("Not a compiled cpu program", false);
+            }
+            region_ = mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (region_ == MAP_FAILED) {
+                close(fd);
+                return fail("Failed to map file", true);
+            }
+            close(fd);
+            // Start reading the whole program in, jumps make access random
+            madvise(region_, length_, MADV_WILLNEED);
+            madvise(region_, length_, MADV_RANDOM);
+            // ProgramImage exits on these
+            ProgramHeader header;
+            memcpy(&header, region_, sizeof(header));
+            if (memcmp(header.magic, PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC)) != 0) {
+                return fail("Not a compiled cpu program", false);
+            }
+            if (header.version != PROGRAM_VERSION) {
+                return fail("Unsupported program version " + std::to_string(header.version) + ", expected " +
+                            std::to_string(PROGRAM_VERSION), false);
+            }
+            if (ProgramImage(Data()).Length() > length_) {
+                return fail("Truncated program", false);
+            }
+            return true;
+        }
+
+        void* region_;
+        size_t length_;
+    };
+
+    // Executes straight from a MappedProgram, so startup does not depend on
+    // the program size
+    class MappedFileCommandsReader : public BufferCommandsReader {
     public:
-        double& at(size_t pos) {
-            if (pos >= buffer.size()) {
-                buffer.resize(pos + 1);
+        explicit MappedFileCommandsReader(const char* filename)
+            : BufferCommandsReader(nullptr), program_(filename) {
+            Load(program_.Data());
+        }
+
+    private:
+        MappedProgram program_;
+    };
+
+    // Runs the code section of a compiled program in place: it already is an
+    // aligned array with label operands resolved into command indices.
+    // Positions kept in registers by JEXEC/RET are command indices as well.
+    class DecodedProgram {
+    public:
+        explicit DecodedProgram(const char* program) : image_(program) {
+        }
+
+        const ProgramImage& Image() const {
+            return image_;
+        }
+
+        const Instruction* Code() const {
+            return image_.Code();
+        }
+
+        const double* Constants() const {
+            return image_.Constants();
+        }
+
+        double Arg(const Instruction& instruction) const {
+            return image_.Constants()[instruction.constant];
+        }
+
+        size_t Size() const {
+            return image_.Size();
+        }
+
+        uint32_t IndexOf(size_t position) const {
+            assert(position < Size());
+            return position;
+        }
+
+        // Same as IndexOf, but returns NO_INDEX for positions that are not commands
+        uint32_t FindIndex(double position) const {
+            if (!(position >= 0) || position >= Size()) {
+                return NO_INDEX;
             }
-            return buffer[pos];
+            return static_cast<uint32_t>(position);
+        }
+
+        size_t PositionOf(size_t index) const {
+            return index;
         }
+
     private:
-        std::vector<double> buffer;
+        ProgramImage image_;
+    };
+
+    // What every engine throws on a computed jump to a position that is not a command
+    inline MemoryFault NotACommand(double position) {
+        char reason[64];
+        snprintf(reason, sizeof(reason), "ret to %g, which is not a command", position);
+        return MemoryFault(reason);
+    }
+
+    enum class Engine {
+        SWITCH,
+        THREADED,
+        DECODED,
+        JIT
+    };
+
+    bool EngineFromString(const std::string& name, Engine* engine) {
+        if (name == "switch") {
+            *engine = Engine::SWITCH;
+            return true;
+        }
+        if (name == "threaded") {
+            *engine = Engine::THREADED;
+            return true;
+        }
+        if (name == "decoded") {
+            *engine = Engine::DECODED;
+            return true;
+        }
+        if (name == "jit") {
+            *engine = Engine::JIT;
+            return true;
+        }
+        return false;
+    }
+
+    // Execution monitor of the decoded engine, which calls it before every
+    // command with the operand stack and both register files, and after every
+    // jump. If Step returns false, the run stops before the command. Stop ends
+    // every run, with halted set only when it ended on HLT. This one does
+    // nothing and compiles away; see Profiler, Tracer and Breakpoint for ones
+    // that do.
+    struct NoMonitor {
+        void Start(const DecodedProgram& program) {
+            UNUSED(program);
+        }
+
+        template <class Stack>
+        bool Step(uint32_t index, const Stack& stack, const double* regs, const int64_t* iregs) {
+            UNUSED(index);
+            UNUSED(stack);
+            UNUSED(regs);
+            UNUSED(iregs);
+            return true;
+        }
+
+        void Jump(uint32_t from, uint32_t to) {
+            UNUSED(from);
+            UNUSED(to);
+        }
+
+        void Stop(bool halted) {
+            UNUSED(halted);
+        }
     };
 
-    class Cpu {
+    template <template<class> class OperandStack = CpuStack, class Monitor = NoMonitor>
+    class BasicCpu {
     public:
-        explicit Cpu(CommandsReader &reader) : reader_(reader) {
+        // Without io the program reads std::cin and writes std::cout
+        explicit BasicCpu(CommandsReader &reader, Memory memory = Memory(), Io* io = nullptr)
+            : reader_(reader), iregs_(), mem_(std::move(memory)), io_(io ? io : &stream_io_), needs_input_(false),
+              out_of_budget_(false), executed_(0) {
         }
 
-        void Run() {
+        // Runs from the command at position start. Returns the position of the
+        // command the monitor stopped the run before, or NO_INDEX after HLT.
+        // The decoded engine also stops before an IN when the Io has no input
+        // ready; NeedsInput tells this apart, and running from the returned
+        // position once there is input goes on as if it never stopped.
+        uint32_t Run(Engine engine = Engine::SWITCH, uint32_t start = 0) {
+            uint32_t stop = NO_INDEX;
+            needs_input_ = false;
+            out_of_budget_ = false;
+            switch (engine) {
+                case Engine::SWITCH:
+                    reader_.Jump(start);
+                    RunSwitch();
+                    break;
+                case Engine::THREADED:
+                    reader_.Jump(start);
+                    RunThreaded();
+                    break;
+                case Engine::DECODED:
+                    stop = RunDecoded(DecodedProgram(reader_.GetCompiled().first), start);
+                    break;
+                case Engine::JIT:
+                    stop = RunJit(start);
+                    break;
+            }
+            io_->Flush();
+            return stop;
+        }
+
+        Monitor& GetMonitor() {
+            return monitor_;
+        }
+
+        // Runs on the decoded engine like Run, stopping once count more
+        // commands have run. The count is only checked on jumps, so the run
+        // goes on to the next jump taken past it; a program that never jumps
+        // ends anyway. OutOfBudget tells this stop apart.
+        uint32_t RunFor(uint64_t count, uint32_t start = 0) {
+            needs_input_ = false;
+            uint32_t stop = RunDecoded<true>(DecodedProgram(reader_.GetCompiled().first), start, count);
+            io_->Flush();
+            return stop;
+        }
+
+        // Whether the last run stopped waiting for input
+        bool NeedsInput() const {
+            return needs_input_;
+        }
+
+        // Whether the last run stopped at the end of its RunFor budget
+        bool OutOfBudget() const {
+            return out_of_budget_;
+        }
+
+        // Commands run by RunFor over all runs, except the ones that faulted
+        uint64_t Executed() const {
+            return executed_;
+        }
+
+        // Only for stacks reserving their size up front, like FixedStack
+        void ReserveStack(size_t size) {
+            stack_.Reserve(size);
+        }
+
+        // Deepest nesting of CALL before it faults
+        void SetCallDepthLimit(size_t limit) {
+            calls_.SetLimit(limit);
+        }
+
+        // Defined in jit.h
+        uint32_t RunJit(uint32_t start = 0);
+
+        // Defined in snapshot.h
+        void SaveSnapshot(const char* filename, uint32_t position);
+        uint32_t LoadSnapshot(const char* filename);
+
+        // Budgeted runs count the commands they run and stop after the jump
+        // that reaches count. Only they pay for counting.
+        template <bool Budgeted = false>
+        uint32_t RunDecoded(const DecodedProgram& program, size_t start = 0, uint64_t count = 0) {
+            const Instruction* code = program.Code();
+            const double* constants = program.Constants();
+            const Instruction* ip = code + start;
+            const Instruction* next = nullptr;
+            const double* args = nullptr;
+            // Where the budget would run out if there were no more jumps. A jump
+            // moves it by its distance, which costs no division to count.
+            const uint64_t MAX_COUNT = uint64_t(1) << 48;
+            count = std::min<uint64_t>(count, MAX_COUNT);
+            intptr_t budget_end = reinterpret_cast<intptr_t>(ip) + count * sizeof(Instruction);
+            needs_input_ = false;
+            out_of_budget_ = false;
+            monitor_.Start(program);
+
+// Budgeted runs pay for their budget only on jumps taken. A jump ends its
+// command, so stopping right after it leaves nothing of the command undone.
+#define JUMP_ARG(i) do { next = code + ip->target; CHARGE_JUMP(); } while (0)
+#define JUMP_TO(pos) do {                                                                \
+                double target = (pos);                                                          \
+                uint32_t target_index = program.FindIndex(target);                              \
+                if (target_index == NO_INDEX) {                                                 \
+                    throw NotACommand(target);                                                  \
+                }                                                                               \
+                next = code + target_index;                                                     \
+                CHARGE_JUMP();                                                                  \
+            } while (0)
+#define CHARGE_JUMP()                                                                           \
+            if (Budgeted) {                                                                     \
+                budget_end += reinterpret_cast<intptr_t>(next) - reinterpret_cast<intptr_t>(ip + 1); \
+                if (reinterpret_cast<intptr_t>(next) >= budget_end) {                           \
+                    goto out_of_budget;                                                         \
+                }                                                                               \
+            }
+#define NEXT_POSITION() program.PositionOf(ip - code + 1)
+// Adds the commands run before stopping at ip, with the one at ip when it ran
+#define COUNT_RUN(current) \
+            if (Budgeted) executed_ += count - (budget_end - reinterpret_cast<intptr_t>(ip)) / intptr_t(sizeof(Instruction)) + current
+#if defined(__GNUC__)
+            static void* const handlers[] = {
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+                &&handler_##NAME,
+
+#include "commands.h"
+
+#undef COMMAND
+            };
+
+#define DISPATCH()                                                  \
+            if (!monitor_.Step(ip - code, stack_, regs_, iregs_)) { \
+                COUNT_RUN(0);                                       \
+                monitor_.Stop(false);                               \
+                return ip - code;                                   \
+            }                                                       \
+            next = ip + 1;                  \
+            args = constants + ip->constant;\
+            goto *handlers[ip->command]
+
+            DISPATCH();
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE)          \
+        handler_##NAME:                                 \
+            if (NAME == IN && !io_->HasInput()) {       \
+                COUNT_RUN(0);                           \
+                needs_input_ = true;                    \
+                monitor_.Stop(false);                   \
+                return ip - code;                       \
+            }                                           \
+            CODE;                                       \
+            if (NAME == HLT) {                          \
+                COUNT_RUN(1);                           \
+                monitor_.Stop(true);                    \
+                return NO_INDEX;                        \
+            }                                           \
+            if (next != ip + 1) {                       \
+                monitor_.Jump(ip - code, next - code);  \
+            }                                           \
+            ip = next;                                  \
+            DISPATCH();
+
+#include "commands.h"
+
+#undef COMMAND
+#undef DISPATCH
+#else
+            while (true) {
+                if (!monitor_.Step(ip - code, stack_, regs_, iregs_)) {
+                    COUNT_RUN(0);
+                    monitor_.Stop(false);
+                    return ip - code;
+                }
+                if (ip->command == IN && !io_->HasInput()) {
+                    COUNT_RUN(0);
+                    needs_input_ = true;
+                    monitor_.Stop(false);
+                    return ip - code;
+                }
+                next = ip + 1;
+                args = constants + ip->constant;
+                switch (ip->command) {
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+                case (NAME):                            \
+                    CODE;                              \
+                    break;
+
+#include "commands.h"
+
+#undef COMMAND
+                }
+                if (ip->command == HLT) {
+                    COUNT_RUN(1);
+                    monitor_.Stop(true);
+                    return NO_INDEX;
+                }
+                if (next != ip + 1) {
+                    monitor_.Jump(ip - code, next - code);
+                }
+                ip = next;
+            }
+#endif
+        out_of_budget:
+            if (next != ip + 1) {
+                monitor_.Jump(ip - code, next - code);
+            }
+            ip = next;
+            COUNT_RUN(0);
+            out_of_budget_ = true;
+            monitor_.Stop(false);
+            return ip - code;
+#undef JUMP_ARG
+#undef JUMP_TO
+#undef CHARGE_JUMP
+#undef NEXT_POSITION
+#undef COUNT_RUN
+        }
+
+    private:
+#define JUMP_ARG(i) reader_.Jump(reader_.GetTarget())
+#define JUMP_TO(pos) do {                                   \
+            double target = (pos);                             \
+            if (!(target >= 0) || target >= size) {            \
+                throw NotACommand(target);                     \
+            }                                                  \
+            reader_.Jump(static_cast<size_t>(target));         \
+        } while (0)
+#define NEXT_POSITION() reader_.GetNextPosition()
+        void RunSwitch() {
+            const size_t size = ProgramImage(reader_.GetCompiled().first).Size();
             Command command = HLT;
             do {
                 reader_.NextCommand(&command);
                 const double* args = reader_.GetArgs();
                 switch (command) {
-#define COMMAND(NAME, PARAM_CNT, READ, WRITE, CODE) \
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
                 case (NAME):                            \
                     CODE;                              \
                     break;
@@ -283,10 +986,65 @@ NAME,
             } while (command != HLT);
         }
 
-    private:
+        // Direct-threaded dispatch: every handler fetches the next command and jumps
+        // straight to its label, so there is no central switch and each handler
+        // gets its own indirect branch to predict. Falls back to the switch engine
+        // on compilers without labels as values.
+        void RunThreaded() {
+#if defined(__GNUC__)
+            static void* const handlers[] = {
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+                &&handler_##NAME,
+
+#include "commands.h"
+
+#undef COMMAND
+            };
+            const size_t size = ProgramImage(reader_.GetCompiled().first).Size();
+            Command command = HLT;
+            const double* args = nullptr;
+
+#define DISPATCH()                          \
+            reader_.NextCommand(&command);  \
+            args = reader_.GetArgs();       \
+            goto *handlers[command]
+
+            DISPATCH();
+#define COMMAND(NAME, PARAM_CNT, SYNTAX, CODE) \
+        handler_##NAME:                             \
+            CODE;                                   \
+            if (NAME == HLT) {                      \
+                return;                             \
+            }                                       \
+            DISPATCH();
+
+#include "commands.h"
+
+#undef COMMAND
+#undef DISPATCH
+#else
+            RunSwitch();
+#endif
+        }
+#undef JUMP_ARG
+#undef JUMP_TO
+#undef NEXT_POSITION
+
         CommandsReader& reader_;
-        CpuStack stack_;
+        OperandStack<double> stack_;
         double regs_[REGISTER_COUNT];
+        int64_t iregs_[INT_REGISTER_COUNT];
         Memory mem_;
+        CallStack calls_;
+        StreamIo stream_io_;
+        Io* io_;
+        Monitor monitor_;
+        bool needs_input_;
+        bool out_of_budget_;
+        uint64_t executed_;
     };
-} // namespace Cpu
\ No newline at end of file
+
+    using Cpu = BasicCpu<>;
+} // namespace Cpu
+
+#include "jit.h"
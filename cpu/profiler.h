@@ -0,0 +1,221 @@
+#pragma once
+
+#include "parser.h"
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace Cpu {
+    // Monitor for the decoded engine counting executions of every command and
+    // taken jumps. The program is split into regions starting at the entry
+    // point, at labels and at jump targets, and the time spent in each region
+    // is measured when execution moves from one region to another.
+    class Profiler {
+    public:
+        Profiler() : region_(NO_INDEX) {
+        }
+
+        void Start(const DecodedProgram& program) {
+            if (counts_.empty()) {
+                Init(program);
+            }
+        }
+
+        template <class Stack>
+        bool Step(uint32_t index, const Stack& stack, const double* regs, const int64_t* iregs) {
+            UNUSED(stack);
+            UNUSED(regs);
+            UNUSED(iregs);
+            ++counts_[index];
+            if (region_of_[index] != region_) {
+                Enter(region_of_[index]);
+            }
+            return true;
+        }
+
+        void Jump(uint32_t from, uint32_t to) {
+            ++edges_[uint64_t(from) << 32 | to];
+        }
+
+        void Stop(bool halted) {
+            UNUSED(halted);
+            Enter(NO_INDEX);
+        }
+
+        // Writes the report. Commands are named by the closest label before
+        // them, like "fib+3", using the symbol table of the program.
+        void WriteJson(std::ostream& out, const ProgramImage& image) const {
+            std::vector<std::string> labels = Labels(image);
+
+            uint64_t total = 0;
+            std::vector<uint64_t> opcodes(COMMAND_COUNT);
+            for (size_t i = 0; i < counts_.size(); ++i) {
+                total += counts_[i];
+                opcodes[image.Code()[i].command] += counts_[i];
+            }
+            out << "{\n  \"commands\": " << total << ",\n";
+
+            std::vector<size_t> order;
+            for (size_t command = 0; command < COMMAND_COUNT; ++command) {
+                if (opcodes[command] != 0) {
+                    order.push_back(command);
+                }
+            }
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return opcodes[a] > opcodes[b];
+            });
+            out << "  \"opcodes\": [";
+            for (size_t i = 0; i < order.size(); ++i) {
+                out << (i ? "," : "") << "\n    {\"opcode\": " << Quoted(CommandName(Command(order[i])))
+                    << ", \"count\": " << opcodes[order[i]] << "}";
+            }
+
+            out << "\n  ],\n  \"offsets\": [";
+            bool first = true;
+            for (size_t i = 0; i < counts_.size(); ++i) {
+                if (counts_[i] == 0) {
+                    continue;
+                }
+                const Instruction& instruction = image.Code()[i];
+                std::string target = IsJumpCommand(instruction.command) ? labels[instruction.target] : "";
+                out << (first ? "" : ",") << "\n    {\"offset\": " << i << ", \"label\": " << Quoted(labels[i])
+                    << ", \"command\": "
+                    << Quoted(StringFromCommand(instruction.command, image.Constants() + instruction.constant, target))
+                    << ", \"count\": " << counts_[i] << "}";
+                first = false;
+            }
+
+            std::vector<std::pair<uint64_t, uint64_t>> edges(edges_.begin(), edges_.end());
+            std::sort(edges.begin(), edges.end(), [](const std::pair<uint64_t, uint64_t>& a,
+                                                     const std::pair<uint64_t, uint64_t>& b) {
+                return a.second > b.second || (a.second == b.second && a.first < b.first);
+            });
+            out << "\n  ],\n  \"edges\": [";
+            for (size_t i = 0; i < edges.size(); ++i) {
+                uint32_t from = edges[i].first >> 32;
+                uint32_t to = edges[i].first & UINT32_MAX;
+                out << (i ? "," : "") << "\n    {\"from\": " << from << ", \"from_label\": " << Quoted(labels[from])
+                    << ", \"to\": " << to << ", \"to_label\": " << Quoted(labels[to])
+                    << ", \"count\": " << edges[i].second << "}";
+            }
+
+            std::vector<size_t> regions(region_starts_.size());
+            for (size_t i = 0; i < regions.size(); ++i) {
+                regions[i] = i;
+            }
+            std::stable_sort(regions.begin(), regions.end(), [&](size_t a, size_t b) {
+                return seconds_[a] > seconds_[b];
+            });
+            out << "\n  ],\n  \"regions\": [";
+            first = true;
+            for (size_t region : regions) {
+                if (entries_[region] == 0) {
+                    continue;
+                }
+                size_t start = region_starts_[region];
+                size_t end = region + 1 < region_starts_.size() ? region_starts_[region + 1] : counts_.size();
+                uint64_t commands = 0;
+                for (size_t i = start; i < end; ++i) {
+                    commands += counts_[i];
+                }
+                out << (first ? "" : ",") << "\n    {\"label\": " << Quoted(labels[start])
+                    << ", \"start\": " << start << ", \"end\": " << end << ", \"entries\": " << entries_[region]
+                    << ", \"commands\": " << commands << ", \"seconds\": " << seconds_[region] << "}";
+                first = false;
+            }
+            out << "\n  ]\n}\n";
+        }
+
+        uint64_t Count(uint32_t index) const {
+            return counts_[index];
+        }
+
+        uint64_t EdgeCount(uint32_t from, uint32_t to) const {
+            auto it = edges_.find(uint64_t(from) << 32 | to);
+            return it == edges_.end() ? 0 : it->second;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        void Init(const DecodedProgram& program) {
+            std::vector<bool> starts(program.Size(), false);
+            starts[0] = true;
+            for (size_t i = 0; i < program.Size(); ++i) {
+                const Instruction& instruction = program.Code()[i];
+                if (IsJumpCommand(instruction.command) && instruction.target < program.Size()) {
+                    starts[instruction.target] = true;
+                }
+            }
+            for (const auto& symbol : program.Image().Symbols()) {
+                if (symbol.first < program.Size()) {
+                    starts[symbol.first] = true;
+                }
+            }
+            counts_.assign(program.Size(), 0);
+            region_of_.resize(program.Size());
+            for (size_t i = 0; i < program.Size(); ++i) {
+                if (starts[i]) {
+                    region_starts_.push_back(i);
+                }
+                region_of_[i] = region_starts_.size() - 1;
+            }
+            entries_.assign(region_starts_.size(), 0);
+            seconds_.assign(region_starts_.size(), 0);
+        }
+
+        void Enter(uint32_t region) {
+            Clock::time_point now = Clock::now();
+            if (region_ != NO_INDEX) {
+                seconds_[region_] += std::chrono::duration<double>(now - since_).count();
+            }
+            if (region != NO_INDEX) {
+                ++entries_[region];
+            }
+            region_ = region;
+            since_ = now;
+        }
+
+        static std::vector<std::string> Labels(const ProgramImage& image) {
+            std::vector<std::string> labels(image.Size() + 1);
+            std::string name;
+            size_t start = 0;
+            auto symbols = image.Symbols();
+            auto symbol = symbols.begin();
+            for (size_t i = 0; i < labels.size(); ++i) {
+                for (; symbol != symbols.end() && symbol->first == i; ++symbol) {
+                    name = symbol->second;
+                    start = i;
+                }
+                if (name.empty()) {
+                    labels[i] = std::to_string(i);
+                } else {
+                    labels[i] = i == start ? name : name + "+" + std::to_string(i - start);
+                }
+            }
+            return labels;
+        }
+
+        static std::string Quoted(const std::string& text) {
+            std::string quoted = "\"";
+            for (char c : text) {
+                if (c == '"' || c == '\\') {
+                    quoted.push_back('\\');
+                }
+                quoted.push_back(c);
+            }
+            return quoted + "\"";
+        }
+
+        std::vector<uint64_t> counts_;
+        std::unordered_map<uint64_t, uint64_t> edges_;
+        std::vector<size_t> region_starts_;
+        std::vector<uint32_t> region_of_;
+        std::vector<uint64_t> entries_;
+        std::vector<double> seconds_;
+        uint32_t region_;
+        Clock::time_point since_;
+    };
+} // namespace Cpu
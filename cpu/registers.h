@@ -3,4 +3,14 @@
 REGISTER(RAX, 0)
 REGISTER(RBX, 1)
 REGISTER(RCX, 2)
-REGISTER(RDX, 3)
\ No newline at end of file
+REGISTER(RDX, 3)
+
+// INT_REGISTER(NAME, NUM): 64-bit integer registers, listed only where
+// INT_REGISTER is defined
+
+#ifdef INT_REGISTER
+INT_REGISTER(IAX, 0)
+INT_REGISTER(IBX, 1)
+INT_REGISTER(ICX, 2)
+INT_REGISTER(IDX, 3)
+#endif
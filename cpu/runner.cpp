@@ -1,11 +1,252 @@
 #include <err.h>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
 #include "parser.h"
+#include "batch.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "tracer.h"
+#include "verifier.h"
+
+bool ReadOption(const char* arg, const char* prefix, const char** value) {
+    if (strncmp(arg, prefix, strlen(prefix)) != 0) {
+        return false;
+    }
+    *value = arg + strlen(prefix);
+    return true;
+}
+
+size_t ReadSize(const char* option, const char* value) {
+    char* end = nullptr;
+    unsigned long long size = strtoull(value, &end, 10);
+    if (*value == '\0' || *end != '\0') {
+        errx(1, "Number expected for %s, got '%s'", option, value);
+    }
+    return size;
+}
+
+// With max_commands the program runs on the decoded engine and is stopped
+// once it runs that many commands
+template <class CpuType>
+uint32_t Execute(CpuType& cpu, Cpu::Engine engine, Cpu::BufferedIo& buffered,
+                 const std::function<void()>& on_fault = [] {}, uint32_t start = 0, uint64_t max_commands = 0) {
+    try {
+        if (max_commands == 0) {
+            return cpu.Run(engine, start);
+        }
+        uint32_t stop = cpu.RunFor(max_commands, start);
+        if (cpu.OutOfBudget()) {
+            buffered.Flush();
+            std::cout.flush();
+            errx(1, "Stopped after %llu commands, at command %u", (unsigned long long)cpu.Executed(), stop);
+        }
+        return stop;
+    } catch (const Cpu::MemoryFault& fault) {
+        buffered.Flush();
+        std::cout.flush();
+        on_fault();
+        errx(1, "Memory fault: %s", fault.what());
+    }
+}
 
 int main(int argc, const char** argv) {
-    if (argc != 2) {
-        errx(1, "Exactly 1 argument expected: script file");
+    Cpu::Engine engine = Cpu::Engine::SWITCH;
+    // The option that chose the engine, if any
+    const char* engine_option = nullptr;
+    Cpu::Memory memory;
+    size_t call_depth = Cpu::CallStack::DEFAULT_LIMIT;
+    // The last option that set up memory or the call depth, which a resumed
+    // snapshot brings its own of
+    const char* machine_option = nullptr;
+    size_t max_commands = 0;
+    bool buffered_io = true;
+    const char* profile = nullptr;
+    const char* trace = nullptr;
+    const char* batch = nullptr;
+    const char* snapshot_at = nullptr;
+    const char* snapshot = "snapshot.bin";
+    const char* resume = nullptr;
+    bool verify_only = false;
+    bool verify = true;
+    size_t threads = std::thread::hardware_concurrency();
+    const char* script = nullptr;
+    const char* value = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            engine = Cpu::Engine::JIT;
+            engine_option = argv[i];
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify_only = true;
+        } else if (strcmp(argv[i], "--no-verify") == 0) {
+            verify = false;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            if (i + 1 == argc) {
+                errx(1, "--profile expects an output file");
+            }
+            profile = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot-at") == 0) {
+            if (i + 1 == argc) {
+                errx(1, "--snapshot-at expects a label");
+            }
+            snapshot_at = argv[++i];
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            if (i + 1 == argc) {
+                errx(1, "--resume expects a snapshot file");
+            }
+            resume = argv[++i];
+        } else if (ReadOption(argv[i], "--snapshot=", &value)) {
+            snapshot = value;
+        } else if (ReadOption(argv[i], "--trace=", &value)) {
+            trace = value;
+        } else if (ReadOption(argv[i], "--batch=", &value)) {
+            batch = value;
+        } else if (ReadOption(argv[i], "--threads=", &value)) {
+            threads = ReadSize("--threads", value);
+        } else if (ReadOption(argv[i], "--engine=", &value)) {
+            if (!Cpu::EngineFromString(value, &engine)) {
+                errx(1, "Unknown engine: %s", value);
+            }
+            engine_option = argv[i];
+        } else if (ReadOption(argv[i], "--io=", &value)) {
+            if (strcmp(value, "stream") != 0 && strcmp(value, "buffered") != 0) {
+                errx(1, "Unknown io: %s", value);
+            }
+            buffered_io = strcmp(value, "buffered") == 0;
+        } else if (ReadOption(argv[i], "--memory-limit=", &value)) {
+            memory = Cpu::Memory(ReadSize("--memory-limit", value));
+            machine_option = argv[i];
+        } else if (ReadOption(argv[i], "--flat-memory=", &value)) {
+            memory = Cpu::Memory::Flat(ReadSize("--flat-memory", value));
+            machine_option = argv[i];
+        } else if (ReadOption(argv[i], "--call-depth=", &value)) {
+            call_depth = ReadSize("--call-depth", value);
+            machine_option = argv[i];
+        } else if (ReadOption(argv[i], "--max-commands=", &value)) {
+            max_commands = ReadSize("--max-commands", value);
+        } else if (!script) {
+            script = argv[i];
+        } else {
+            errx(1, "Exactly 1 script file expected");
+        }
+    }
+    if (batch) {
+        if (script) {
+            errx(1, "No script file expected with --batch");
+        }
+        std::ifstream manifest(batch);
+        if (!manifest) {
+            err(1, "Failed to open %s", batch);
+        }
+        Cpu::WorkStealingPool pool(threads);
+        Cpu::BatchStats stats = Cpu::RunBatch(Cpu::ReadManifest(manifest), engine, &pool);
+        // An empty manifest takes next to no time
+        double rate = stats.jobs > 0 && stats.seconds > 0 ? stats.jobs / stats.seconds : 0;
+        fprintf(stderr, "%zu jobs, %zu failed, in %.3f s: %.1f jobs/s on %zu threads, %zu steals\n",
+                stats.jobs, stats.failed, stats.seconds, rate, pool.Threads(), stats.steals);
+        return stats.failed == 0 ? 0 : 1;
+    }
+    if (!script) {
+        errx(1, "Usage: runner [--engine=switch|threaded|decoded|jit] [--jit] "
+                "[--io=buffered|stream] [--memory-limit=BYTES | --flat-memory=CELLS] [--call-depth=N] [--max-commands=N] "
+                "[--no-verify] [--profile out.json | --trace=FILE] script file\n"
+                "       runner --verify script file\n"
+                "       runner --snapshot-at LABEL [--snapshot=FILE] script file\n"
+                "       runner --resume FILE [--engine=...] [--max-commands=N] script file\n"
+                "       runner --batch=MANIFEST [--threads=N] [--engine=...]\n"
+                "--profile, --trace and --max-commands run on the decoded engine only");
+    }
+    if (profile && engine_option && engine != Cpu::Engine::DECODED) {
+        errx(1, "--profile runs on the decoded engine, not with %s", engine_option);
+    }
+    if (trace && engine_option && engine != Cpu::Engine::DECODED) {
+        errx(1, "--trace runs on the decoded engine, not with %s", engine_option);
+    }
+    if (max_commands && engine_option && engine != Cpu::Engine::DECODED) {
+        errx(1, "--max-commands runs on the decoded engine, not with %s", engine_option);
+    }
+    Cpu::MappedFileCommandsReader reader(script);
+    Cpu::Verification verification;
+    if (verify || verify_only) {
+        verification = Cpu::Verify(Cpu::DecodedProgram(reader.GetCompiled().first));
+    }
+    if (verify_only) {
+        if (!verification.verified) {
+            errx(1, "Not verified at command %u: %s", verification.index, verification.error.c_str());
+        }
+        fprintf(stderr, "Verified, the stack takes at most %zu cells\n", verification.max_stack);
+        return 0;
+    }
+    Cpu::BufferedIo buffered;
+    Cpu::Io* io = buffered_io ? &buffered : nullptr;
+    if (snapshot_at) {
+        // Runs up to the label and saves the state there instead of going on
+        Cpu::ProgramImage image(reader.GetCompiled().first);
+        uint32_t position = image.FindSymbol(snapshot_at);
+        if (position == Cpu::NO_INDEX) {
+            char* end = nullptr;
+            position = strtoul(snapshot_at, &end, 10);
+            if (*end != '\0' || position >= image.Size()) {
+                errx(1, "No label %s in the program, compile it with --symbols", snapshot_at);
+            }
+        }
+        Cpu::BasicCpu<Cpu::CpuStack, Cpu::Breakpoint> cpu(reader, std::move(memory), io);
+        cpu.SetCallDepthLimit(call_depth);
+        cpu.GetMonitor().Set(position);
+        if (Execute(cpu, Cpu::Engine::DECODED, buffered) == Cpu::NO_INDEX) {
+            errx(1, "The program halted before reaching %s", snapshot_at);
+        }
+        cpu.SaveSnapshot(snapshot, position);
+        return 0;
+    }
+    if (resume) {
+        // Memory and the call depth limit come from the snapshot
+        if (machine_option) {
+            errx(1, "%s cannot be used with --resume, the snapshot keeps its own", machine_option);
+        }
+        Cpu::Cpu cpu(reader, std::move(memory), io);
+        uint32_t position = cpu.LoadSnapshot(resume);
+        Execute(cpu, engine, buffered, [] {}, position, max_commands);
+        return 0;
+    }
+    if (trace) {
+        // The last commands are appended to the file on HLT, on a fault and on SIGUSR1
+        int fd = open(trace, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            err(1, "Failed to open %s", trace);
+        }
+        Cpu::DumpTraceOnSignal();
+        Cpu::BasicCpu<Cpu::CpuStack, Cpu::Tracer> cpu(reader, std::move(memory), io);
+        cpu.SetCallDepthLimit(call_depth);
+        cpu.GetMonitor().SetOutput(fd, true);
+        Execute(cpu, Cpu::Engine::DECODED, buffered, [&] {
+            cpu.GetMonitor().Dump(fd);
+        });
+        close(fd);
+        return 0;
+    }
+    if (!profile && verification.verified) {
+        // Runs without operand stack checks
+        Cpu::VerifiedCpu cpu(reader, std::move(memory), io);
+        cpu.ReserveStack(verification.max_stack);
+        cpu.SetCallDepthLimit(call_depth);
+        Execute(cpu, engine, buffered, [] {}, 0, max_commands);
+        return 0;
+    }
+    if (!profile) {
+        Cpu::Cpu cpu(reader, std::move(memory), io);
+        cpu.SetCallDepthLimit(call_depth);
+        Execute(cpu, engine, buffered, [] {}, 0, max_commands);
+        return 0;
+    }
+    // Only the decoded engine reports to the profiler
+    Cpu::BasicCpu<Cpu::CpuStack, Cpu::Profiler> cpu(reader, std::move(memory), io);
+    cpu.SetCallDepthLimit(call_depth);
+    Execute(cpu, Cpu::Engine::DECODED, buffered);
+    std::ofstream out(profile);
+    cpu.GetMonitor().WriteJson(out, Cpu::ProgramImage(reader.GetCompiled().first));
+    if (!out) {
+        errx(1, "Failed to write profile to %s", profile);
     }
-    Cpu::BinaryFileCommandsReader reader(argv[1]);
-    Cpu::Cpu cpu(reader);
-    cpu.Run();
-}
\ No newline at end of file
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "parser.h"
+#include <deque>
+#include <functional>
+#include <map>
+#include <time.h>
+#include <vector>
+
+namespace Cpu {
+    enum class SchedulePolicy {
+        // Every task gets its quantum in turn
+        ROUND_ROBIN,
+        // Only the tasks of the highest priority that are left run, in turn
+        PRIORITY
+    };
+
+    struct TaskStats {
+        enum State {
+            READY,
+            HALTED,
+            // Ran through its command budget without halting
+            OUT_OF_BUDGET,
+            FAULTED
+        };
+
+        State state = READY;
+        uint64_t commands = 0;
+        uint64_t slices = 0;
+        // CPU time of the thread running the scheduler spent on the task
+        double seconds = 0;
+        std::string fault;
+    };
+
+    // Shares one thread between many programs by running each on the decoded
+    // engine for a quantum of commands at a time, see RunFor. A task that runs
+    // through its command budget is stopped for good, so a runaway program
+    // cannot hold the thread. Tasks should not wait for input: one that does
+    // just gives up the rest of its quantum.
+    template <class CpuType = Cpu>
+    class Scheduler {
+    public:
+        static const uint64_t UNLIMITED = UINT64_MAX;
+        static const uint64_t DEFAULT_QUANTUM = 100000;
+
+        explicit Scheduler(uint64_t quantum = DEFAULT_QUANTUM, SchedulePolicy policy = SchedulePolicy::ROUND_ROBIN)
+            : quantum_(quantum), policy_(policy) {
+        }
+
+        // Adds a task running the program of cpu from its start, and returns
+        // its number. A quantum of 0 takes the scheduler's one. The cpu is
+        // not owned.
+        size_t Add(CpuType* cpu, uint64_t budget = UNLIMITED, int priority = 0, uint64_t quantum = 0) {
+            Task task;
+            task.cpu = cpu;
+            task.budget = budget;
+            task.priority = policy_ == SchedulePolicy::PRIORITY ? priority : 0;
+            task.quantum = quantum ? quantum : quantum_;
+            task.position = 0;
+            tasks_.push_back(task);
+            stats_.emplace_back();
+            ready_[task.priority].push_back(tasks_.size() - 1);
+            return tasks_.size() - 1;
+        }
+
+        // Runs until no task is ready. Calls on_stop with the number of each
+        // task as it halts, faults or runs out of its budget.
+        void Run(const std::function<void(size_t)>& on_stop = [](size_t) {}) {
+            while (!ready_.empty()) {
+                auto queue = ready_.begin();
+                size_t i = queue->second.front();
+                queue->second.pop_front();
+                if (queue->second.empty()) {
+                    ready_.erase(queue);
+                }
+                if (RunSlice(i)) {
+                    ready_[tasks_[i].priority].push_back(i);
+                } else {
+                    on_stop(i);
+                }
+            }
+        }
+
+        const TaskStats& Stats(size_t task) const {
+            return stats_[task];
+        }
+
+        size_t Size() const {
+            return tasks_.size();
+        }
+
+    private:
+        struct Task {
+            CpuType* cpu;
+            uint64_t budget;
+            int priority;
+            uint64_t quantum;
+            uint32_t position;
+        };
+
+        static double ThreadSeconds() {
+            struct timespec now;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+            return now.tv_sec + now.tv_nsec * 1e-9;
+        }
+
+        // Returns whether the task is still ready
+        bool RunSlice(size_t i) {
+            Task& task = tasks_[i];
+            TaskStats& stats = stats_[i];
+            uint64_t executed = task.cpu->Executed();
+            double start = ThreadSeconds();
+            try {
+                task.position = task.cpu->RunFor(std::min(task.quantum, task.budget - stats.commands), task.position);
+                if (task.position == NO_INDEX) {
+                    stats.state = TaskStats::HALTED;
+                }
+            } catch (const MemoryFault& fault) {
+                stats.state = TaskStats::FAULTED;
+                stats.fault = fault.what();
+            }
+            stats.seconds += ThreadSeconds() - start;
+            stats.commands += task.cpu->Executed() - executed;
+            ++stats.slices;
+            if (stats.state == TaskStats::READY && stats.commands >= task.budget) {
+                stats.state = TaskStats::OUT_OF_BUDGET;
+            }
+            return stats.state == TaskStats::READY;
+        }
+
+        uint64_t quantum_;
+        SchedulePolicy policy_;
+        std::vector<Task> tasks_;
+        std::vector<TaskStats> stats_;
+        // Ready tasks by priority, highest first
+        std::map<int, std::deque<size_t>, std::greater<int>> ready_;
+    };
+} // namespace Cpu
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace Cpu {
+    // SHA-256 as in FIPS 180-4
+    class Sha256 {
+    public:
+        using Digest = std::array<uint8_t, 32>;
+
+        Sha256() : length_(0), buffered_(0) {
+            static const uint32_t INITIAL[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+            };
+            memcpy(state_, INITIAL, sizeof(state_));
+        }
+
+        void Update(const void* data, size_t size) {
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            length_ += size;
+            while (size > 0) {
+                size_t count = std::min(size, sizeof(block_) - buffered_);
+                memcpy(block_ + buffered_, bytes, count);
+                buffered_ += count;
+                bytes += count;
+                size -= count;
+                if (buffered_ == sizeof(block_)) {
+                    Transform();
+                    buffered_ = 0;
+                }
+            }
+        }
+
+        void Update(const std::string& data) {
+            Update(data.data(), data.size());
+        }
+
+        Digest Finish() {
+            uint64_t bits = length_ * 8;
+            uint8_t padding = 0x80;
+            Update(&padding, 1);
+            padding = 0;
+            while (buffered_ != sizeof(block_) - 8) {
+                Update(&padding, 1);
+            }
+            uint8_t length[8];
+            for (int i = 0; i < 8; ++i) {
+                length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+            }
+            Update(length, sizeof(length));
+            Digest digest;
+            for (int i = 0; i < 8; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    digest[4 * i + j] = static_cast<uint8_t>(state_[i] >> (24 - 8 * j));
+                }
+            }
+            return digest;
+        }
+
+        static std::string Hex(const Digest& digest) {
+            static const char DIGITS[] = "0123456789abcdef";
+            std::string hex;
+            for (uint8_t byte : digest) {
+                hex.push_back(DIGITS[byte >> 4]);
+                hex.push_back(DIGITS[byte & 15]);
+            }
+            return hex;
+        }
+
+    private:
+        static uint32_t Rotate(uint32_t value, int count) {
+            return (value >> count) | (value << (32 - count));
+        }
+
+        void Transform() {
+            static const uint32_t K[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+            };
+            uint32_t w[64];
+            for (int i = 0; i < 16; ++i) {
+                w[i] = uint32_t(block_[4 * i]) << 24 | uint32_t(block_[4 * i + 1]) << 16 |
+                       uint32_t(block_[4 * i + 2]) << 8 | uint32_t(block_[4 * i + 3]);
+            }
+            for (int i = 16; i < 64; ++i) {
+                uint32_t s0 = Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+            uint32_t v[8];
+            memcpy(v, state_, sizeof(v));
+            for (int i = 0; i < 64; ++i) {
+                uint32_t s1 = Rotate(v[4], 6) ^ Rotate(v[4], 11) ^ Rotate(v[4], 25);
+                uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+                uint32_t first = v[7] + s1 + choice + K[i] + w[i];
+                uint32_t s0 = Rotate(v[0], 2) ^ Rotate(v[0], 13) ^ Rotate(v[0], 22);
+                uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+                uint32_t second = s0 + majority;
+                memmove(v + 1, v, 7 * sizeof(uint32_t));
+                v[4] += first;
+                v[0] = first + second;
+            }
+            for (int i = 0; i < 8; ++i) {
+                state_[i] += v[i];
+            }
+        }
+
+        uint32_t state_[8];
+        uint8_t block_[64];
+        uint64_t length_;
+        size_t buffered_;
+    };
+} // namespace Cpu
@@ -0,0 +1,258 @@
+#pragma once
+
+#include "parser.h"
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Snapshots of a stopped Cpu.
+//
+// Layout:
+//   SnapshotHeader
+//   double regs[register_count]
+//   int64_t iregs[int_register_count]
+//   double stack[stack_size]               bottom first
+//   uint32_t calls[call_depth]             CALL return positions, bottom first
+//   uint64_t page_numbers[page_count]
+//   padding to SNAPSHOT_ALIGNMENT
+//   double flat[flat_size]                 padded to SNAPSHOT_ALIGNMENT
+//   page_count pages of Memory::PAGE_CELLS doubles
+//
+// Memory sections are aligned so that LoadSnapshot maps them straight into
+// the restored Memory: pages are read in from the file only when touched,
+// and writes stay private to the process. Pages that are all zero are not
+// saved.
+
+namespace Cpu {
+    const char SNAPSHOT_MAGIC[4] = {'C', 'P', 'U', 'S'};
+    const uint32_t SNAPSHOT_VERSION = 3;
+    const size_t SNAPSHOT_ALIGNMENT = Memory::PAGE_CELLS * sizeof(double);
+
+    struct SnapshotHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t program_hash;
+        uint32_t position;
+        uint32_t register_count;
+        uint32_t int_register_count;
+        uint32_t reserved;
+        uint64_t stack_size;
+        uint64_t call_depth;
+        uint64_t call_limit;
+        uint64_t memory_limit;
+        uint64_t flat;
+        uint64_t flat_size;
+        uint64_t page_count;
+    };
+
+    // FNV-1a of the whole compiled program, so a snapshot is only resumed with
+    // the program it was taken from
+    uint64_t ProgramHash(const char* program) {
+        uint64_t hash = 14695981039346656037ull;
+        size_t length = ProgramImage(program).Length();
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ static_cast<uint8_t>(program[i])) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    size_t AlignSnapshotOffset(size_t offset) {
+        return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+    }
+
+    // Monitor stopping the decoded engine before the command at a position
+    class Breakpoint {
+    public:
+        explicit Breakpoint(uint32_t position = NO_INDEX) : position_(position) {
+        }
+
+        void Set(uint32_t position) {
+            position_ = position;
+        }
+
+        void Start(const DecodedProgram& program) {
+            UNUSED(program);
+        }
+
+        template <class Stack>
+        bool Step(uint32_t index, const Stack& stack, const double* regs, const int64_t* iregs) {
+            UNUSED(stack);
+            UNUSED(regs);
+            UNUSED(iregs);
+            return index != position_;
+        }
+
+        void Jump(uint32_t from, uint32_t to) {
+            UNUSED(from);
+            UNUSED(to);
+        }
+
+        void Stop(bool halted) {
+            UNUSED(halted);
+        }
+
+    private:
+        uint32_t position_;
+    };
+
+    template <template<class> class OperandStack, class Monitor>
+    void BasicCpu<OperandStack, Monitor>::SaveSnapshot(const char* filename, uint32_t position) {
+        std::vector<double> stack(stack_.Size());
+        for (size_t i = stack.size(); i > 0; --i) {
+            stack_.Pop(&stack[i - 1]);
+        }
+        for (double value : stack) {
+            stack_.Push(value);
+        }
+
+        std::vector<uint64_t> numbers;
+        std::vector<const double*> pages;
+        mem_.ForEachPage([&](size_t number, const double* cells) {
+            for (size_t i = 0; i < Memory::PAGE_CELLS; ++i) {
+                if (cells[i] != 0 || std::signbit(cells[i])) {
+                    numbers.push_back(number);
+                    pages.push_back(cells);
+                    return;
+                }
+            }
+        });
+
+        SnapshotHeader header = {};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.program_hash = ProgramHash(reader_.GetCompiled().first);
+        header.position = position;
+        header.register_count = REGISTER_COUNT;
+        header.int_register_count = INT_REGISTER_COUNT;
+        header.stack_size = stack.size();
+        header.call_depth = calls_.Depth();
+        header.call_limit = calls_.Limit();
+        header.memory_limit = mem_.Limit();
+        header.flat = mem_.IsFlat();
+        header.flat_size = mem_.FlatSize();
+        header.page_count = numbers.size();
+
+        std::string data;
+        data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        data.append(reinterpret_cast<const char*>(regs_), sizeof(regs_));
+        data.append(reinterpret_cast<const char*>(iregs_), sizeof(iregs_));
+        data.append(reinterpret_cast<const char*>(stack.data()), stack.size() * sizeof(double));
+        data.append(reinterpret_cast<const char*>(calls_.Positions().data()), calls_.Depth() * sizeof(uint32_t));
+        data.append(reinterpret_cast<const char*>(numbers.data()), numbers.size() * sizeof(uint64_t));
+        data.resize(AlignSnapshotOffset(data.size()));
+        data.append(reinterpret_cast<const char*>(mem_.FlatData()), mem_.FlatSize() * sizeof(double));
+        data.resize(AlignSnapshotOffset(data.size()));
+        for (const double* page : pages) {
+            data.append(reinterpret_cast<const char*>(page), SNAPSHOT_ALIGNMENT);
+        }
+
+        FILE* file = fopen(filename, "wb");
+        if (!file) {
+            err(1, "Failed to create snapshot %s", filename);
+        }
+        bool failed = fwrite(data.data(), 1, data.size(), file) != data.size();
+        if (fclose(file) != 0 || failed) {
+            err(1, "Failed to write snapshot %s", filename);
+        }
+    }
+
+    // Restores the state saved by SaveSnapshot and returns the position to
+    // resume from
+    template <template<class> class OperandStack, class Monitor>
+    uint32_t BasicCpu<OperandStack, Monitor>::LoadSnapshot(const char* filename) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            err(1, "Failed to open snapshot %s", filename);
+        }
+        struct stat statbuf;
+        if (fstat(fd, &statbuf) < 0) {
+            err(1, "Error calling stat");
+        }
+        size_t length = statbuf.st_size;
+        if (length < sizeof(SnapshotHeader)) {
+            errx(1, "Not a cpu snapshot: %s", filename);
+        }
+        void* region = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (region == MAP_FAILED) {
+            err(1, "Failed to map snapshot %s", filename);
+        }
+        close(fd);
+        std::shared_ptr<void> mapping(region, [length](void* address) {
+            munmap(address, length);
+        });
+
+        char* data = static_cast<char*>(region);
+        SnapshotHeader header;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+            header.version != SNAPSHOT_VERSION || header.register_count != REGISTER_COUNT ||
+            header.int_register_count != INT_REGISTER_COUNT) {
+            errx(1, "Not a cpu snapshot of this version: %s", filename);
+        }
+        if (header.program_hash != ProgramHash(reader_.GetCompiled().first)) {
+            errx(1, "Snapshot %s was taken from another program", filename);
+        }
+        // Keeps the offsets below from overflowing
+        if (header.stack_size > length || header.call_depth > length || header.flat_size > length ||
+            header.page_count > length) {
+            errx(1, "Truncated snapshot %s", filename);
+        }
+        size_t offset = sizeof(header);
+        size_t calls_offset = offset + sizeof(regs_) + sizeof(iregs_) + header.stack_size * sizeof(double);
+        size_t numbers_offset = calls_offset + header.call_depth * sizeof(uint32_t);
+        size_t flat_offset = AlignSnapshotOffset(numbers_offset + header.page_count * sizeof(uint64_t));
+        size_t pages_offset = AlignSnapshotOffset(flat_offset + header.flat_size * sizeof(double));
+        if (pages_offset + header.page_count * SNAPSHOT_ALIGNMENT > length) {
+            errx(1, "Truncated snapshot %s", filename);
+        }
+
+        memcpy(regs_, data + offset, sizeof(regs_));
+        offset += sizeof(regs_);
+        memcpy(iregs_, data + offset, sizeof(iregs_));
+        offset += sizeof(iregs_);
+        while (!stack_.Empty()) {
+            stack_.Pop(nullptr);
+        }
+        for (size_t i = 0; i < header.stack_size; ++i, offset += sizeof(double)) {
+            double value = 0;
+            memcpy(&value, data + offset, sizeof(value));
+            stack_.Push(value);
+        }
+        // Engines take positions as given, so they have to be commands
+        size_t size = ProgramImage(reader_.GetCompiled().first).Size();
+        if (header.position >= size) {
+            errx(1, "Corrupt snapshot %s: position %u is not a command", filename, header.position);
+        }
+        std::vector<uint32_t> calls(header.call_depth);
+        memcpy(calls.data(), data + calls_offset, calls.size() * sizeof(uint32_t));
+        for (uint32_t call : calls) {
+            if (call >= size) {
+                errx(1, "Corrupt snapshot %s: return position %u is not a command", filename, call);
+            }
+        }
+        calls_.Assign(std::move(calls));
+        calls_.SetLimit(header.call_limit);
+
+        std::vector<std::pair<size_t, double*>> pages;
+        for (size_t i = 0; i < header.page_count; ++i) {
+            uint64_t number = 0;
+            memcpy(&number, data + numbers_offset + i * sizeof(number), sizeof(number));
+            if (number >= Memory::PAGE_COUNT) {
+                errx(1, "Corrupt snapshot %s: page %llu is out of the address space", filename,
+                     (unsigned long long)number);
+            }
+            pages.emplace_back(number, reinterpret_cast<double*>(data + pages_offset + i * SNAPSHOT_ALIGNMENT));
+        }
+        double* flat = header.flat ? reinterpret_cast<double*>(data + flat_offset) : nullptr;
+        try {
+            mem_ = Memory::Adopt(mapping, header.memory_limit, flat, header.flat_size, pages);
+        } catch (const MemoryFault& fault) {
+            // The page tables do not fit in the saved limit
+            errx(1, "Corrupt snapshot %s: %s", filename, fault.what());
+        }
+        return header.position;
+    }
+} // namespace Cpu
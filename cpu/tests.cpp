@@ -1,9 +1,22 @@
 #include <gtest/gtest.h>
 #include <fstream>
+#include <ftw.h>
+#include <sys/socket.h>
+#include <thread>
 #include "parser.h"
 #include "compiler.h"
+#include "compile_cache.h"
+#include "interactive.h"
+#include "scheduler.h"
+#include "batch.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "tracer.h"
+#include "transpiler.h"
+#include "verifier.h"
 
-std::string RunProgram(Cpu::CommandsReader& reader, const std::string& input) {
+template <class CpuType>
+std::string RunCpu(CpuType& cpu, const std::string& input, Cpu::Engine engine) {
     // replacing stdout and stdin
     std::stringstream input_buffer(input);
     std::stringstream output_buffer;
@@ -11,8 +24,7 @@ std::string RunProgram(Cpu::CommandsReader& reader, const std::string& input) {
     std::streambuf* old_output = std::cout.rdbuf(output_buffer.rdbuf());
     std::cin.tie(nullptr);
 
-    Cpu::Cpu cpu(reader);
-    cpu.Run();
+    cpu.Run(engine);
 
     // put everything back
     std::cin.rdbuf(old_input);
@@ -20,22 +32,40 @@ std::string RunProgram(Cpu::CommandsReader& reader, const std::string& input) {
     return output_buffer.str();
 }
 
-void TestTextProgram(const std::string& program, const std::string& input, const std::string& output) {
-    std::stringstream program_stream(program);
-    auto bytecode = Cpu::Compile(program_stream);
-    Cpu::BufferCommandsReader reader(bytecode.data());
-
-    auto result = RunProgram(reader, input);
-
-    ASSERT_EQ(result, output);
+template <class CpuType = Cpu::Cpu>
+std::string RunProgram(Cpu::CommandsReader& reader, const std::string& input, Cpu::Engine engine = Cpu::Engine::SWITCH) {
+    CpuType cpu(reader);
+    return RunCpu(cpu, input, engine);
 }
 
+const Cpu::Engine ALL_ENGINES[] = {Cpu::Engine::SWITCH, Cpu::Engine::THREADED, Cpu::Engine::DECODED, Cpu::Engine::JIT};
+
 void TestBinaryProgram(const char* program, const std::string& input, const std::string& output) {
-    Cpu::BufferCommandsReader reader(program);
+    for (auto engine : ALL_ENGINES) {
+        Cpu::BufferCommandsReader reader(program);
 
-    auto result = RunProgram(reader, input);
+        auto result = RunProgram(reader, input, engine);
 
-    ASSERT_EQ(result, output);
+        ASSERT_EQ(result, output);
+    }
+}
+
+void TestTextProgram(const std::string& program, const std::string& input, const std::string& output) {
+    for (bool optimize : {false, true}) {
+        std::stringstream program_stream(program);
+        Cpu::CompileOptions options;
+        options.optimize = optimize;
+        auto bytecode = Cpu::Compile(program_stream, options);
+        TestBinaryProgram(bytecode.data(), input, output);
+    }
+}
+
+std::string CompileText(const std::string& program, bool optimize = true, bool dataflow = true) {
+    std::stringstream program_stream(program);
+    Cpu::CompileOptions options;
+    options.optimize = optimize;
+    options.dataflow = dataflow;
+    return Cpu::Compile(program_stream, options);
 }
 
 std::string CompileFromFile(const std::string& filename) {
@@ -43,6 +73,33 @@ std::string CompileFromFile(const std::string& filename) {
     return Cpu::Compile(in);
 }
 
+// Scratch directory under /tmp, removed with everything in it
+class TempDirectory {
+public:
+    TempDirectory() {
+        char path[] = "/tmp/cpu_test_XXXXXX";
+        if (!mkdtemp(path)) {
+            err(1, "Failed to create a temporary directory");
+        }
+        path_ = path;
+    }
+
+    ~TempDirectory() {
+        nftw(path_.c_str(), Remove, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    const std::string& Path() const {
+        return path_;
+    }
+
+private:
+    static int Remove(const char* path, const struct stat*, int, struct FTW*) {
+        return remove(path);
+    }
+
+    std::string path_;
+};
+
 TEST(CommandTest, AllCommands) {
     TestTextProgram(
         "push 10\n"
@@ -226,6 +283,80 @@ TEST(CommandTest, Jump) {
         ,
         "8\n"
     );
+    TestTextProgram(
+        "push 4\n"
+        "call twice\n"
+        "out\n"
+        "hlt\n"
+        ":twice\n"
+        "call double\n"
+        "call double\n"
+        "return\n"
+        ":double\n"
+        "push 2\n"
+        "mul\n"
+        "return\n"
+        ,
+        ""
+        ,
+        "16\n"
+    );
+}
+
+TEST(CommandTest, IntegerRegisters) {
+    TestTextProgram(
+        "iset IAX 0\n"
+        ":fill\n"
+        "ipush IAX\n"
+        "ipush IAX\n"
+        "mul\n"
+        "pop [IAX+100]\n"
+        "iadd IAX 1\n"
+        "ijb IAX 10 fill\n"
+        "iset IBX 0\n"
+        "push 0\n"
+        ":sum\n"
+        "push [IBX+100]\n"
+        "add\n"
+        "iadd IBX 1\n"
+        "ijne IBX 10 sum\n"
+        "out\n"
+        "push 7\n"
+        "ipop ICX\n"
+        "push 3\n"
+        "imul ICX\n"
+        "push 5\n"
+        "isub ICX\n"
+        "push 2.9\n"
+        "iadd ICX\n"
+        "ipush ICX\n"
+        "out\n"
+        "iset IDX 3\n"
+        "push -1.5\n"
+        "pop [IDX]\n"
+        "push [IDX]\n"
+        "out\n"
+        "ija IDX 2 greater\n"
+        "push 0\n"
+        "out\n"
+        ":greater\n"
+        "ije IDX 4 wrong\n"
+        "iadd IDX -10\n"
+        "ipush IDX\n"
+        "out\n"
+        "hlt\n"
+        ":wrong\n"
+        "push 0\n"
+        "out\n"
+        "hlt\n"
+        ,
+        ""
+        ,
+        "285\n"
+        "18\n"
+        "-1.5\n"
+        "-7\n"
+    );
 }
 
 TEST(Compiler, CompileDecompileCompile) {
@@ -247,6 +378,477 @@ TEST(Compiler, CompileDecompileCompile) {
     ASSERT_EQ(out1, out2);
 }
 
+TEST(Compiler, DecompilesLabels) {
+    std::ifstream in("../cpu/test_programs/fib.txt");
+    std::stringstream source;
+    source << in.rdbuf();
+    for (bool symbols : {false, true}) {
+        Cpu::CompileOptions options;
+        options.symbols = symbols;
+        std::stringstream in1(source.str());
+        auto out1 = Cpu::Compile(in1, options);
+        std::stringstream out_decomp;
+        Cpu::Decompile(out1.data(), out_decomp);
+        std::stringstream in2(out_decomp.str());
+        auto out2 = Cpu::Compile(in2, options);
+        ASSERT_EQ(out1, out2);
+        ASSERT_EQ(out_decomp.str().find(":fib\n") != std::string::npos, symbols);
+    }
+}
+
+TEST(Compiler, ContainerLayout) {
+    auto program = CompileText(
+        "push 2.5\n"
+        "push 2.5\n"
+        ":loop\n"
+        "je 7 loop\n"
+        "out\n"
+        , true, false
+    );
+    Cpu::ProgramImage image(program.data());
+    ASSERT_EQ(memcmp(program.data(), Cpu::PROGRAM_MAGIC, sizeof(Cpu::PROGRAM_MAGIC)), 0);
+    ASSERT_EQ(image.Length(), program.size());
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(image.Constants()) % alignof(double), 0u);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(image.Code()) % alignof(Cpu::Instruction), 0u);
+    // Equal constants share the pool entry, and the program gets its final hlt
+    ASSERT_EQ(image.Size(), 5u);
+    ASSERT_EQ(image.Code()[0].constant, image.Code()[1].constant);
+    ASSERT_EQ(image.Constants()[image.Code()[0].constant], 2.5);
+    ASSERT_EQ(image.Code()[2].command, Cpu::JE_IMM);
+    ASSERT_EQ(image.Code()[2].target, 2u);
+    ASSERT_EQ(image.Constants()[image.Code()[2].constant], 7);
+    ASSERT_EQ(image.Code()[4].command, Cpu::HLT);
+    ASSERT_TRUE(image.Symbols().empty());
+}
+
+TEST(Compiler, ParsesEveryCommandSyntax) {
+    for (size_t i = 0; i < Cpu::COMMAND_COUNT; ++i) {
+        Cpu::Command command = Cpu::Command(i);
+        double args[Cpu::MAX_ARGS_COUNT] = {7, 9};
+        if (Cpu::IsJumpCommand(command)) {
+            args[Cpu::CommandParamCnt(command) - 1] = 0;
+        }
+        Cpu::Command parsed = Cpu::HLT;
+        double parsed_args[Cpu::MAX_ARGS_COUNT] = {};
+        std::string label;
+        ASSERT_TRUE(Cpu::ParseCommand(Cpu::StringFromCommand(command, args), &parsed, parsed_args, &label));
+        ASSERT_EQ(parsed, command);
+        for (size_t j = 0; j < Cpu::CommandParamCnt(command); ++j) {
+            ASSERT_EQ(parsed_args[j], args[j]);
+        }
+        ASSERT_EQ(label.empty(), !Cpu::IsJumpCommand(command));
+    }
+}
+
+TEST(Compiler, Tokenizer) {
+    ASSERT_EQ(CompileText("push  [ RAX + 12 ]\n", false), CompileText("push [RAX+12]\n", false));
+    ASSERT_EQ(CompileText("\tpush\t-1e-3 \n", false), CompileText("push -0.001\n", false));
+    ASSERT_EQ(CompileText("jmp 10\n:10\nhlt\n", false), CompileText("jmp ten\n:ten\nhlt\n", false));
+    Cpu::Command command = Cpu::HLT;
+    double args[Cpu::MAX_ARGS_COUNT] = {};
+    std::string label;
+    ASSERT_FALSE(Cpu::ParseCommand("push RAX 5", &command, args, &label));
+    ASSERT_FALSE(Cpu::ParseCommand("push [RBX+1] 2 3", &command, args, &label));
+    ASSERT_FALSE(Cpu::ParseCommand("pusher 1", &command, args, &label));
+    ASSERT_TRUE(Cpu::ParseCommand("je -2.5 loop", &command, args, &label));
+    ASSERT_EQ(command, Cpu::JE_IMM);
+    ASSERT_EQ(args[0], -2.5);
+    ASSERT_EQ(label, "loop");
+}
+
+TEST(Compiler, StreamsSameProgram) {
+    // Forward jumps far enough to be patched in the file, folding, a label
+    // at the end and constants past the first write of the code
+    std::stringstream generated;
+    const int BLOCKS = 3000;
+    for (int i = 0; i < BLOCKS; ++i) {
+        generated << "push " << i << "\npush 2\nmul\npop RAX\njmp block" << (BLOCKS - 1 - i) << "\n";
+        generated << ":block" << i << "\npush RAX\npush 1\npop\nje 0.5 block" << i << "\n";
+    }
+    generated << ":end\n";
+    std::vector<std::string> sources = {generated.str()};
+    for (const char* name : {"fib", "fib_call", "square_solver", "sum"}) {
+        std::ifstream in(std::string("../cpu/test_programs/") + name + ".txt");
+        std::stringstream source;
+        source << in.rdbuf();
+        sources.push_back(source.str());
+    }
+    char filename[] = "/tmp/cpu_stream_XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    for (const auto& source : sources) {
+        for (int flags = 0; flags < 4; ++flags) {
+            Cpu::CompileOptions options;
+            options.optimize = flags & 1;
+            options.symbols = flags & 2;
+            // Only the peephole pass streams
+            options.dataflow = false;
+            std::stringstream in1(source);
+            Cpu::CompileToFile(in1, filename, options);
+            std::ifstream streamed(filename);
+            std::stringstream streamed_program;
+            streamed_program << streamed.rdbuf();
+            std::stringstream in2(source);
+            ASSERT_EQ(streamed_program.str(), Cpu::Compile(in2, options));
+        }
+    }
+    unlink(filename);
+}
+
+TEST(CompileCache, Sha256) {
+    Cpu::Sha256 empty;
+    ASSERT_EQ(Cpu::Sha256::Hex(empty.Finish()), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    Cpu::Sha256 abc;
+    abc.Update("abc");
+    ASSERT_EQ(Cpu::Sha256::Hex(abc.Finish()), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    // Longer than a block, fed in uneven pieces
+    std::string text(1000, 'a');
+    Cpu::Sha256 whole;
+    whole.Update(text);
+    Cpu::Sha256 pieces;
+    for (size_t i = 0; i < text.size(); i += 37) {
+        pieces.Update(text.data() + i, std::min<size_t>(37, text.size() - i));
+    }
+    ASSERT_EQ(whole.Finish(), pieces.Finish());
+}
+
+TEST(CompileCache, HitsSkipCompiling) {
+    TempDirectory directory;
+    const std::string& base = directory.Path();
+    std::ifstream in("../cpu/test_programs/fib.txt");
+    std::stringstream source;
+    source << in.rdbuf();
+    std::string fib = CompileFromFile("../cpu/test_programs/fib.txt");
+    {
+        Cpu::CompileCache cache(base);
+        Cpu::CompileOptions options;
+        options.cache = &cache;
+        for (int i = 0; i < 3; ++i) {
+            std::stringstream in1(source.str());
+            ASSERT_EQ(Cpu::Compile(in1, options), fib);
+        }
+        ASSERT_EQ(cache.Misses(), 1u);
+        ASSERT_EQ(cache.Hits(), 2u);
+        // Other options compile to another program
+        options.symbols = true;
+        std::stringstream in2(source.str());
+        ASSERT_NE(Cpu::Compile(in2, options), fib);
+        ASSERT_EQ(cache.Misses(), 2u);
+    }
+    // Entries outlive the cache object, and damaged ones are compiled again
+    Cpu::CompileCache cache(base);
+    Cpu::CompileOptions options;
+    options.cache = &cache;
+    std::stringstream in1(source.str());
+    ASSERT_EQ(Cpu::Compile(in1, options), fib);
+    ASSERT_EQ(cache.Hits(), 1u);
+    // Optimized with the dataflow passes
+    std::string key = Cpu::CompileCache::Key(source.str(), 1 | 1 << 2);
+    std::ofstream(base + "/" + key + ".bin") << fib.substr(0, fib.size() - 1);
+    std::stringstream in2(source.str());
+    ASSERT_EQ(Cpu::Compile(in2, options), fib);
+    ASSERT_EQ(cache.Misses(), 1u);
+    std::string cached;
+    ASSERT_TRUE(cache.Lookup(key, &cached));
+    ASSERT_EQ(cached, fib);
+}
+
+TEST(CompileCache, EvictsLeastRecentlyUsed) {
+    TempDirectory directory;
+    const std::string& base = directory.Path();
+    std::string program = CompileText("push 1\nout\n");
+    // Room for two entries
+    Cpu::CompileCache cache(base, program.size() * 2);
+    std::string first = Cpu::CompileCache::Key("first", 0);
+    std::string second = Cpu::CompileCache::Key("second", 0);
+    std::string third = Cpu::CompileCache::Key("third", 0);
+    std::string cached;
+    cache.Store(first, program);
+    cache.Store(second, program);
+    ASSERT_TRUE(cache.Lookup(first, &cached));
+    cache.Store(third, program);
+    ASSERT_TRUE(cache.Lookup(first, &cached));
+    ASSERT_TRUE(cache.Lookup(third, &cached));
+    ASSERT_FALSE(cache.Lookup(second, &cached));
+}
+
+TEST(Decoder, JumpTargetsAreIndices) {
+    auto fib_program = CompileFromFile("../cpu/test_programs/fib.txt");
+    Cpu::DecodedProgram decoded(fib_program.data());
+    for (size_t i = 0; i < decoded.Size(); ++i) {
+        const Cpu::Instruction& instruction = decoded.Code()[i];
+        ASSERT_EQ(decoded.IndexOf(decoded.PositionOf(i)), i);
+        if (Cpu::IsJumpCommand(instruction.command)) {
+            ASSERT_LT(instruction.target, decoded.Size());
+        } else {
+            ASSERT_EQ(instruction.target, Cpu::NO_INDEX);
+        }
+    }
+}
+
+TEST(Optimizer, FoldsConstants) {
+    ASSERT_EQ(
+        CompileText(
+            "push 2\n"
+            "push 3\n"
+            "add\n"
+            "push 4\n"
+            "mul\n"
+            "push 10\n"
+            "pop\n"
+            "out\n"
+            "hlt\n"
+            , true, false
+        ),
+        CompileText(
+            "push 20\n"
+            "out\n"
+            "hlt\n"
+            , false
+        )
+    );
+    ASSERT_EQ(
+        CompileText(
+            "push 1\n"
+            "push 1\n"
+            "je equal\n"
+            "push 1\n"
+            "push 2\n"
+            "je equal\n"
+            ":equal\n"
+            "hlt\n"
+            , true, false
+        ),
+        CompileText(
+            "jmp equal\n"
+            ":equal\n"
+            "hlt\n"
+            , false
+        )
+    );
+}
+
+TEST(Optimizer, Superinstructions) {
+    ASSERT_EQ(
+        CompileText(
+            "push RAX\n"
+            "push 1\n"
+            "sub\n"
+            "pop RAX\n"
+            "push RAX\n"
+            "dup\n"
+            "push 0\n"
+            "je end\n"
+            "push RBX\n"
+            "pop RBX\n"
+            ":end\n"
+            "hlt\n"
+            , true, false
+        ),
+        CompileText(
+            "push RAX\n"
+            "sub 1\n"
+            "store RAX\n"
+            "dup\n"
+            "je 0 end\n"
+            ":end\n"
+            "hlt\n"
+            , false
+        )
+    );
+    TestTextProgram(
+        "in\n"
+        "add 2\n"
+        "store RAX\n"
+        "ja 4 big\n"
+        "push RAX\n"
+        "out\n"
+        "hlt\n"
+        ":big\n"
+        "push RAX\n"
+        "mul 10\n"
+        "out\n"
+        "hlt\n"
+        ,
+        "3\n"
+        ,
+        "50\n"
+    );
+}
+
+TEST(Optimizer, DoesNotFoldAcrossLabels) {
+    TestTextProgram(
+        "push 0\n"
+        "pop RAX\n"
+        "push 1\n"
+        ":again\n"
+        "push 2\n"
+        "add\n"
+        "push RAX\n"
+        "add 1\n"
+        "store RAX\n"
+        "je 1 again\n"
+        "out\n"
+        "hlt\n"
+        ,
+        ""
+        ,
+        "5\n"
+    );
+}
+
+TEST(Optimizer, SameOutputAsUnoptimized) {
+    std::ifstream fib_in("../cpu/test_programs/fib.txt");
+    std::stringstream fib_text;
+    fib_text << fib_in.rdbuf();
+    auto optimized = CompileText(fib_text.str());
+    auto plain = CompileText(fib_text.str(), false);
+    ASSERT_LT(optimized.size(), plain.size());
+    for (const char* input : {"0\n", "1\n", "9\n"}) {
+        Cpu::BufferCommandsReader optimized_reader(optimized.data());
+        Cpu::BufferCommandsReader plain_reader(plain.data());
+        ASSERT_EQ(RunProgram(optimized_reader, input), RunProgram(plain_reader, input));
+    }
+}
+
+TEST(Optimizer, PropagatesConstantsAcrossBlocks) {
+    ASSERT_EQ(
+        CompileText(
+            "push 3\n"
+            "pop RAX\n"
+            "jmp next\n"
+            ":next\n"
+            "push RAX\n"
+            "push 2\n"
+            "ja big\n"
+            "push 0\n"
+            "out\n"
+            "hlt\n"
+            ":big\n"
+            "push RAX\n"
+            "push 1\n"
+            "add\n"
+            "out\n"
+            "hlt\n"
+        ),
+        CompileText(
+            "push 4\n"
+            "out\n"
+            "hlt\n"
+            , false
+        )
+    );
+}
+
+TEST(Optimizer, ThreadsJumps) {
+    ASSERT_EQ(
+        CompileText(
+            "in\n"
+            "jne 0 a\n"
+            "jmp b\n"
+            ":a\n"
+            "jmp c\n"
+            ":b\n"
+            "push 1\n"
+            "out\n"
+            "hlt\n"
+            ":c\n"
+            "jmp d\n"
+            ":d\n"
+            "push 2\n"
+            "out\n"
+            "hlt\n"
+        ),
+        CompileText(
+            "in\n"
+            "jne 0 d\n"
+            "push 1\n"
+            "out\n"
+            "hlt\n"
+            ":d\n"
+            "push 2\n"
+            "out\n"
+            "hlt\n"
+            , false
+        )
+    );
+}
+
+TEST(Optimizer, RemovesDeadStores) {
+    ASSERT_EQ(
+        CompileText(
+            "in\n"
+            "pop RAX\n"
+            "in\n"
+            "pop RAX\n"
+            "push RAX\n"
+            "out\n"
+        ),
+        CompileText(
+            "in\n"
+            "pop\n"
+            "in\n"
+            "out\n"
+            , false
+        )
+    );
+    // Registers stay live across calls
+    TestTextProgram(
+        "push 5\n"
+        "pop RAX\n"
+        "call print\n"
+        "hlt\n"
+        ":print\n"
+        "push RAX\n"
+        "out\n"
+        "return\n"
+        ,
+        ""
+        ,
+        "5\n"
+    );
+}
+
+TEST(Optimizer, SquareSolverDataflow) {
+    std::ifstream in("../cpu/test_programs/square_solver.txt");
+    std::stringstream source;
+    source << in.rdbuf();
+    auto global = CompileText(source.str());
+    auto peephole = CompileText(source.str(), true, false);
+    auto count_jumps = [](const std::string& program) {
+        Cpu::ProgramImage image(program.data());
+        size_t jumps = 0;
+        for (size_t i = 0; i < image.Size(); ++i) {
+            jumps += Cpu::IsJumpCommand(image.Code()[i].command);
+        }
+        return jumps;
+    };
+    ASSERT_LT(count_jumps(global), count_jumps(peephole));
+    for (const char* input : {"1\n-4\n3\n", "12\n-1\n-1\n", "1\n6\n9\n", "1\n6\n10\n", "-2\n0\n8\n",
+                              "0\n2\n10\n", "0\n0\n5\n", "0\n0\n0\n", "0.00001\n0\n1\n"}) {
+        Cpu::BufferCommandsReader reader(peephole.data());
+        TestBinaryProgram(global.data(), input, RunProgram(reader, input));
+    }
+
+    // With the coefficients known, the whole solver folds into its answer
+    for (auto coefficients : {"1 -4 3", "12 -1 -1", "1 6 9", "1 6 10", "0 2 10", "0 0 5", "0 0 0"}) {
+        std::stringstream numbers(coefficients);
+        std::string a, b, c;
+        numbers >> a >> b >> c;
+        std::string text = source.str();
+        text.replace(text.find("in\nin\nin\n"), 9, "push " + a + "\npush " + b + "\npush " + c + "\n");
+        auto folded = CompileText(text);
+        Cpu::ProgramImage image(folded.data());
+        for (size_t i = 0; i < image.Size(); ++i) {
+            Cpu::Command command = image.Code()[i].command;
+            ASSERT_TRUE(command == Cpu::PUSH || command == Cpu::OUT || command == Cpu::HLT);
+        }
+        Cpu::BufferCommandsReader reader(global.data());
+        TestBinaryProgram(folded.data(), "", RunProgram(reader, a + "\n" + b + "\n" + c + "\n"));
+    }
+}
+
 TEST(BigPrograms, Fib) {
     auto fib_program = CompileFromFile("../cpu/test_programs/fib.txt");
     TestBinaryProgram(fib_program.data(), "0\n", "1\n");
@@ -258,6 +860,14 @@ TEST(BigPrograms, Fib) {
     TestBinaryProgram(fib_program.data(), "6\n", "13\n");
 }
 
+TEST(BigPrograms, FibCall) {
+    auto fib_program = CompileFromFile("../cpu/test_programs/fib_call.txt");
+    TestBinaryProgram(fib_program.data(), "0\n", "1\n");
+    TestBinaryProgram(fib_program.data(), "1\n", "1\n");
+    TestBinaryProgram(fib_program.data(), "6\n", "13\n");
+    TestBinaryProgram(fib_program.data(), "15\n", "987\n");
+}
+
 TEST(BigPrograms, SquareSolver) {
     auto solver_program = CompileFromFile("../cpu/test_programs/square_solver.txt");
 
@@ -272,6 +882,302 @@ TEST(BigPrograms, SquareSolver) {
     TestBinaryProgram(solver_program.data(), "0\n0\n0\n", "-1\n");
 }
 
+void TestAgainstInterpreter(const std::string& program, const std::vector<std::string>& inputs) {
+    for (const auto& input : inputs) {
+        Cpu::BufferCommandsReader reader(program.data());
+        Cpu::BufferCommandsReader jit_reader(program.data());
+        ASSERT_EQ(RunProgram(jit_reader, input, Cpu::Engine::JIT), RunProgram(reader, input, Cpu::Engine::SWITCH));
+    }
+}
+
+// Runs the program and returns the memory fault it stopped with
+template <class CpuType = Cpu::Cpu>
+std::string RunFaultingProgram(const std::string& program, Cpu::Memory memory, Cpu::Engine engine) {
+    std::stringstream output_buffer;
+    std::streambuf* old_output = std::cout.rdbuf(output_buffer.rdbuf());
+    Cpu::BufferCommandsReader reader(program.data());
+    CpuType cpu(reader, std::move(memory));
+    std::string fault;
+    try {
+        cpu.Run(engine);
+    } catch (const Cpu::MemoryFault& error) {
+        fault = error.what();
+    }
+    std::cout.rdbuf(old_output);
+    return fault;
+}
+
+TEST(Memory, Paged) {
+    Cpu::Memory memory;
+    memory.at(1e10) = 5;
+    memory.at(1e10 + 1) = 6;
+    ASSERT_EQ(memory.at(1e10), 5);
+    ASSERT_EQ(memory.at(1e10 + 1), 6);
+    ASSERT_EQ(memory.at(0), 0);
+    // Two pages, the directory and the two tables of the pages
+    const size_t table = Cpu::Memory::TABLE_PAGES * sizeof(double*);
+    ASSERT_EQ(memory.Allocated(), 2 * Cpu::Memory::PAGE_CELLS * sizeof(double) + 3 * table);
+    ASSERT_THROW(memory.at(-1), Cpu::MemoryFault);
+    ASSERT_THROW(memory.at(Cpu::Memory::ADDRESS_SPACE), Cpu::MemoryFault);
+}
+
+TEST(Memory, LimitAndFlat) {
+    // Room for three pages of the first table
+    const size_t table = Cpu::Memory::TABLE_PAGES * sizeof(double*);
+    Cpu::Memory limited(3 * Cpu::Memory::PAGE_CELLS * sizeof(double) + 2 * table);
+    for (size_t page = 0; page < 3; ++page) {
+        limited.at(page * 1e6) = page;
+    }
+    ASSERT_THROW(limited.at(4e6), Cpu::MemoryFault);
+    ASSERT_EQ(limited.at(2e6), 2);
+
+    // Tables count too, so touching one cell per table stops at the limit
+    Cpu::Memory sparse(size_t(1) << 20);
+    ASSERT_THROW({
+        for (size_t i = 0; i < Cpu::Memory::DIRECTORY_TABLES; ++i) {
+            sparse.AtIndex(i * Cpu::Memory::TABLE_PAGES * Cpu::Memory::PAGE_CELLS) = 1;
+        }
+    }, Cpu::MemoryFault);
+    ASSERT_LE(sparse.Allocated(), sparse.Limit());
+
+    Cpu::Memory flat = Cpu::Memory::Flat(100);
+    flat.at(99) = 1;
+    ASSERT_EQ(flat.at(99), 1);
+    ASSERT_THROW(flat.at(100), Cpu::MemoryFault);
+}
+
+TEST(Memory, FaultsStopEveryEngine) {
+    auto program = CompileText(
+        "push 1\n"
+        "pop [10]\n"
+        "push 2\n"
+        "out\n"
+        "push 3\n"
+        "pop [1000]\n"
+        "push 4\n"
+        "out\n"
+        "hlt\n"
+    );
+    for (auto engine : ALL_ENGINES) {
+        ASSERT_EQ(RunFaultingProgram(program, Cpu::Memory::Flat(100), engine),
+                  "address 1000 is past the flat memory of 100 cells");
+        ASSERT_EQ(RunFaultingProgram(program, Cpu::Memory(), engine), "");
+    }
+}
+
+TEST(Memory, IntegerAddresses) {
+    auto program = CompileText("iset IAX 5\npush 1\npop [IAX+-10]\nhlt\n");
+    for (auto engine : ALL_ENGINES) {
+        ASSERT_EQ(RunFaultingProgram(program, Cpu::Memory(), engine),
+                  "address 18446744073709551611 is out of the address space");
+    }
+    Cpu::Memory memory;
+    memory.AtIndex(1 << 20) = 3;
+    ASSERT_EQ(memory.at(1 << 20), 3);
+}
+
+TEST(Memory, CallDepthFaultsEveryEngine) {
+    auto recursive = CompileText(
+        ":forever\n"
+        "call forever\n"
+        "hlt\n"
+    );
+    auto unbalanced = CompileText("return\nhlt\n");
+    for (auto engine : ALL_ENGINES) {
+        std::string fault;
+        Cpu::BufferCommandsReader reader(recursive.data());
+        Cpu::Cpu cpu(reader);
+        cpu.SetCallDepthLimit(1000);
+        try {
+            cpu.Run(engine);
+        } catch (const Cpu::MemoryFault& error) {
+            fault = error.what();
+        }
+        ASSERT_EQ(fault, "call depth limit of 1000 exceeded");
+        ASSERT_EQ(RunFaultingProgram(unbalanced, Cpu::Memory(), engine), "return without a call");
+    }
+}
+
+TEST(Memory, RetToNotACommandFaultsEveryEngine) {
+    auto past_end = CompileText("push 99\npop RDX\nret\nhlt\n");
+    auto negative = CompileText("push -1\npop RDX\nret\nhlt\n");
+    for (auto engine : ALL_ENGINES) {
+        ASSERT_EQ(RunFaultingProgram(past_end, Cpu::Memory(), engine), "ret to 99, which is not a command");
+        ASSERT_EQ(RunFaultingProgram(negative, Cpu::Memory(), engine), "ret to -1, which is not a command");
+    }
+}
+
+// Lays out x[i] = i + 1 and y[i] = 2i - 7, then runs body. $X, $Y, $Z, $W
+// and $V are the ranges and $N their length.
+std::string VectorProgram(const std::string& body, size_t count) {
+    std::string program =
+        "iset IAX 0\n"
+        ":init\n"
+        "ipush IAX\n"
+        "add 1\n"
+        "pop [IAX+$X]\n"
+        "ipush IAX\n"
+        "mul 2\n"
+        "sub 7\n"
+        "pop [IAX+$Y]\n"
+        "iadd IAX 1\n"
+        "ijb IAX $N init\n" + body + "hlt\n";
+    // Ranges cross page boundaries
+    size_t page = Cpu::Memory::PAGE_CELLS;
+    const std::pair<std::string, size_t> ranges[] = {
+        {"$X", page - 5}, {"$Y", 3 * page - 11}, {"$Z", 100}, {"$W", 2 * page - 1}, {"$V", 5 * page - 2},
+        {"$N", count},
+    };
+    for (auto& range : ranges) {
+        for (size_t at = 0; (at = program.find(range.first, at)) != std::string::npos;) {
+            program.replace(at, range.first.size(), std::to_string(range.second));
+        }
+    }
+    return program;
+}
+
+TEST(Vector, SameAsLoops) {
+    std::string vectors =
+        "push $Z\npush $X\npush $Y\npush $N\nvadd\n"
+        "push $X\npush $Y\npush $N\nvdot\nout\n"
+        "push $Z\npush $N\nvsum\nout\n"
+        "push $W\npush $X\npush $Y\npush $N\nvmul\n"
+        "push $W\npush 3\npush $X\npush $N\nvaxpy\n"
+        "push $W\npush $N\nvsum\nout\n"
+        "push $V\npush 0.5\npush $N\nvfill\n"
+        "push $V\npush $N\nvsum\nout\n";
+    // The same with a loop per command
+    std::string loops =
+        "iset IBX 0\n:add\npush [IBX+$X]\npush [IBX+$Y]\nadd\npop [IBX+$Z]\niadd IBX 1\nijb IBX $N add\n"
+        "push 0\niset IBX 0\n:dot\npush [IBX+$X]\npush [IBX+$Y]\nmul\nadd\niadd IBX 1\nijb IBX $N dot\nout\n"
+        "push 0\niset IBX 0\n:sumz\npush [IBX+$Z]\nadd\niadd IBX 1\nijb IBX $N sumz\nout\n"
+        "iset IBX 0\n:mul\npush [IBX+$X]\npush [IBX+$Y]\nmul\npop [IBX+$W]\niadd IBX 1\nijb IBX $N mul\n"
+        "iset IBX 0\n:axpy\npush [IBX+$W]\npush 3\npush [IBX+$X]\nmul\nadd\npop [IBX+$W]\niadd IBX 1\n"
+        "ijb IBX $N axpy\n"
+        "push 0\niset IBX 0\n:sumw\npush [IBX+$W]\nadd\niadd IBX 1\nijb IBX $N sumw\nout\n"
+        "iset IBX 0\n:fill\npush 0.5\npop [IBX+$V]\niadd IBX 1\nijb IBX $N fill\n"
+        "push 0\niset IBX 0\n:sumv\npush [IBX+$V]\nadd\niadd IBX 1\nijb IBX $N sumv\nout\n";
+    for (size_t count : {1, 4, 23, 100}) {
+        auto compiled = CompileText(VectorProgram(loops, count));
+        Cpu::BufferCommandsReader reader(compiled.data());
+        TestTextProgram(VectorProgram(vectors, count), "", RunProgram(reader, ""));
+    }
+    TestTextProgram(VectorProgram(vectors, 23), "", "6164\n621\n6992\n11.5\n");
+    // Counts below one do nothing
+    TestTextProgram("push 0\npush 1\npush 0\nvfill\npush 0\npush -5\nvsum\nout\nhlt\n", "", "0\n");
+}
+
+TEST(Vector, KernelsAgree) {
+#ifdef CPU_VECTOR_AVX2
+    if (!__builtin_cpu_supports("avx2")) {
+        return;
+    }
+    std::vector<double> x(64);
+    std::vector<double> y(64);
+    srand(18);
+    for (size_t i = 0; i < x.size(); ++i) {
+        x[i] = rand() / double(RAND_MAX) - 0.5;
+        y[i] = rand() / double(RAND_MAX) * 1e3;
+    }
+    const Cpu::VectorKernels& scalar = Cpu::SCALAR_KERNELS;
+    const Cpu::VectorKernels& avx2 = Cpu::AVX2_KERNELS;
+    for (size_t count = 0; count <= x.size(); ++count) {
+        ASSERT_EQ(scalar.dot(x.data(), y.data(), count), avx2.dot(x.data(), y.data(), count));
+        ASSERT_EQ(scalar.sum(y.data(), count), avx2.sum(y.data(), count));
+        std::vector<double> expected(y);
+        std::vector<double> result(y);
+        scalar.axpy(expected.data(), 0.3, x.data(), count);
+        avx2.axpy(result.data(), 0.3, x.data(), count);
+        ASSERT_EQ(expected, result);
+        scalar.mul(expected.data(), x.data(), y.data(), count);
+        avx2.mul(result.data(), x.data(), y.data(), count);
+        ASSERT_EQ(expected, result);
+        scalar.add(expected.data(), x.data(), y.data(), count);
+        avx2.add(result.data(), x.data(), y.data(), count);
+        ASSERT_EQ(expected, result);
+        scalar.fill(expected.data(), 0.7, count);
+        avx2.fill(result.data(), 0.7, count);
+        ASSERT_EQ(expected, result);
+    }
+    ASSERT_STREQ(Cpu::Kernels().name, "avx2");
+#endif
+}
+
+TEST(Vector, FaultsLeaveMemoryUnchanged) {
+    Cpu::Memory memory = Cpu::Memory::Flat(100);
+    ASSERT_THROW(Cpu::VectorFill(&memory, 90, 1, 20), Cpu::MemoryFault);
+    ASSERT_EQ(memory.at(95), 0);
+    ASSERT_THROW(Cpu::VectorAdd(&memory, 0, 50, 95, 10), Cpu::MemoryFault);
+    ASSERT_THROW(Cpu::VectorSum(&memory, -1, 10), Cpu::MemoryFault);
+    // Counts below one do nothing, whatever the addresses
+    ASSERT_EQ(Cpu::VectorSum(&memory, -1, 0), 0);
+    Cpu::VectorFill(&memory, 1e300, 1, 0.5);
+    TestTextProgram("push -1\npush -2\npush -3\npush 0\nvadd\npush 7\nout\nhlt\n", "", "7\n");
+
+    auto program = CompileText("push 90\npush 1\npush 20\nvfill\nhlt\n");
+    for (auto engine : ALL_ENGINES) {
+        ASSERT_EQ(RunFaultingProgram(program, Cpu::Memory::Flat(100), engine),
+                  "address 100 is past the flat memory of 100 cells");
+    }
+}
+
+TEST(Jit, Differential) {
+    TestAgainstInterpreter(CompileFromFile("../cpu/test_programs/fib.txt"), {"0\n", "1\n", "7\n", "15\n"});
+    TestAgainstInterpreter(CompileFromFile("../cpu/test_programs/fib_call.txt"), {"0\n", "1\n", "7\n", "15\n"});
+    TestAgainstInterpreter(CompileFromFile("../cpu/test_programs/square_solver.txt"),
+                           {"1\n-4\n3\n", "12\n-1\n-1\n", "1\n6\n9\n", "1\n6\n10\n",
+                            "0\n2\n10\n", "0\n0\n5\n", "0\n0\n0\n", "nan\n1\n1\n"});
+}
+
+TEST(Jit, FallsBackOnStackUnderflow) {
+    TestTextProgram(
+        "push 1\n"
+        "pop\n"
+        "pop\n"
+        "out\n"
+        "push 2\n"
+        "out\n"
+        "hlt\n"
+        ,
+        ""
+        ,
+        "0\n"
+        "2\n"
+    );
+}
+
+TEST(Jit, FallsBackOnStackOverflow) {
+    std::stringstream program(
+        "push 100000\n"
+        "pop RAX\n"
+        ":loop\n"
+        "push RAX\n"
+        "push RAX\n"
+        "push 1\n"
+        "sub\n"
+        "pop RAX\n"
+        "push RAX\n"
+        "push 0\n"
+        "ja loop\n"
+        "add\n"
+        "add\n"
+        "out\n"
+        "hlt\n"
+    );
+    TestAgainstInterpreter(Cpu::Compile(program), {""});
+}
+
+TEST(Stacks, CheckedStackGivesSameResults) {
+    auto sum_program = CompileFromFile("../cpu/test_programs/sum.txt");
+    for (auto engine : ALL_ENGINES) {
+        Cpu::BufferCommandsReader checked_reader(sum_program.data());
+        Cpu::BufferCommandsReader fast_reader(sum_program.data());
+        auto checked = RunProgram<Cpu::BasicCpu<Stack>>(checked_reader, "100\n", engine);
+        ASSERT_EQ(checked, "5050\n");
+        ASSERT_EQ(RunProgram<Cpu::BasicCpu<FastStack>>(fast_reader, "100\n", engine), checked);
+    }
+}
+
 TEST(Runner, BinFormat) {
     std::string program =
         "push 10\n"
@@ -291,6 +1197,699 @@ TEST(Runner, BinFormat) {
     );
 }
 
+TEST(Runner, MappedFile) {
+    auto program = CompileFromFile("../cpu/test_programs/sum.txt");
+    char filename[] = "/tmp/cpu_test_XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(write(fd, program.data(), program.size()), static_cast<ssize_t>(program.size()));
+    close(fd);
+    for (auto engine : ALL_ENGINES) {
+        Cpu::MappedFileCommandsReader mapped(filename);
+        Cpu::BinaryFileCommandsReader read(filename);
+        ASSERT_EQ(RunProgram(mapped, "100\n", engine), "5050\n");
+        ASSERT_EQ(RunProgram(read, "100\n", engine), "5050\n");
+    }
+    unlink(filename);
+}
+
+// Output of a command run by the shell with the input on stdin
+std::string RunCommand(const std::string& command, const std::string& input) {
+    char filename[] = "/tmp/cpu_test_XXXXXX";
+    int fd = mkstemp(filename);
+    EXPECT_GE(fd, 0);
+    EXPECT_EQ(write(fd, input.data(), input.size()), static_cast<ssize_t>(input.size()));
+    close(fd);
+    FILE* pipe = popen((command + " < " + filename).c_str(), "r");
+    std::string output;
+    char buffer[4096];
+    for (size_t count; (count = fread(buffer, 1, sizeof(buffer), pipe)) > 0;) {
+        output.append(buffer, count);
+    }
+    EXPECT_EQ(pclose(pipe), 0);
+    unlink(filename);
+    return output;
+}
+
+// fib_native and square_solver_native are built from the test programs by
+// cpu2cpp next to runner
+TEST(Runner, TranspiledSameAsRunner) {
+    for (const char* input : {"0\n", "1\n", "7\n", "20\n"}) {
+        ASSERT_EQ(RunCommand("./fib_native", input), RunCommand("./runner fib.bin", input));
+    }
+    for (const char* input : {"1\n-4\n3\n", "12\n-1\n-1\n", "1\n6\n9\n", "1\n6\n10\n", "0\n2\n10\n", "0\n0\n5\n",
+                              "0\n0\n0\n", "nan\n1\n1\n"}) {
+        ASSERT_EQ(RunCommand("./square_solver_native", input), RunCommand("./runner square_solver.bin", input));
+    }
+}
+
+TEST(Runner, TranspilesToLocals) {
+    // Reached at depths 0 and 1, so written out twice
+    auto program = CompileText(
+        "in\n"
+        "push 0\n"
+        "ja skip\n"
+        "push 5\n"
+        ":skip\n"
+        "push 1\n"
+        "out\n"
+        "hlt\n"
+    );
+    std::string text = Cpu::Transpile(Cpu::DecodedProgram(program.data()));
+    ASSERT_EQ(text.find("stack"), std::string::npos);
+    ASSERT_NE(text.find("L3_0:"), std::string::npos);
+    ASSERT_NE(text.find("s1 = 1.0;"), std::string::npos);
+
+    auto recursive = CompileFromFile("../cpu/test_programs/fib_call.txt");
+    text = Cpu::Transpile(Cpu::DecodedProgram(recursive.data()));
+    ASSERT_NE(text.find("Cpu::CpuStack<double> stack;"), std::string::npos);
+    ASSERT_NE(text.find("goto *labels[calls.Pop()];"), std::string::npos);
+}
+
+// Runs the program with BufferedIo between two temporary files
+std::string RunBuffered(const std::string& program, const std::string& input, Cpu::Engine engine,
+                        size_t buffer_size = Cpu::BufferedIo::DEFAULT_BUFFER_SIZE) {
+    FILE* in = tmpfile();
+    FILE* out = tmpfile();
+    fputs(input.c_str(), in);
+    fflush(in);
+    rewind(in);
+    {
+        Cpu::BufferCommandsReader reader(program.data());
+        Cpu::BufferedIo io(fileno(in), fileno(out), buffer_size);
+        Cpu::Cpu cpu(reader, Cpu::Memory(), &io);
+        cpu.Run(engine);
+    }
+    std::string output(lseek(fileno(out), 0, SEEK_END), '\0');
+    output.resize(pread(fileno(out), &output[0], output.size(), 0));
+    fclose(in);
+    fclose(out);
+    return output;
+}
+
+TEST(Io, BufferedSameAsStreams) {
+    auto solver_program = CompileFromFile("../cpu/test_programs/square_solver.txt");
+    auto sum_program = CompileFromFile("../cpu/test_programs/sum.txt");
+    for (auto engine : ALL_ENGINES) {
+        for (size_t buffer_size : {size_t(1), size_t(3), Cpu::BufferedIo::DEFAULT_BUFFER_SIZE}) {
+            ASSERT_EQ(RunBuffered(solver_program, "12\n-1\n  -1", engine, buffer_size), "2\n-0.25\n0.333333\n");
+            ASSERT_EQ(RunBuffered(solver_program, "1e0 6 1e1\n", engine, buffer_size), "0\n");
+            ASSERT_EQ(RunBuffered(sum_program, "1000", engine, buffer_size), "500500\n");
+        }
+        // Unparsable input reads as zeros, like with streams
+        ASSERT_EQ(RunBuffered(solver_program, "x 2 10", engine), "-1\n");
+    }
+}
+
+TEST(Profiler, CountsFib) {
+    std::ifstream in("../cpu/test_programs/fib.txt");
+    Cpu::CompileOptions options;
+    options.symbols = true;
+    auto program = Cpu::Compile(in, options);
+    Cpu::BufferCommandsReader reader(program.data());
+    Cpu::BasicCpu<Cpu::CpuStack, Cpu::Profiler> cpu(reader);
+    ASSERT_EQ(RunCpu(cpu, "10\n", Cpu::Engine::DECODED), "89\n");
+
+    // fib(10) makes 177 calls, all of them entering through the first command
+    const Cpu::Profiler& profiler = cpu.GetMonitor();
+    Cpu::ProgramImage image(program.data());
+    uint32_t fib = image.Symbols()[0].first;
+    ASSERT_EQ(image.Symbols()[0].second, "fib");
+    ASSERT_EQ(profiler.Count(0), 1u);
+    ASSERT_EQ(profiler.Count(fib), 177u);
+    ASSERT_EQ(profiler.EdgeCount(1, fib), 1u);
+
+    std::stringstream report;
+    profiler.WriteJson(report, image);
+    ASSERT_NE(report.str().find("{\"opcode\": \"HLT\", \"count\": 1}"), std::string::npos);
+    ASSERT_NE(report.str().find("\"label\": \"fib\""), std::string::npos);
+    ASSERT_NE(report.str().find("\"command\": \"jexec fib\""), std::string::npos);
+}
+
+TEST(Tracer, KeepsLastCommands) {
+    auto program = CompileText(
+        "iset ICX 9\n"
+        "push 5\n"
+        "pop RAX\n"
+        ":loop\n"
+        "push RAX\n"
+        "push 1\n"
+        "sub\n"
+        "store RAX\n"
+        "push 0\n"
+        "jne loop\n"
+        "push 7\n"
+        "out\n"
+        "hlt\n"
+    , false);
+    Cpu::BufferCommandsReader reader(program.data());
+    Cpu::BasicCpu<Cpu::CpuStack, Cpu::BasicTracer<8>> cpu(reader);
+    ASSERT_EQ(RunCpu(cpu, "", Cpu::Engine::DECODED), "7\n");
+
+    const auto& tracer = cpu.GetMonitor();
+    ASSERT_EQ(tracer.Total(), 3 + 5 * 6 + 3u);
+    auto records = tracer.Snapshot();
+    ASSERT_EQ(records.size(), 7u);
+    ASSERT_EQ(records.back().command, Cpu::HLT);
+    ASSERT_EQ(records.back().has_top, false);
+    ASSERT_EQ(records[records.size() - 2].command, Cpu::OUT);
+    ASSERT_EQ(records[records.size() - 2].top, 7);
+    ASSERT_EQ(records.back().regs[Cpu::RAX], 0);
+    ASSERT_EQ(records.back().iregs[Cpu::ICX], 9);
+
+    char filename[] = "/tmp/cpu_trace_XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    tracer.Dump(fd);
+    close(fd);
+    std::ifstream dump(filename);
+    std::string header;
+    std::getline(dump, header);
+    ASSERT_EQ(header, "trace: last 7 of 36 commands");
+    std::string first;
+    std::getline(dump, first);
+    ASSERT_NE(first.find("ICX=9 "), std::string::npos);
+    unlink(filename);
+}
+
+TEST(Tracer, DumpsOnSignal) {
+    auto program = CompileText("push 1\nout\nhlt\n");
+    char filename[] = "/tmp/cpu_trace_XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    Cpu::DumpTraceOnSignal();
+    raise(SIGUSR1);
+    Cpu::BufferCommandsReader reader(program.data());
+    Cpu::BasicCpu<Cpu::CpuStack, Cpu::Tracer> cpu(reader);
+    cpu.GetMonitor().SetOutput(fd, false);
+    ASSERT_EQ(RunCpu(cpu, "", Cpu::Engine::DECODED), "1\n");
+    close(fd);
+    signal(SIGUSR1, SIG_DFL);
+    std::ifstream dump(filename);
+    std::string header;
+    std::getline(dump, header);
+    ASSERT_EQ(header, "trace: last 0 of 0 commands");
+    unlink(filename);
+}
+
+TEST(Tracer, DumpsOnlyOnHalt) {
+    auto program = CompileText(
+        "push 0\n"
+        "pop RAX\n"
+        ":loop\n"
+        "push RAX\n"
+        "push 1\n"
+        "add\n"
+        "pop RAX\n"
+        "push 100\n"
+        "push RAX\n"
+        "ja loop\n"
+        "hlt\n"
+    , false);
+    char filename[] = "/tmp/cpu_trace_XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    Cpu::BufferCommandsReader reader(program.data());
+    Cpu::BasicCpu<Cpu::CpuStack, Cpu::Tracer> cpu(reader);
+    cpu.GetMonitor().SetOutput(fd, true);
+    uint32_t position = cpu.RunFor(10);
+    ASSERT_TRUE(cpu.OutOfBudget());
+    ASSERT_EQ(lseek(fd, 0, SEEK_END), 0);
+    ASSERT_EQ(cpu.RunFor(1000, position), Cpu::NO_INDEX);
+    ASSERT_GT(lseek(fd, 0, SEEK_END), 0);
+    close(fd);
+    unlink(filename);
+}
+
+TEST(Batch, PoolRunsEveryTaskOnce) {
+    Cpu::WorkStealingPool pool(4);
+    std::vector<std::atomic<int>> runs(1000);
+    pool.Run(runs.size(), [&](size_t i) {
+        // Uneven tasks make idle workers steal
+        if (i % 4 == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        ++runs[i];
+    });
+    for (const auto& count : runs) {
+        ASSERT_EQ(count, 1);
+    }
+}
+
+TEST(Batch, RunsManifest) {
+    TempDirectory directory;
+    const std::string& base = directory.Path();
+    std::ofstream(base + "/sum.bin") << CompileFromFile("../cpu/test_programs/sum.txt");
+    std::ofstream(base + "/fib.bin") << CompileFromFile("../cpu/test_programs/fib.txt");
+    std::stringstream manifest;
+    manifest << "# program input output\n\n";
+    const size_t JOBS = 40;
+    for (size_t i = 0; i < JOBS; ++i) {
+        std::string name = base + "/" + std::to_string(i);
+        std::ofstream(name + ".in") << (i % 2 ? i : i % 12) << "\n";
+        manifest << base << (i % 2 ? "/sum.bin " : "/fib.bin ") << name << ".in " << name << ".out\n";
+    }
+    auto jobs = Cpu::ReadManifest(manifest);
+    ASSERT_EQ(jobs.size(), JOBS);
+
+    for (auto engine : ALL_ENGINES) {
+        Cpu::WorkStealingPool pool(3);
+        Cpu::BatchStats stats = Cpu::RunBatch(jobs, engine, &pool);
+        ASSERT_EQ(stats.jobs, JOBS);
+        ASSERT_EQ(stats.failed, 0u);
+        size_t fib[12] = {1, 1};
+        for (size_t i = 2; i < 12; ++i) {
+            fib[i] = fib[i - 1] + fib[i - 2];
+        }
+        for (size_t i = 0; i < JOBS; ++i) {
+            std::ifstream out(base + "/" + std::to_string(i) + ".out");
+            size_t result = 0;
+            ASSERT_TRUE(out >> result);
+            ASSERT_EQ(result, i % 2 ? i * (i + 1) / 2 : fib[i % 12]);
+        }
+    }
+
+    // Missing, damaged and truncated programs fail their jobs only
+    jobs.push_back({base + "/missing.bin", base + "/0.in", base + "/missing.out"});
+    std::ofstream(base + "/garbage.bin") << std::string(100, 'x');
+    jobs.push_back({base + "/garbage.bin", base + "/0.in", base + "/garbage.out"});
+    std::string sum = CompileFromFile("../cpu/test_programs/sum.txt");
+    std::ofstream(base + "/truncated.bin") << sum.substr(0, sum.size() - 1);
+    jobs.push_back({base + "/truncated.bin", base + "/0.in", base + "/truncated.out"});
+    jobs.push_back({base, base + "/0.in", base + "/directory.out"});
+    Cpu::WorkStealingPool pool(2);
+    Cpu::BatchStats stats = Cpu::RunBatch(jobs, Cpu::Engine::SWITCH, &pool);
+    ASSERT_EQ(stats.jobs, JOBS + 4);
+    ASSERT_EQ(stats.failed, 4u);
+}
+
+TEST(Interactive, StopsForInput) {
+    auto program = CompileText(
+        "in\n"
+        "in\n"
+        "add\n"
+        "out\n"
+        "in\n"
+        "out\n"
+    );
+    int in[2];
+    int out[2];
+    ASSERT_EQ(pipe(in), 0);
+    ASSERT_EQ(pipe(out), 0);
+    Cpu::BufferCommandsReader reader(program.data());
+    Cpu::NonBlockingIo io(in[0], out[1]);
+    Cpu::Cpu cpu(reader, Cpu::Memory(), &io);
+    // Half a number is not input yet
+    ASSERT_EQ(write(in[1], "1", 1), 1);
+    uint32_t position = cpu.Run(Cpu::Engine::DECODED);
+    ASSERT_TRUE(cpu.NeedsInput());
+    ASSERT_EQ(position, 0u);
+    ASSERT_EQ(write(in[1], "5 2\n", 4), 4);
+    position = cpu.Run(Cpu::Engine::DECODED, position);
+    ASSERT_TRUE(cpu.NeedsInput());
+    char output[16] = {};
+    ASSERT_EQ(read(out[0], output, sizeof(output)), 3);
+    ASSERT_STREQ(output, "17\n");
+    // The end of input reads as 0, like with streams
+    close(in[1]);
+    ASSERT_EQ(cpu.Run(Cpu::Engine::DECODED, position), Cpu::NO_INDEX);
+    ASSERT_FALSE(cpu.NeedsInput());
+    ASSERT_EQ(read(out[0], output, sizeof(output)), 2);
+    ASSERT_EQ(std::string(output, 2), "0\n");
+    close(in[0]);
+    close(out[0]);
+    close(out[1]);
+}
+
+TEST(Interactive, LoopServesManyPrograms) {
+    auto program = CompileText(
+        "in\n"
+        "in\n"
+        "mul\n"
+        "out\n"
+        "in\n"
+        "push 1\n"
+        "add\n"
+        "out\n"
+    );
+    const size_t PROGRAMS = 1000;
+    std::vector<int> ends(PROGRAMS);
+    Cpu::InteractiveLoop loop(program.data());
+    for (size_t i = 0; i < PROGRAMS; ++i) {
+        int pair[2];
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+        ends[i] = pair[0];
+        loop.Add(pair[1], pair[1]);
+    }
+    // Input trickles in from another thread, in pieces that split numbers
+    std::thread feeder([&] {
+        for (const char* piece : {"1", "0 ", "", "4", "1\n"}) {
+            for (size_t i = PROGRAMS; i-- > 0;) {
+                std::string text = piece;
+                if (text == "") {
+                    text = std::to_string(i) + " ";
+                }
+                ASSERT_EQ(write(ends[i], text.data(), text.size()), ssize_t(text.size()));
+            }
+        }
+    });
+    ASSERT_EQ(loop.Run(), 0u);
+    feeder.join();
+    for (size_t i = 0; i < PROGRAMS; ++i) {
+        char output[64] = {};
+        ASSERT_GT(read(ends[i], output, sizeof(output)), 0);
+        ASSERT_EQ(std::string(output), std::to_string(10 * i) + "\n42\n");
+        close(ends[i]);
+    }
+}
+
+// Counts RAX up to 100: 2 + 100 * 7 + 1 commands
+const char* COUNTING_LOOP =
+    "push 0\n"
+    "pop RAX\n"
+    ":loop\n"
+    "push RAX\n"
+    "push 1\n"
+    "add\n"
+    "pop RAX\n"
+    "push 100\n"
+    "push RAX\n"
+    "ja loop\n"
+    "hlt\n";
+
+TEST(Scheduler, RunForCountsCommands) {
+    auto program = CompileText(COUNTING_LOOP, false);
+    Cpu::BufferCommandsReader reader(program.data());
+    Cpu::Cpu whole(reader);
+    ASSERT_EQ(whole.RunFor(Cpu::Scheduler<>::UNLIMITED), Cpu::NO_INDEX);
+    ASSERT_FALSE(whole.OutOfBudget());
+    ASSERT_EQ(whole.Executed(), 703u);
+    // The budget is checked on jumps, which come every 7 commands
+    Cpu::Cpu sliced(reader);
+    uint32_t position = 0;
+    size_t slices = 0;
+    for (; position != Cpu::NO_INDEX; ++slices) {
+        uint64_t executed = sliced.Executed();
+        position = sliced.RunFor(10, position);
+        ASSERT_EQ(sliced.OutOfBudget(), position != Cpu::NO_INDEX);
+        if (position != Cpu::NO_INDEX) {
+            ASSERT_GE(sliced.Executed() - executed, 10u);
+            ASSERT_LT(sliced.Executed() - executed, 17u);
+        }
+    }
+    ASSERT_EQ(sliced.Executed(), 703u);
+    ASSERT_EQ(slices, 50u);
+}
+
+TEST(Scheduler, StopsRunawayPrograms) {
+    auto counting = CompileText(COUNTING_LOOP, false);
+    auto runaway = CompileText(":forever\njmp forever\n", false);
+    Cpu::BufferCommandsReader counting_reader(counting.data());
+    Cpu::BufferCommandsReader runaway_reader(runaway.data());
+    for (auto policy : {Cpu::SchedulePolicy::ROUND_ROBIN, Cpu::SchedulePolicy::PRIORITY}) {
+        std::vector<std::unique_ptr<Cpu::Cpu>> cpus;
+        Cpu::Scheduler<> scheduler(50, policy);
+        for (int i = 0; i < 4; ++i) {
+            cpus.emplace_back(new Cpu::Cpu(i == 0 ? runaway_reader : counting_reader));
+            // The runaway program comes first and has the highest priority
+            scheduler.Add(cpus.back().get(), i == 0 ? 5000 : Cpu::Scheduler<>::UNLIMITED, i == 0 ? 1 : 0);
+        }
+        std::vector<size_t> stopped;
+        scheduler.Run([&](size_t task) {
+            stopped.push_back(task);
+        });
+        ASSERT_EQ(scheduler.Stats(0).state, Cpu::TaskStats::OUT_OF_BUDGET);
+        ASSERT_EQ(scheduler.Stats(0).commands, 5000u);
+        ASSERT_EQ(scheduler.Stats(0).slices, 100u);
+        for (size_t i = 1; i < 4; ++i) {
+            ASSERT_EQ(scheduler.Stats(i).state, Cpu::TaskStats::HALTED);
+            ASSERT_EQ(scheduler.Stats(i).commands, 703u);
+            ASSERT_GE(scheduler.Stats(i).seconds, 0);
+        }
+        // Shared in turn, the short programs end first; by priority the
+        // runaway one takes the thread until its budget is spent
+        std::vector<size_t> order = {1, 2, 3, 0};
+        if (policy == Cpu::SchedulePolicy::PRIORITY) {
+            order = {0, 1, 2, 3};
+        }
+        ASSERT_EQ(stopped, order);
+    }
+}
+
+TEST(Snapshot, ResumesWhereItStopped) {
+    // Fills a table in memory, then sums it up for each number read
+    std::stringstream source(
+        "push 0\n"
+        "pop RAX\n"
+        ":fill\n"
+        "push RAX\n"
+        "push RAX\n"
+        "mul\n"
+        "pop [RAX+100000]\n"
+        "push RAX\n"
+        "push 1\n"
+        "add\n"
+        "pop RAX\n"
+        "push RAX\n"
+        "push 5000\n"
+        "jne fill\n"
+        "push -1\n"
+        ":ready\n"
+        "in\n"
+        "pop RBX\n"
+        "push [RBX+100000]\n"
+        "add\n"
+        "out\n"
+        "hlt\n"
+    );
+    Cpu::CompileOptions options;
+    options.symbols = true;
+    auto program = Cpu::Compile(source, options);
+    uint32_t ready = Cpu::ProgramImage(program.data()).FindSymbol("ready");
+    ASSERT_NE(ready, Cpu::NO_INDEX);
+
+    char filename[] = "/tmp/cpu_snapshot_XXXXXX";
+    close(mkstemp(filename));
+    {
+        Cpu::BufferCommandsReader reader(program.data());
+        Cpu::BasicCpu<Cpu::CpuStack, Cpu::Breakpoint> cpu(reader, Cpu::Memory(), nullptr);
+        cpu.GetMonitor().Set(ready);
+        ASSERT_EQ(cpu.Run(Cpu::Engine::DECODED), ready);
+        cpu.SaveSnapshot(filename, ready);
+    }
+    for (auto engine : ALL_ENGINES) {
+        Cpu::BufferCommandsReader reader(program.data());
+        Cpu::Cpu cpu(reader);
+        uint32_t position = cpu.LoadSnapshot(filename);
+        ASSERT_EQ(position, ready);
+        std::stringstream output_buffer;
+        std::stringstream input_buffer("1000\n");
+        std::streambuf* old_input = std::cin.rdbuf(input_buffer.rdbuf());
+        std::streambuf* old_output = std::cout.rdbuf(output_buffer.rdbuf());
+        cpu.Run(engine, position);
+        std::cin.rdbuf(old_input);
+        std::cout.rdbuf(old_output);
+        ASSERT_EQ(output_buffer.str(), std::to_string(1000 * 1000 - 1) + "\n");
+    }
+    unlink(filename);
+}
+
+TEST(Snapshot, KeepsFlatMemory) {
+    auto program = CompileText("push 7\npop [3]\n:end\npush [3]\nout\nhlt\n");
+    char filename[] = "/tmp/cpu_snapshot_XXXXXX";
+    close(mkstemp(filename));
+    {
+        Cpu::BufferCommandsReader reader(program.data());
+        Cpu::BasicCpu<Cpu::CpuStack, Cpu::Breakpoint> cpu(reader, Cpu::Memory::Flat(10));
+        cpu.GetMonitor().Set(2);
+        ASSERT_EQ(cpu.Run(Cpu::Engine::DECODED), 2u);
+        cpu.SaveSnapshot(filename, 2);
+    }
+    Cpu::BufferCommandsReader reader(program.data());
+    Cpu::Cpu cpu(reader);
+    ASSERT_EQ(cpu.LoadSnapshot(filename), 2u);
+    ASSERT_EQ(RunCpu(cpu, "", Cpu::Engine::JIT), "7\n");
+    unlink(filename);
+}
+
+TEST(Snapshot, RejectsPagesOutOfTheAddressSpace) {
+    auto program = CompileText("push 7\npop [5000]\n:end\npush [5000]\nout\nhlt\n");
+    char filename[] = "/tmp/cpu_snapshot_XXXXXX";
+    close(mkstemp(filename));
+    {
+        Cpu::BufferCommandsReader reader(program.data());
+        Cpu::BasicCpu<Cpu::CpuStack, Cpu::Breakpoint> cpu(reader, Cpu::Memory(), nullptr);
+        cpu.GetMonitor().Set(2);
+        ASSERT_EQ(cpu.Run(Cpu::Engine::DECODED), 2u);
+        cpu.SaveSnapshot(filename, 2);
+    }
+    std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+    Cpu::SnapshotHeader header;
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    ASSERT_EQ(header.page_count, 1u);
+    size_t numbers_offset = sizeof(header) + Cpu::REGISTER_COUNT * sizeof(double) +
+                            Cpu::INT_REGISTER_COUNT * sizeof(int64_t) + header.stack_size * sizeof(double) +
+                            header.call_depth * sizeof(uint32_t);
+    file.seekp(numbers_offset);
+    uint64_t number = Cpu::Memory::PAGE_COUNT;
+    file.write(reinterpret_cast<const char*>(&number), sizeof(number));
+    file.close();
+
+    Cpu::BufferCommandsReader reader(program.data());
+    Cpu::Cpu cpu(reader);
+    ASSERT_EXIT(cpu.LoadSnapshot(filename), ::testing::ExitedWithCode(1), "out of the address space");
+
+    // A limit too small for the page tables
+    std::fstream limited(filename, std::ios::in | std::ios::out | std::ios::binary);
+    limited.seekp(numbers_offset);
+    number = 0;
+    limited.write(reinterpret_cast<const char*>(&number), sizeof(number));
+    header.memory_limit = 1;
+    limited.seekp(0);
+    limited.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    limited.close();
+    ASSERT_EXIT(cpu.LoadSnapshot(filename), ::testing::ExitedWithCode(1), "memory limit");
+    unlink(filename);
+}
+
+TEST(Snapshot, RejectsPositionsOutOfTheProgram) {
+    // Stops inside f, with a return position on the call stack
+    auto program = CompileText("call f\nhlt\n:f\npush 1\nout\nreturn\n", false);
+    char filename[] = "/tmp/cpu_snapshot_XXXXXX";
+    close(mkstemp(filename));
+    {
+        Cpu::BufferCommandsReader reader(program.data());
+        Cpu::BasicCpu<Cpu::CpuStack, Cpu::Breakpoint> cpu(reader, Cpu::Memory(), nullptr);
+        cpu.GetMonitor().Set(3);
+        ASSERT_EQ(cpu.Run(Cpu::Engine::DECODED), 3u);
+        cpu.SaveSnapshot(filename, 3);
+    }
+    std::ifstream in(filename, std::ios::binary);
+    std::stringstream saved;
+    saved << in.rdbuf();
+    Cpu::SnapshotHeader header;
+    memcpy(&header, saved.str().data(), sizeof(header));
+    ASSERT_EQ(header.call_depth, 1u);
+    size_t calls_offset = sizeof(header) + Cpu::REGISTER_COUNT * sizeof(double) +
+                          Cpu::INT_REGISTER_COUNT * sizeof(int64_t) + header.stack_size * sizeof(double);
+    uint32_t past_end = Cpu::ProgramImage(program.data()).Size();
+    for (size_t offset : {offsetof(Cpu::SnapshotHeader, position), calls_offset}) {
+        std::string damaged = saved.str();
+        memcpy(&damaged[offset], &past_end, sizeof(past_end));
+        std::ofstream(filename, std::ios::binary) << damaged;
+        Cpu::BufferCommandsReader reader(program.data());
+        Cpu::Cpu cpu(reader);
+        ASSERT_EXIT(cpu.LoadSnapshot(filename), ::testing::ExitedWithCode(1), "is not a command");
+    }
+    unlink(filename);
+}
+
+Cpu::Verification VerifyText(const std::string& program) {
+    std::string compiled = CompileText(program);
+    return Cpu::Verify(Cpu::DecodedProgram(compiled.data()));
+}
+
+TEST(Verifier, FindsMaxStack) {
+    auto solver = CompileFromFile("../cpu/test_programs/square_solver.txt");
+    Cpu::Verification verification = Cpu::Verify(Cpu::DecodedProgram(solver.data()));
+    ASSERT_TRUE(verification.verified) << verification.error;
+    ASSERT_EQ(verification.max_stack, 4u);
+
+    // Both calls of double return to both call sites
+    verification = VerifyText(
+        "push 4\n"
+        "call double\n"
+        "push 1\n"
+        "call double\n"
+        "add\n"
+        "out\n"
+        "hlt\n"
+        ":double\n"
+        "dup\n"
+        "add\n"
+        "return\n"
+    );
+    ASSERT_TRUE(verification.verified) << verification.error;
+    ASSERT_EQ(verification.max_stack, 3u);
+
+    // A function that halts still uses the stack of its caller
+    verification = VerifyText(
+        "push 1\n"
+        "call f\n"
+        "hlt\n"
+        ":f\n"
+        "push 2\n"
+        "push 3\n"
+        "push 4\n"
+        "push 5\n"
+        "out\n"
+        "out\n"
+        "out\n"
+        "out\n"
+        "out\n"
+        "hlt\n"
+    );
+    ASSERT_TRUE(verification.verified) << verification.error;
+    ASSERT_EQ(verification.max_stack, 5u);
+}
+
+TEST(Verifier, RejectsUnsafePrograms) {
+    Cpu::Verification verification = VerifyText("in\nadd\nhlt\n");
+    ASSERT_FALSE(verification.verified);
+    ASSERT_EQ(verification.index, 1u);
+    ASSERT_EQ(verification.error, "ADD may underflow the stack");
+
+    // Underflows in a function that never returns
+    verification = VerifyText("call f\nhlt\n:f\npop\npop\npop\nhlt\n");
+    ASSERT_FALSE(verification.verified);
+    ASSERT_EQ(verification.index, 0u);
+    ASSERT_EQ(verification.error, "CALL may underflow the stack");
+
+    // Underflows only on the second time around the loop
+    verification = VerifyText("push 1\n:again\npop\npush RAX\npush 0\nje again\nhlt\n");
+    ASSERT_FALSE(verification.verified);
+    ASSERT_EQ(verification.error, "POP may underflow the stack");
+
+    verification = VerifyText(":again\npush 1\njmp again\n");
+    ASSERT_FALSE(verification.verified);
+    ASSERT_EQ(verification.error, "the stack depth is not bounded");
+
+    auto fib_call = CompileFromFile("../cpu/test_programs/fib_call.txt");
+    verification = Cpu::Verify(Cpu::DecodedProgram(fib_call.data()));
+    ASSERT_FALSE(verification.verified);
+    ASSERT_EQ(verification.error, "the stack depth is not bounded");
+
+    auto fib = CompileFromFile("../cpu/test_programs/fib.txt");
+    verification = Cpu::Verify(Cpu::DecodedProgram(fib.data()));
+    ASSERT_FALSE(verification.verified);
+    ASSERT_EQ(verification.error, "ret jumps to a computed position");
+
+    // Points the jump past the end
+    std::string program = CompileText("jmp end\n:end\nhlt\n", false);
+    Cpu::ProgramImage image(program.data());
+    size_t offset = reinterpret_cast<const char*>(&image.Code()[0].target) - program.data();
+    uint32_t target = 7;
+    memcpy(&program[offset], &target, sizeof(target));
+    verification = Cpu::Verify(Cpu::DecodedProgram(program.data()));
+    ASSERT_FALSE(verification.verified);
+    ASSERT_EQ(verification.error, "jump target 7 is not a command");
+}
+
+TEST(Verifier, VerifiedProgramsRunUnchecked) {
+    auto solver = CompileFromFile("../cpu/test_programs/square_solver.txt");
+    Cpu::Verification verification = Cpu::Verify(Cpu::DecodedProgram(solver.data()));
+    ASSERT_TRUE(verification.verified);
+    for (const char* input : {"1\n-4\n3\n", "1\n6\n9\n", "0\n2\n10\n", "0\n0\n0\n"}) {
+        for (auto engine : ALL_ENGINES) {
+            Cpu::BufferCommandsReader checked_reader(solver.data());
+            Cpu::BufferCommandsReader reader(solver.data());
+            Cpu::VerifiedCpu cpu(reader);
+            cpu.ReserveStack(verification.max_stack);
+            ASSERT_EQ(RunCpu(cpu, input, engine), RunProgram(checked_reader, input, engine));
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
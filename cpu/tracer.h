@@ -0,0 +1,176 @@
+#pragma once
+
+#include "parser.h"
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <err.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace Cpu {
+    // Set from the signal handler installed by DumpTraceOnSignal
+    std::atomic<bool>& TraceDumpRequested() {
+        static std::atomic<bool> requested(false);
+        return requested;
+    }
+
+    void RequestTraceDump(int signal) {
+        UNUSED(signal);
+        TraceDumpRequested().store(true, std::memory_order_relaxed);
+    }
+
+    // Makes every tracer dump its trace on the next command after the signal.
+    // The handler only raises a flag: dumping from inside it would not be
+    // async-signal-safe.
+    void DumpTraceOnSignal(int signal = SIGUSR1) {
+        struct sigaction action = {};
+        action.sa_handler = &RequestTraceDump;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        if (sigaction(signal, &action, nullptr) < 0) {
+            err(1, "Failed to install the trace signal handler");
+        }
+    }
+
+    // Monitor for the decoded engine keeping the last CAPACITY commands run,
+    // with the top of the operand stack and all registers before each, in a
+    // fixed ring buffer. The engine is its only writer and publishes every
+    // record by a release store of the head, so Snapshot can read the ring
+    // from any thread without locks.
+    template <size_t CAPACITY = 4096>
+    class BasicTracer {
+        static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "Capacity must be a power of two");
+
+    public:
+        struct Record {
+            uint32_t index;
+            Command command;
+            bool has_top;
+            double top;
+            double regs[REGISTER_COUNT];
+            int64_t iregs[INT_REGISTER_COUNT];
+        };
+
+        BasicTracer() : head_(0), code_(nullptr), fd_(-1), dump_on_halt_(false), records_(CAPACITY) {
+        }
+
+        // Where Dump writes when requested by a signal and, if dump_on_halt is
+        // set, on HLT. Without an output the trace is only kept.
+        void SetOutput(int fd, bool dump_on_halt) {
+            fd_ = fd;
+            dump_on_halt_ = dump_on_halt;
+        }
+
+        void Start(const DecodedProgram& program) {
+            code_ = program.Code();
+        }
+
+        template <class Stack>
+        bool Step(uint32_t index, const Stack& stack, const double* regs, const int64_t* iregs) {
+            if (TraceDumpRequested().load(std::memory_order_relaxed) && fd_ >= 0 &&
+                TraceDumpRequested().exchange(false)) {
+                Dump(fd_);
+            }
+            uint64_t head = head_.load(std::memory_order_relaxed);
+            Record& record = records_[head & (CAPACITY - 1)];
+            record.index = index;
+            record.command = code_[index].command;
+            const double* top = stack.Top();
+            record.has_top = top != nullptr;
+            record.top = top ? *top : 0;
+            for (size_t i = 0; i < REGISTER_COUNT; ++i) {
+                record.regs[i] = regs[i];
+            }
+            for (size_t i = 0; i < INT_REGISTER_COUNT; ++i) {
+                record.iregs[i] = iregs[i];
+            }
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        void Jump(uint32_t from, uint32_t to) {
+            UNUSED(from);
+            UNUSED(to);
+        }
+
+        void Stop(bool halted) {
+            if (halted && dump_on_halt_ && fd_ >= 0) {
+                Dump(fd_);
+            }
+        }
+
+        // Commands run so far
+        uint64_t Total() const {
+            return head_.load(std::memory_order_acquire);
+        }
+
+        // The kept records, oldest first. Records the engine may have overwritten
+        // while they were copied are dropped, which with a full ring is always
+        // the oldest one.
+        std::vector<Record> Snapshot() const {
+            uint64_t end = head_.load(std::memory_order_acquire);
+            uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+            std::vector<Record> records;
+            records.reserve(end - begin);
+            for (uint64_t i = begin; i < end; ++i) {
+                records.push_back(records_[i & (CAPACITY - 1)]);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // The engine may be writing record head already, over head - CAPACITY
+            uint64_t head = head_.load(std::memory_order_relaxed);
+            if (head + 1 > begin + CAPACITY) {
+                size_t torn = std::min<uint64_t>(head + 1 - begin - CAPACITY, records.size());
+                records.erase(records.begin(), records.begin() + torn);
+            }
+            return records;
+        }
+
+        // Writes the snapshot as text, one command per line
+        void Dump(int fd) const {
+            std::vector<Record> records = Snapshot();
+            std::string text = "trace: last " + std::to_string(records.size()) + " of " +
+                               std::to_string(Total()) + " commands\n";
+            char line[256];
+            for (const Record& record : records) {
+                int length = snprintf(line, sizeof(line), "%8u %-16s", record.index, CommandName(record.command));
+                text.append(line, length);
+                if (record.has_top) {
+                    length = snprintf(line, sizeof(line), " top=%-12g", record.top);
+                } else {
+                    length = snprintf(line, sizeof(line), " top=%-12s", "-");
+                }
+                text.append(line, length);
+#define REGISTER(NAME, NUM)                                                             \
+                length = snprintf(line, sizeof(line), " " #NAME "=%-12g", record.regs[NUM]); \
+                text.append(line, length);
+#define INT_REGISTER(NAME, NUM)                                                         \
+                length = snprintf(line, sizeof(line), " " #NAME "=%-12" PRId64, record.iregs[NUM]); \
+                text.append(line, length);
+#include "registers.h"
+#undef INT_REGISTER
+#undef REGISTER
+                text.push_back('\n');
+            }
+            for (size_t written = 0; written < text.size();) {
+                ssize_t count = write(fd, text.data() + written, text.size() - written);
+                if (count <= 0) {
+                    break;
+                }
+                written += count;
+            }
+        }
+
+    private:
+        std::atomic<uint64_t> head_;
+        const Instruction* code_;
+        int fd_;
+        bool dump_on_halt_;
+        std::vector<Record> records_;
+    };
+
+    using Tracer = BasicTracer<>;
+} // namespace Cpu
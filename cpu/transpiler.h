@@ -0,0 +1,492 @@
+#pragma once
+
+#include "parser.h"
+#include "verifier.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Translates a compiled program into a standalone C++ program with a label
+// per command and direct gotos between them. The result includes parser.h
+// for Memory, BufferedIo and the integer helpers, so it reads input, prints
+// output and faults exactly like runner does, and is built with the cpu
+// directory on the include path.
+//
+// Registers become locals. When the operand stack depth at every command is
+// known from the code alone, the stack cells become locals too: a command
+// reached at several depths is written out once for each of them. Programs
+// where it is not, because of RET, CALL or loops that grow the stack, keep
+// their operands on a CpuStack.
+
+namespace Cpu {
+    class Transpiler {
+    public:
+        explicit Transpiler(const DecodedProgram& program) : program_(program), code_(program.Code()) {
+        }
+
+        std::string Translate() {
+            bool fixed = FindDepths();
+            if (!fixed) {
+                states_.clear();
+                for (uint32_t i = 0; i < program_.Size(); ++i) {
+                    states_.emplace_back(i, 0);
+                }
+            }
+            fixed_ = fixed;
+
+            std::vector<std::string> blocks;
+            for (size_t i = 0; i < states_.size(); ++i) {
+                blocks.push_back(Emit(i));
+            }
+            bool table = computed_jumps_;
+
+            std::string text =
+                "// Generated by cpu2cpp. Build with the cpu directory on the include path.\n"
+                "#include \"parser.h\"\n"
+                "\n"
+                "int main() {\n"
+                "    Cpu::BufferedIo io;\n"
+                "    Cpu::Memory mem;\n";
+            if (uses_calls_) {
+                text += "    Cpu::CallStack calls;\n";
+            }
+            if (!fixed_) {
+                text += "    Cpu::CpuStack<double> stack;\n";
+            }
+            std::sort(locals_.begin(), locals_.end());
+            for (const std::string& local : locals_) {
+                text += "    " + local + " = 0;\n";
+            }
+            text += "    try {\n";
+            if (table) {
+                text += "        static void* const labels[] = {\n";
+                for (uint32_t i = 0; i < program_.Size(); ++i) {
+                    text += "            &&" + Label(i, 0) + ",\n";
+                }
+                text += "        };\n";
+            }
+            for (size_t i = 0; i < states_.size(); ++i) {
+                std::string label = Label(states_[i].first, states_[i].second);
+                if (table || jumped_to_.count(label)) {
+                    text += label + ":\n";
+                }
+                text += blocks[i];
+            }
+            text +=
+                "        io.Flush();\n"
+                "        errx(1, \"Ran past the end of the program\");\n"
+                "    } catch (const Cpu::MemoryFault& fault) {\n"
+                "        io.Flush();\n"
+                "        errx(1, \"Memory fault: %s\", fault.what());\n"
+                "    }\n"
+                "halt:\n"
+                "    return 0;\n"
+                "}\n";
+            return text;
+        }
+
+    private:
+        // Most commands and depths written out before giving up on locals
+        static const size_t MAX_STATES_PER_COMMAND = 8;
+        static const int64_t MAX_FIXED_DEPTH = 256;
+
+        // Walks every path from the first command with its stack depth. Fails
+        // on anything that makes the depth depend on more than the command.
+        bool FindDepths() {
+            std::set<std::pair<uint32_t, int64_t>> seen;
+            std::vector<std::pair<uint32_t, int64_t>> queue = {{0, 0}};
+            uint32_t size = program_.Size();
+            if (size == 0) {
+                return false;
+            }
+            while (!queue.empty()) {
+                auto state = queue.back();
+                queue.pop_back();
+                if (!seen.insert(state).second) {
+                    continue;
+                }
+                if (seen.size() > MAX_STATES_PER_COMMAND * size) {
+                    return false;
+                }
+                const Instruction& instruction = code_[state.first];
+                size_t pops = 0;
+                size_t pushes = 0;
+                if (!StackEffect(instruction.command, &pops, &pushes) || instruction.command == RET ||
+                    instruction.command == CALL || instruction.command == RETURN ||
+                    state.second < int64_t(pops)) {
+                    return false;
+                }
+                int64_t depth = state.second - int64_t(pops) + int64_t(pushes);
+                if (depth > MAX_FIXED_DEPTH) {
+                    return false;
+                }
+                if (instruction.command == HLT) {
+                    continue;
+                }
+                if (IsJumpCommand(instruction.command)) {
+                    queue.emplace_back(instruction.target, depth);
+                }
+                if (instruction.command != JMP && instruction.command != JEXEC) {
+                    if (state.first + 1 == size) {
+                        return false;
+                    }
+                    queue.emplace_back(state.first + 1, depth);
+                }
+            }
+            states_.assign(seen.begin(), seen.end());
+            return true;
+        }
+
+        std::string Label(uint32_t index, int64_t depth) const {
+            std::string label = "L" + std::to_string(index);
+            if (fixed_) {
+                label += "_" + std::to_string(depth);
+            }
+            return label;
+        }
+
+        static std::string Number(double value) {
+            if (std::isnan(value)) {
+                return "NAN";
+            }
+            if (std::isinf(value)) {
+                return value > 0 ? "INFINITY" : "-INFINITY";
+            }
+            char text[64];
+            snprintf(text, sizeof(text), "%.17g", value);
+            std::string number = text;
+            if (number.find_first_of(".e") == std::string::npos) {
+                number += ".0";
+            }
+            return number;
+        }
+
+        static std::string Integer(int64_t value) {
+            if (value == INT64_MIN) {
+                return "INT64_MIN";
+            }
+            return "INT64_C(" + std::to_string(value) + ")";
+        }
+
+        void Declare(const std::string& local) {
+            if (std::find(locals_.begin(), locals_.end(), local) == locals_.end()) {
+                locals_.push_back(local);
+            }
+        }
+
+        std::string RegisterLocal(const char* name) {
+            Declare(std::string("double ") + name);
+            return name;
+        }
+
+        std::string IntRegisterLocal(const char* name) {
+            Declare(std::string("int64_t ") + name);
+            return name;
+        }
+
+        // Code of a command at the depth of its state, in a block of its own.
+        // Operands are named by pop and pushed by push, so the same code works
+        // with both stacks.
+        std::string Emit(size_t state) {
+            uint32_t index = states_[state].first;
+            int64_t depth = states_[state].second;
+            const Instruction& instruction = code_[index];
+            double arg = program_.Arg(instruction);
+            std::string code = "        {\n";
+            int temps = 0;
+            auto line = [&](const std::string& text) {
+                code += "            " + text + "\n";
+            };
+            auto pop = [&]() {
+                if (fixed_) {
+                    --depth;
+                    Declare("double s" + std::to_string(depth));
+                    return "s" + std::to_string(depth);
+                }
+                std::string temp = "t" + std::to_string(temps++);
+                line("double " + temp + " = 0;");
+                line("stack.Pop(&" + temp + ");");
+                return temp;
+            };
+            auto push = [&](const std::string& value) {
+                if (fixed_) {
+                    std::string cell = "s" + std::to_string(depth++);
+                    Declare("double " + cell);
+                    if (value != cell) {
+                        line(cell + " = " + value + ";");
+                    }
+                } else {
+                    line("stack.Push(" + value + ");");
+                }
+            };
+            auto jump = [&](uint32_t target) {
+                std::string label = Label(target, depth);
+                jumped_to_.insert(label);
+                return "goto " + label + ";";
+            };
+            auto binary = [&](const char* operation) {
+                std::string second = pop();
+                std::string first = pop();
+                push(first + " " + operation + " " + second);
+            };
+            auto compare_jump = [&](const char* condition) {
+                std::string second = pop();
+                std::string first = pop();
+                line("if (" + first + " " + condition + " " + second + ") " + jump(instruction.target));
+            };
+            auto compare_imm_jump = [&](const char* condition) {
+                std::string first = pop();
+                line("if (" + first + " " + condition + " " + Number(arg) + ") " + jump(instruction.target));
+            };
+            auto vector = [&](const char* function, int operands) {
+                std::vector<std::string> args(operands);
+                for (int i = operands - 1; i >= 0; --i) {
+                    args[i] = pop();
+                }
+                std::string call = std::string("Cpu::") + function + "(&mem";
+                for (const std::string& operand : args) {
+                    call += ", " + operand;
+                }
+                return call + ")";
+            };
+
+            line("// " + std::string(CommandName(instruction.command)));
+            switch (instruction.command) {
+                case HLT:
+                    line("goto halt;");
+                    return code + "        }\n";
+                case PUSH:
+                    push(Number(arg));
+                    break;
+                case POP:
+                    if (fixed_) {
+                        --depth;
+                    } else {
+                        line("stack.Pop(nullptr);");
+                    }
+                    break;
+                case DUP: {
+                    std::string value = pop();
+                    push(value);
+                    push(value);
+                    break;
+                }
+                case IN:
+                    push("io.In()");
+                    break;
+                case OUT:
+                    line("io.Out(" + pop() + ");");
+                    break;
+                case ADD:
+                    binary("+");
+                    break;
+                case MUL:
+                    binary("*");
+                    break;
+                case DIV:
+                    binary("/");
+                    break;
+                case SUB:
+                    binary("-");
+                    break;
+                case SQRT:
+                    push("sqrt(" + pop() + ")");
+                    break;
+                case ABS:
+                    push("fabs(" + pop() + ")");
+                    break;
+                case PUSH_MEM:
+                    push("mem.at(" + Number(arg) + ")");
+                    break;
+                case POP_MEM:
+                    line("mem.at(" + Number(arg) + ") = " + pop() + ";");
+                    break;
+#define REGISTER(REG, NUM)                                                                        \
+                case PUSH_##REG:                                                                  \
+                    push(RegisterLocal(#REG));                                                         \
+                    break;                                                                        \
+                case POP_##REG:                                                                   \
+                    line(RegisterLocal(#REG) + " = " + pop() + ";");                                   \
+                    break;                                                                        \
+                case PUSH_MEM_##REG:                                                              \
+                    push("mem.at(" + RegisterLocal(#REG) + ")");                                       \
+                    break;                                                                        \
+                case POP_MEM_##REG:                                                               \
+                    line("mem.at(" + RegisterLocal(#REG) + ") = " + pop() + ";");                      \
+                    break;                                                                        \
+                case PUSH_MEM_OFFSET_##REG:                                                       \
+                    push("mem.at(" + RegisterLocal(#REG) + " + " + Number(arg) + ")");                 \
+                    break;                                                                        \
+                case POP_MEM_OFFSET_##REG:                                                        \
+                    line("mem.at(" + Number(arg) + " + " + RegisterLocal(#REG) + ") = " + pop() + ";"); \
+                    break;                                                                        \
+                case STORE_##REG:                                                                 \
+                    line(RegisterLocal(#REG) + " = " + pop() + ";");                                   \
+                    push(#REG);                                                                   \
+                    break;
+
+#include "registers.h"
+#undef REGISTER
+                case JMP:
+                    line(jump(instruction.target));
+                    return code + "        }\n";
+                case JE:
+                    compare_jump("==");
+                    break;
+                case JNE:
+                    compare_jump("!=");
+                    break;
+                case JA:
+                    compare_jump(">");
+                    break;
+                case JEXEC:
+                    line(RegisterLocal("RDX") + " = " + Number(program_.PositionOf(index + 1)) + ";");
+                    line(jump(instruction.target));
+                    return code + "        }\n";
+                case RET:
+                    computed_jumps_ = true;
+                    line("if (!(RDX >= 0) || RDX >= " + std::to_string(program_.Size()) + ") {");
+                    line("    throw Cpu::NotACommand(RDX);");
+                    line("}");
+                    line("goto *labels[static_cast<uint32_t>(RDX)];");
+                    RegisterLocal("RDX");
+                    return code + "        }\n";
+                case CALL:
+                    uses_calls_ = true;
+                    line("calls.Push(" + std::to_string(index + 1) + ");");
+                    line(jump(instruction.target));
+                    return code + "        }\n";
+                case RETURN:
+                    uses_calls_ = true;
+                    computed_jumps_ = true;
+                    line("goto *labels[calls.Pop()];");
+                    return code + "        }\n";
+                case ADD_IMM:
+                    push(pop() + " + " + Number(arg));
+                    break;
+                case MUL_IMM:
+                    push(pop() + " * " + Number(arg));
+                    break;
+                case DIV_IMM:
+                    push(pop() + " / " + Number(arg));
+                    break;
+                case SUB_IMM:
+                    push(pop() + " - " + Number(arg));
+                    break;
+                case JE_IMM:
+                    compare_imm_jump("==");
+                    break;
+                case JNE_IMM:
+                    compare_imm_jump("!=");
+                    break;
+                case JA_IMM:
+                    compare_imm_jump(">");
+                    break;
+#define REGISTER(REG, NUM)
+#define INT_REGISTER(REG, NUM)                                                                    \
+                case IPUSH_##REG:                                                                 \
+                    push("static_cast<double>(" + IntRegisterLocal(#REG) + ")");                       \
+                    break;                                                                        \
+                case IPOP_##REG:                                                                  \
+                    line(IntRegisterLocal(#REG) + " = Cpu::DoubleToInt(" + pop() + ");");              \
+                    break;                                                                        \
+                case ISET_##REG:                                                                  \
+                    line(IntRegisterLocal(#REG) + " = " + Integer(DoubleToInt(arg)) + ";");            \
+                    break;                                                                        \
+                case IADD_IMM_##REG:                                                              \
+                    line(IntRegisterLocal(#REG) + " = Cpu::WrappingAdd(" #REG ", " +                   \
+                         Integer(DoubleToInt(arg)) + ");");                                       \
+                    break;                                                                        \
+                case IADD_##REG:                                                                  \
+                    line(IntRegisterLocal(#REG) + " = Cpu::WrappingAdd(" #REG ", Cpu::DoubleToInt(" +  \
+                         pop() + "));");                                                          \
+                    break;                                                                        \
+                case ISUB_##REG:                                                                  \
+                    line(IntRegisterLocal(#REG) + " = Cpu::WrappingSub(" #REG ", Cpu::DoubleToInt(" +  \
+                         pop() + "));");                                                          \
+                    break;                                                                        \
+                case IMUL_##REG:                                                                  \
+                    line(IntRegisterLocal(#REG) + " = Cpu::WrappingMul(" #REG ", Cpu::DoubleToInt(" +  \
+                         pop() + "));");                                                          \
+                    break;                                                                        \
+                case IJE_##REG:                                                                   \
+                    line("if (" + IntRegisterLocal(#REG) + " == " + Integer(DoubleToInt(arg)) + ") " + \
+                         jump(instruction.target));                                               \
+                    break;                                                                        \
+                case IJNE_##REG:                                                                  \
+                    line("if (" + IntRegisterLocal(#REG) + " != " + Integer(DoubleToInt(arg)) + ") " + \
+                         jump(instruction.target));                                               \
+                    break;                                                                        \
+                case IJA_##REG:                                                                   \
+                    line("if (" + IntRegisterLocal(#REG) + " > " + Integer(DoubleToInt(arg)) + ") " +  \
+                         jump(instruction.target));                                               \
+                    break;                                                                        \
+                case IJB_##REG:                                                                   \
+                    line("if (" + IntRegisterLocal(#REG) + " < " + Integer(DoubleToInt(arg)) + ") " +  \
+                         jump(instruction.target));                                               \
+                    break;                                                                        \
+                case PUSH_MEM_INT_##REG:                                                          \
+                    push("mem.AtIndex(" + IntRegisterLocal(#REG) + ")");                               \
+                    break;                                                                        \
+                case POP_MEM_INT_##REG:                                                           \
+                    line("mem.AtIndex(" + IntRegisterLocal(#REG) + ") = " + pop() + ";");              \
+                    break;                                                                        \
+                case PUSH_MEM_INT_OFFSET_##REG:                                                   \
+                    push("mem.AtIndex(Cpu::WrappingAdd(" + IntRegisterLocal(#REG) + ", " +             \
+                         Integer(DoubleToInt(arg)) + "))");                                       \
+                    break;                                                                        \
+                case POP_MEM_INT_OFFSET_##REG:                                                    \
+                    line("mem.AtIndex(Cpu::WrappingAdd(" + IntRegisterLocal(#REG) + ", " +             \
+                         Integer(DoubleToInt(arg)) + ")) = " + pop() + ";");                      \
+                    break;
+
+#include "registers.h"
+#undef INT_REGISTER
+#undef REGISTER
+                case VFILL:
+                    line(vector("VectorFill", 3) + ";");
+                    break;
+                case VADD:
+                    line(vector("VectorAdd", 4) + ";");
+                    break;
+                case VMUL:
+                    line(vector("VectorMul", 4) + ";");
+                    break;
+                case VAXPY:
+                    line(vector("VectorAxpy", 4) + ";");
+                    break;
+                case VDOT:
+                    push(vector("VectorDot", 3));
+                    break;
+                case VSUM:
+                    push(vector("VectorSum", 2));
+                    break;
+            }
+            // The next command comes right after this one only if it is not
+            // also reached at a lower depth
+            auto next = std::make_pair(index + 1, depth);
+            if (fixed_ && (state + 1 == states_.size() || states_[state + 1] != next)) {
+                line(jump(index + 1));
+            }
+            return code + "        }\n";
+        }
+
+        const DecodedProgram& program_;
+        const Instruction* code_;
+        bool fixed_ = false;
+        bool uses_calls_ = false;
+        bool computed_jumps_ = false;
+        // Commands with the depth they are reached at, in order
+        std::vector<std::pair<uint32_t, int64_t>> states_;
+        std::vector<std::string> locals_;
+        std::set<std::string> jumped_to_;
+    };
+
+    std::string Transpile(const DecodedProgram& program) {
+        return Transpiler(program).Translate();
+    }
+} // namespace Cpu
@@ -0,0 +1,274 @@
+#pragma once
+
+#include "memory.h"
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CPU_VECTOR_AVX2
+#endif
+
+// Kernels of the vector commands, which work on ranges of Memory.
+//
+// Sums are kept in four lanes over blocks of four cells, the lanes are added
+// as (0 + 1) + (2 + 3) and the cells past the last block go after them one by
+// one. The scalar kernels follow the same order and neither uses fused
+// multiply-add, so every kernel set gives bit for bit the same results.
+
+namespace Cpu {
+    struct VectorKernels {
+        const char* name;
+        // dst = x + y and dst = x * y, elementwise
+        void (*add)(double* dst, const double* x, const double* y, size_t count);
+        void (*mul)(double* dst, const double* x, const double* y, size_t count);
+        // y = y + a * x
+        void (*axpy)(double* y, double a, const double* x, size_t count);
+        double (*dot)(const double* x, const double* y, size_t count);
+        double (*sum)(const double* x, size_t count);
+        void (*fill)(double* dst, double value, size_t count);
+    };
+
+    void ScalarAdd(double* dst, const double* x, const double* y, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            dst[i] = x[i] + y[i];
+        }
+    }
+
+    void ScalarMul(double* dst, const double* x, const double* y, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            dst[i] = x[i] * y[i];
+        }
+    }
+
+    void ScalarAxpy(double* y, double a, const double* x, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            double product = a * x[i];
+            y[i] = y[i] + product;
+        }
+    }
+
+    double ScalarDot(const double* x, const double* y, size_t count) {
+        double lanes[4] = {0, 0, 0, 0};
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            for (size_t lane = 0; lane < 4; ++lane) {
+                double product = x[i + lane] * y[i + lane];
+                lanes[lane] = lanes[lane] + product;
+            }
+        }
+        double result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        for (; i < count; ++i) {
+            double product = x[i] * y[i];
+            result = result + product;
+        }
+        return result;
+    }
+
+    double ScalarSum(const double* x, size_t count) {
+        double lanes[4] = {0, 0, 0, 0};
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            for (size_t lane = 0; lane < 4; ++lane) {
+                lanes[lane] += x[i + lane];
+            }
+        }
+        double result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        for (; i < count; ++i) {
+            result += x[i];
+        }
+        return result;
+    }
+
+    void ScalarFill(double* dst, double value, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            dst[i] = value;
+        }
+    }
+
+    const VectorKernels SCALAR_KERNELS = {
+        "scalar", &ScalarAdd, &ScalarMul, &ScalarAxpy, &ScalarDot, &ScalarSum, &ScalarFill,
+    };
+
+#ifdef CPU_VECTOR_AVX2
+    __attribute__((target("avx2"))) void Avx2Add(double* dst, const double* x, const double* y, size_t count) {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        }
+        ScalarAdd(dst + i, x + i, y + i, count - i);
+    }
+
+    __attribute__((target("avx2"))) void Avx2Mul(double* dst, const double* x, const double* y, size_t count) {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        }
+        ScalarMul(dst + i, x + i, y + i, count - i);
+    }
+
+    __attribute__((target("avx2"))) void Avx2Axpy(double* y, double a, const double* x, size_t count) {
+        __m256d factor = _mm256_set1_pd(a);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m256d product = _mm256_mul_pd(factor, _mm256_loadu_pd(x + i));
+            _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), product));
+        }
+        ScalarAxpy(y + i, a, x + i, count - i);
+    }
+
+    __attribute__((target("avx2"))) double Avx2Lanes(__m256d lanes) {
+        double values[4];
+        _mm256_storeu_pd(values, lanes);
+        return (values[0] + values[1]) + (values[2] + values[3]);
+    }
+
+    __attribute__((target("avx2"))) double Avx2Dot(const double* x, const double* y, size_t count) {
+        __m256d lanes = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            lanes = _mm256_add_pd(lanes, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        }
+        double result = Avx2Lanes(lanes);
+        for (; i < count; ++i) {
+            double product = x[i] * y[i];
+            result = result + product;
+        }
+        return result;
+    }
+
+    __attribute__((target("avx2"))) double Avx2Sum(const double* x, size_t count) {
+        __m256d lanes = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            lanes = _mm256_add_pd(lanes, _mm256_loadu_pd(x + i));
+        }
+        double result = Avx2Lanes(lanes);
+        for (; i < count; ++i) {
+            result += x[i];
+        }
+        return result;
+    }
+
+    __attribute__((target("avx2"))) void Avx2Fill(double* dst, double value, size_t count) {
+        __m256d values = _mm256_set1_pd(value);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            _mm256_storeu_pd(dst + i, values);
+        }
+        ScalarFill(dst + i, value, count - i);
+    }
+
+    const VectorKernels AVX2_KERNELS = {
+        "avx2", &Avx2Add, &Avx2Mul, &Avx2Axpy, &Avx2Dot, &Avx2Sum, &Avx2Fill,
+    };
+#endif
+
+    // The best kernels the processor supports, chosen once by CPUID
+    const VectorKernels& Kernels() {
+        static const VectorKernels* const kernels = [] {
+#ifdef CPU_VECTOR_AVX2
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return &AVX2_KERNELS;
+            }
+#endif
+            return &SCALAR_KERNELS;
+        }();
+        return *kernels;
+    }
+
+    // Calls visit(cells, length) over the ranges of count cells starting at
+    // every address of starts, split where any of them stops being contiguous.
+    // All pages are allocated first, so a fault leaves memory unchanged.
+    template <size_t N, class Visit>
+    void ForEachSpan(Memory* memory, const size_t (&starts)[N], size_t count, Visit visit) {
+        for (int pass = 0; pass < 2; ++pass) {
+            for (size_t done = 0; done < count;) {
+                double* cells[N];
+                size_t length = count - done;
+                for (size_t i = 0; i < N; ++i) {
+                    if (starts[i] + done >= Memory::ADDRESS_SPACE) {
+                        throw MemoryFault("address " + std::to_string(starts[i] + done) +
+                                          " is out of the address space");
+                    }
+                    cells[i] = memory->Span(starts[i] + done, &length);
+                }
+                if (pass == 1) {
+                    visit(cells, length);
+                }
+                done += length;
+            }
+        }
+    }
+
+    // Number of cells a vector command works on; nothing for counts below one,
+    // and then the addresses are not checked either
+    size_t VectorCount(double count) {
+        return count >= 1 ? static_cast<size_t>(std::min(count, double(Memory::ADDRESS_SPACE))) : 0;
+    }
+
+    void VectorAdd(Memory* memory, double dst, double x, double y, double count) {
+        if (VectorCount(count) == 0) {
+            return;
+        }
+        const size_t starts[] = {Memory::Address(dst), Memory::Address(x), Memory::Address(y)};
+        ForEachSpan(memory, starts, VectorCount(count), [](double** cells, size_t length) {
+            Kernels().add(cells[0], cells[1], cells[2], length);
+        });
+    }
+
+    void VectorMul(Memory* memory, double dst, double x, double y, double count) {
+        if (VectorCount(count) == 0) {
+            return;
+        }
+        const size_t starts[] = {Memory::Address(dst), Memory::Address(x), Memory::Address(y)};
+        ForEachSpan(memory, starts, VectorCount(count), [](double** cells, size_t length) {
+            Kernels().mul(cells[0], cells[1], cells[2], length);
+        });
+    }
+
+    void VectorAxpy(Memory* memory, double y, double a, double x, double count) {
+        if (VectorCount(count) == 0) {
+            return;
+        }
+        const size_t starts[] = {Memory::Address(y), Memory::Address(x)};
+        ForEachSpan(memory, starts, VectorCount(count), [a](double** cells, size_t length) {
+            Kernels().axpy(cells[0], a, cells[1], length);
+        });
+    }
+
+    double VectorDot(Memory* memory, double x, double y, double count) {
+        if (VectorCount(count) == 0) {
+            return 0;
+        }
+        const size_t starts[] = {Memory::Address(x), Memory::Address(y)};
+        double result = 0;
+        ForEachSpan(memory, starts, VectorCount(count), [&result](double** cells, size_t length) {
+            result += Kernels().dot(cells[0], cells[1], length);
+        });
+        return result;
+    }
+
+    double VectorSum(Memory* memory, double x, double count) {
+        if (VectorCount(count) == 0) {
+            return 0;
+        }
+        const size_t starts[] = {Memory::Address(x)};
+        double result = 0;
+        ForEachSpan(memory, starts, VectorCount(count), [&result](double** cells, size_t length) {
+            result += Kernels().sum(cells[0], length);
+        });
+        return result;
+    }
+
+    void VectorFill(Memory* memory, double dst, double value, double count) {
+        if (VectorCount(count) == 0) {
+            return;
+        }
+        const size_t starts[] = {Memory::Address(dst)};
+        ForEachSpan(memory, starts, VectorCount(count), [value](double** cells, size_t length) {
+            Kernels().fill(cells[0], value, length);
+        });
+    }
+} // namespace Cpu
@@ -0,0 +1,372 @@
+#pragma once
+
+#include "parser.h"
+#include "../stack/fixed_stack.h"
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace Cpu {
+    // Operands a command pops and results it pushes. Returns false for
+    // commands the verifier does not know.
+    bool StackEffect(Command command, size_t* pops, size_t* pushes) {
+        switch (command) {
+            case HLT:
+            case JMP:
+            case JEXEC:
+            case RET:
+            case CALL:
+            case RETURN:
+                *pops = 0;
+                *pushes = 0;
+                return true;
+            case PUSH:
+            case IN:
+            case PUSH_MEM:
+                *pops = 0;
+                *pushes = 1;
+                return true;
+            case POP:
+            case OUT:
+            case POP_MEM:
+            case JE_IMM:
+            case JNE_IMM:
+            case JA_IMM:
+                *pops = 1;
+                *pushes = 0;
+                return true;
+            case DUP:
+                *pops = 1;
+                *pushes = 2;
+                return true;
+            case ADD:
+            case MUL:
+            case DIV:
+            case SUB:
+                *pops = 2;
+                *pushes = 1;
+                return true;
+            case SQRT:
+            case ABS:
+            case ADD_IMM:
+            case MUL_IMM:
+            case DIV_IMM:
+            case SUB_IMM:
+                *pops = 1;
+                *pushes = 1;
+                return true;
+            case JE:
+            case JNE:
+            case JA:
+                *pops = 2;
+                *pushes = 0;
+                return true;
+            case VFILL:
+                *pops = 3;
+                *pushes = 0;
+                return true;
+            case VADD:
+            case VMUL:
+            case VAXPY:
+                *pops = 4;
+                *pushes = 0;
+                return true;
+            case VDOT:
+                *pops = 3;
+                *pushes = 1;
+                return true;
+            case VSUM:
+                *pops = 2;
+                *pushes = 1;
+                return true;
+#define REGISTER(REG, NUM)              \
+            case PUSH_##REG:            \
+            case PUSH_MEM_##REG:        \
+            case PUSH_MEM_OFFSET_##REG: \
+                *pops = 0;              \
+                *pushes = 1;            \
+                return true;            \
+            case POP_##REG:             \
+            case POP_MEM_##REG:         \
+            case POP_MEM_OFFSET_##REG:  \
+                *pops = 1;              \
+                *pushes = 0;            \
+                return true;            \
+            case STORE_##REG:           \
+                *pops = 1;              \
+                *pushes = 1;            \
+                return true;
+
+#include "registers.h"
+#undef REGISTER
+#define REGISTER(REG, NUM)
+#define INT_REGISTER(REG, NUM)              \
+            case ISET_##REG:                \
+            case IADD_IMM_##REG:            \
+            case IJE_##REG:                 \
+            case IJNE_##REG:                \
+            case IJA_##REG:                 \
+            case IJB_##REG:                 \
+                *pops = 0;                  \
+                *pushes = 0;                \
+                return true;                \
+            case IPUSH_##REG:               \
+            case PUSH_MEM_INT_##REG:        \
+            case PUSH_MEM_INT_OFFSET_##REG: \
+                *pops = 0;                  \
+                *pushes = 1;                \
+                return true;                \
+            case IPOP_##REG:                \
+            case IADD_##REG:                \
+            case ISUB_##REG:                \
+            case IMUL_##REG:                \
+            case POP_MEM_INT_##REG:         \
+            case POP_MEM_INT_OFFSET_##REG:  \
+                *pops = 1;                  \
+                *pushes = 0;                \
+                return true;
+
+#include "registers.h"
+#undef INT_REGISTER
+#undef REGISTER
+            default:
+                return false;
+        }
+    }
+
+    struct Verification {
+        bool verified = false;
+        // The command the program failed verification at, if any
+        uint32_t index = NO_INDEX;
+        std::string error;
+        // Deepest the operand stack gets on any path
+        size_t max_stack = 0;
+    };
+
+    // What a function, the code run from a CALL target to its RETURN, does
+    // to the operand stack, relative to the depth it was called at
+    struct FunctionSummary {
+        bool returns = false;
+        // Cells below the call depth it pops
+        int64_t need = 0;
+        // Change of the depth at RETURN
+        int64_t low = 0;
+        int64_t high = 0;
+        // Most cells above the call depth
+        int64_t peak = 0;
+
+        bool operator==(const FunctionSummary& other) const {
+            return returns == other.returns && need == other.need && low == other.low && high == other.high &&
+                   peak == other.peak;
+        }
+    };
+
+    // Finds the summary of the function starting at entry, given the summaries
+    // of the functions it calls, and appends their entries to callees. Returns
+    // false and fills the error on code that can never be verified.
+    bool SummarizeFunction(const DecodedProgram& program, uint32_t entry, bool main,
+                           const std::map<uint32_t, FunctionSummary>& summaries, FunctionSummary* summary,
+                           std::vector<uint32_t>* callees, Verification* result) {
+        const Instruction* code = program.Code();
+        uint32_t size = program.Size();
+        auto fail = [&](uint32_t index, const std::string& error) {
+            result->index = index;
+            result->error = error;
+            return false;
+        };
+
+        // The depth is a range over all paths reaching each command. A range
+        // still growing after a path as long as the program goes around a loop
+        // that pushes or pops every time.
+        struct Depth {
+            bool reached = false;
+            int64_t low = 0;
+            int64_t high = 0;
+            size_t low_length = 0;
+            size_t high_length = 0;
+        };
+        std::vector<Depth> depths(size);
+        std::vector<bool> queued(size, false);
+        std::deque<uint32_t> queue;
+        depths[entry].reached = true;
+        queue.push_back(entry);
+        queued[entry] = true;
+        *summary = FunctionSummary();
+
+        while (!queue.empty()) {
+            uint32_t index = queue.front();
+            queue.pop_front();
+            queued[index] = false;
+            const Instruction& instruction = code[index];
+            const Depth depth = depths[index];
+
+            size_t pops = 0;
+            size_t pushes = 0;
+            if (!StackEffect(instruction.command, &pops, &pushes)) {
+                return fail(index, std::string("unknown stack effect of ") + CommandName(instruction.command));
+            }
+            if (instruction.command == RET) {
+                return fail(index, "ret jumps to a computed position");
+            }
+            int64_t need = int64_t(pops) - depth.low;
+            const FunctionSummary* callee = nullptr;
+            if (instruction.command == CALL) {
+                callees->push_back(instruction.target);
+                auto it = summaries.find(instruction.target);
+                if (it == summaries.end()) {
+                    // Not summarized yet
+                    continue;
+                }
+                callee = &it->second;
+                need = callee->need - depth.low;
+                summary->peak = std::max(summary->peak, depth.high + callee->peak);
+            }
+            if (need > summary->need) {
+                if (main) {
+                    return fail(index, std::string(CommandName(instruction.command)) + " may underflow the stack");
+                }
+                summary->need = need;
+            }
+            if (callee && !callee->returns) {
+                // Its stack use counts even if it halts, but nothing comes back
+                continue;
+            }
+
+            Depth out;
+            out.reached = true;
+            int64_t change = int64_t(pushes) - int64_t(pops);
+            out.low = depth.low + change + (callee ? callee->low : 0);
+            out.high = depth.high + change + (callee ? callee->high : 0);
+            out.low_length = depth.low_length + 1;
+            out.high_length = depth.high_length + 1;
+            summary->peak = std::max(summary->peak, out.high);
+
+            std::vector<uint32_t> next;
+            switch (instruction.command) {
+                case HLT:
+                    break;
+                case RETURN:
+                    // From the entry point it is a fault the call stack reports
+                    if (!main) {
+                        summary->low = summary->returns ? std::min(summary->low, out.low) : out.low;
+                        summary->high = summary->returns ? std::max(summary->high, out.high) : out.high;
+                        summary->returns = true;
+                    }
+                    break;
+                case JMP:
+                case JEXEC:
+                    next.push_back(instruction.target);
+                    break;
+                default:
+                    if (IsJumpCommand(instruction.command) && instruction.command != CALL) {
+                        next.push_back(instruction.target);
+                    }
+                    if (index + 1 == size) {
+                        return fail(index, "runs past the end of the program");
+                    }
+                    next.push_back(index + 1);
+            }
+
+            for (uint32_t successor : next) {
+                Depth& target = depths[successor];
+                bool changed = !target.reached;
+                if (!target.reached) {
+                    target = out;
+                }
+                if (out.low < target.low) {
+                    target.low = out.low;
+                    target.low_length = out.low_length;
+                    changed = true;
+                }
+                if (out.high > target.high) {
+                    target.high = out.high;
+                    target.high_length = out.high_length;
+                    changed = true;
+                }
+                if (target.low_length >= size) {
+                    return fail(successor, std::string(CommandName(code[successor].command)) +
+                                           " may underflow the stack");
+                }
+                if (target.high_length >= size) {
+                    return fail(successor, "the stack depth is not bounded");
+                }
+                if (changed && !queued[successor]) {
+                    queue.push_back(successor);
+                    queued[successor] = true;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Checks a program run from its first command with an empty operand stack:
+    // every jump lands on a command, nothing runs past the end, no path pops
+    // more than it pushed, and the stack depth is bounded. A verified program
+    // can run on a FixedStack of max_stack cells without any stack checks.
+    //
+    // Every CALL target is summarized as a function, and calls apply the
+    // summary of their callee. Summaries start with nothing returning and are
+    // recomputed until they settle; recursion growing the stack keeps them
+    // changing, and then the depth is not bounded. RET jumps to a computed
+    // position, so programs reaching it are not verified.
+    Verification Verify(const DecodedProgram& program) {
+        Verification result;
+        const Instruction* code = program.Code();
+        uint32_t size = program.Size();
+        if (size == 0) {
+            result.index = 0;
+            result.error = "the program is empty";
+            return result;
+        }
+        for (uint32_t i = 0; i < size; ++i) {
+            if (IsJumpCommand(code[i].command) && code[i].target >= size) {
+                result.index = i;
+                result.error = "jump target " + std::to_string(code[i].target) + " is not a command";
+                return result;
+            }
+        }
+
+        std::map<uint32_t, FunctionSummary> summaries;
+        FunctionSummary main;
+        for (size_t round = 0;; ++round) {
+            std::vector<uint32_t> callees;
+            if (!SummarizeFunction(program, 0, true, summaries, &main, &callees, &result)) {
+                return result;
+            }
+            bool changed = false;
+            std::set<uint32_t> seen;
+            for (size_t i = 0; i < callees.size(); ++i) {
+                uint32_t entry = callees[i];
+                if (!seen.insert(entry).second) {
+                    continue;
+                }
+                FunctionSummary summary;
+                if (!SummarizeFunction(program, entry, false, summaries, &summary, &callees, &result)) {
+                    return result;
+                }
+                if (!(summaries[entry] == summary)) {
+                    summaries[entry] = summary;
+                    changed = true;
+                    // Without recursion growing the stack, a round adds at
+                    // most one more level of calls to any summary
+                    if (round > summaries.size() + 1) {
+                        result.index = entry;
+                        result.error = "the stack depth is not bounded";
+                        return result;
+                    }
+                }
+            }
+            if (!changed) {
+                break;
+            }
+        }
+        result.verified = true;
+        result.max_stack = main.peak;
+        return result;
+    }
+
+    using VerifiedCpu = BasicCpu<FixedStack>;
+} // namespace Cpu
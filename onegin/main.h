@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <cctype>
 #include <memory>
 #include <sys/stat.h>
 #include <vector>
@@ -30,8 +31,8 @@ std::unique_ptr<char[]> readFile(const char* filename) {
         err(1, "Failed to open file");
     }
     size_t fileSize = fread(fileBuffer.get(), 1, statbuf.st_size, file);
-    fclose(file);
-    if (ferror(file)) {
+    bool failed = ferror(file);
+    if (fclose(file) != 0 || failed) {
         err(1, "Error when reading/closing file");
     }
     fileBuffer[fileSize] = '\0';
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+// Unchecked growable stack with the same interface as Stack. It keeps no
+// guards or checksums, so Push and Pop are O(1) and only test the size.
+template <class T>
+class FastStack {
+    static constexpr size_t INITIAL_BUFFER_SIZE = 64;
+    static constexpr size_t BUFFER_GROW_COEFFICIENT = 2;
+
+public:
+    FastStack()
+        : buffer_size_(INITIAL_BUFFER_SIZE)
+        , size_(0)
+        , buffer_(new T[INITIAL_BUFFER_SIZE]) {
+    }
+
+    void Push(const T& value) {
+        if (size_ == buffer_size_) {
+            Reallocate(buffer_size_ * BUFFER_GROW_COEFFICIENT);
+        }
+        buffer_[size_++] = value;
+    }
+
+    bool Pop(T* result = nullptr) {
+        if (size_ == 0) {
+            return false;
+        }
+        --size_;
+        if (result) {
+            *result = buffer_[size_];
+        }
+        return true;
+    }
+
+    // The top element, or null if the stack is empty
+    const T* Top() const {
+        return size_ == 0 ? nullptr : &buffer_[size_ - 1];
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+private:
+    void Reallocate(size_t new_size) {
+        std::unique_ptr<T[]> buffer(new T[new_size]);
+        for (size_t i = 0; i < size_; ++i) {
+            buffer[i] = buffer_[i];
+        }
+        buffer_ = std::move(buffer);
+        buffer_size_ = new_size;
+    }
+
+    size_t buffer_size_;
+    size_t size_;
+    std::unique_ptr<T[]> buffer_;
+};
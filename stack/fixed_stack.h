@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+// Stack with the same interface as Stack over a buffer reserved up front.
+// Push and Pop do no checks at all, only asserts: it is meant for code that
+// is known not to underflow and not to go deeper than the reserved size,
+// such as a verified program.
+template <class T>
+class FixedStack {
+public:
+    FixedStack() : capacity_(0), size_(0) {
+    }
+
+    // Drops the elements and makes room for capacity of them
+    void Reserve(size_t capacity) {
+        buffer_.reset(new T[capacity]);
+        capacity_ = capacity;
+        size_ = 0;
+    }
+
+    void Push(const T& value) {
+        assert(size_ < capacity_);
+        buffer_[size_++] = value;
+    }
+
+    bool Pop(T* result = nullptr) {
+        assert(size_ > 0);
+        --size_;
+        if (result) {
+            *result = buffer_[size_];
+        }
+        return true;
+    }
+
+    // The top element, or null if the stack is empty
+    const T* Top() const {
+        return size_ == 0 ? nullptr : &buffer_[size_ - 1];
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    size_t Capacity() const {
+        return capacity_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+private:
+    size_t capacity_;
+    size_t size_;
+    std::unique_ptr<T[]> buffer_;
+};
@@ -3,7 +3,6 @@
 #include <cstdio>
 #include <memory>
 #include <typeinfo>
-#include <arpa/nameser.h>
 #include <assert.h>
 
 template <class T>
@@ -89,6 +88,11 @@ public:
         return true;
     }
 
+    const T* Top() const {
+        TRY_PANIC();
+        return size_ == 0 ? nullptr : &buffer_[size_ - 1];
+    }
+
     size_t Size() const {
         TRY_PANIC();
         return size_;
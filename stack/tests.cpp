@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 #include "stack.h"
+#include "fast_stack.h"
+#include "fixed_stack.h"
 
 TEST(StackBasic, CallTest) {
     Stack<int> s;
@@ -30,6 +32,55 @@ TEST(StackBasic, BigTest) {
     }
 }
 
+TEST(FastStack, CallTest) {
+    FastStack<int> s;
+    ASSERT_TRUE(s.Empty());
+    for (int i = 1; i < 10; ++i) {
+        s.Push(i);
+    }
+    ASSERT_EQ(s.Size(), 9u);
+    for (int i = 9; i > 0; --i) {
+        int r = -1;
+        ASSERT_TRUE(s.Pop(&r));
+        ASSERT_EQ(r, i);
+    }
+    int r = 0;
+    ASSERT_FALSE(s.Pop(&r));
+    ASSERT_EQ(r, 0);
+}
+
+TEST(FastStack, BigTest) {
+    FastStack<int> s;
+    int n = 1000000;
+    for (int i = 0; i < n; ++i) {
+        s.Push(i);
+    }
+    for (int i = n - 1; i >= 0; --i) {
+        int r = -1;
+        ASSERT_TRUE(s.Pop(&r));
+        ASSERT_EQ(r, i);
+    }
+    ASSERT_TRUE(s.Empty());
+}
+
+TEST(FixedStack, CallTest) {
+    FixedStack<int> s;
+    s.Reserve(9);
+    ASSERT_TRUE(s.Empty());
+    for (int i = 1; i < 10; ++i) {
+        s.Push(i);
+    }
+    ASSERT_EQ(s.Size(), s.Capacity());
+    ASSERT_EQ(*s.Top(), 9);
+    for (int i = 9; i > 0; --i) {
+        int r = -1;
+        ASSERT_TRUE(s.Pop(&r));
+        ASSERT_EQ(r, i);
+    }
+    ASSERT_TRUE(s.Empty());
+    ASSERT_EQ(s.Top(), nullptr);
+}
+
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();